@@ -0,0 +1,77 @@
+#ifndef AUDIODECODER_HPP
+#define AUDIODECODER_HPP
+
+#include <string>
+#include <stdexcept>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "Trace.hpp"
+
+namespace avio {
+
+// Decoder for the stream an AudioReader selected, flags2 takes AV_CODEC_FLAG2_*
+// options such as SKIP_MANUAL
+
+class AudioDecoder {
+public:
+    AVCodecContext* codec_ctx = nullptr;
+
+    AudioDecoder(const AVStream* stream, int flags2 = 0) {
+        const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+        if (!codec)
+            throw std::runtime_error("Decoder not found");
+
+        codec_ctx = avcodec_alloc_context3(codec);
+        if (!codec_ctx)
+            throw std::runtime_error("Failed to allocate decoder context");
+
+        if (avcodec_parameters_to_context(codec_ctx, stream->codecpar) < 0) {
+            avcodec_free_context(&codec_ctx);
+            throw std::runtime_error("Failed to copy codec parameters");
+        }
+        codec_ctx->pkt_timebase = stream->time_base;
+        codec_ctx->flags2 |= flags2;
+
+        if (avcodec_open2(codec_ctx, codec, nullptr) < 0) {
+            avcodec_free_context(&codec_ctx);
+            throw std::runtime_error("Failed to open codec");
+        }
+    }
+
+    ~AudioDecoder() {
+        if (codec_ctx) avcodec_free_context(&codec_ctx);
+    }
+
+    AudioDecoder(const AudioDecoder&) = delete;
+    AudioDecoder& operator=(const AudioDecoder&) = delete;
+
+    // nullptr starts draining the decoder at end of stream
+    int send(const AVPacket* pkt) {
+        AVIO_TRACE_SPAN("send");
+        return avcodec_send_packet(codec_ctx, pkt);
+    }
+
+    // 1 with a frame, 0 when more input is needed or the decoder is drained
+    int receive(AVFrame* frame) {
+        AVIO_TRACE_SPAN("decode");
+        int ret = avcodec_receive_frame(codec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        return ret < 0 ? ret : 1;
+    }
+
+    // drops buffered input and output, after a seek
+    void flush() { avcodec_flush_buffers(codec_ctx); }
+
+    int sampleRate() const { return codec_ctx->sample_rate; }
+    AVSampleFormat sampleFormat() const { return codec_ctx->sample_fmt; }
+    const AVChannelLayout* channelLayout() const { return &codec_ctx->ch_layout; }
+};
+
+}
+
+#endif // AUDIODECODER_HPP
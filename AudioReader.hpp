@@ -0,0 +1,151 @@
+#ifndef AUDIOREADER_HPP
+#define AUDIOREADER_HPP
+
+#include <string>
+#include <memory>
+#include <stdexcept>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+}
+
+#include "StreamInfoCache.hpp"
+#include "MappedInput.hpp"
+#include "Trace.hpp"
+
+namespace avio {
+
+// How AudioReader opens a file. The libavformat defaults probe up to 5 MB and
+// 5 s of data, which for some containers means demuxing and decoding seconds
+// of audio before the first sample plays. fast() bounds both, enough for the
+// audio files this player handles. With a cache, the stream info resolved on
+// the first open is stored and later opens of the unchanged file skip
+// avformat_find_stream_info entirely. mmap serves regular local files from a
+// MappedInput instead of the file protocol, other inputs ignore it. index
+// has Track scan the file for a PacketIndex in the background, it is stored
+// in the cache as well.
+
+struct OpenOptions {
+    int64_t probesize = 0;              // bytes, 0 keeps the libavformat default
+    int64_t analyzeduration_us = 0;     // 0 keeps the libavformat default
+    StreamInfoCache* cache = nullptr;
+    bool mmap = false;
+    bool index = false;                 // Track builds a PacketIndex for seeking
+
+    static OpenOptions fast(StreamInfoCache* cache = nullptr) {
+        OpenOptions options;
+        options.probesize = 64 * 1024;
+        options.analyzeduration_us = 100000;
+        options.cache = cache;
+        return options;
+    }
+};
+
+// Demuxes the best audio stream of a file. Unlike avio::Reader it needs
+// nothing but libavformat, so it runs in the headless benchmarks on Linux.
+
+class AudioReader {
+public:
+    AVFormatContext* fmt_ctx = nullptr;
+    AVStream* stream = nullptr;
+    int stream_index = -1;
+    std::string filename;
+    bool cache_hit = false;
+    // Set when the file is memory mapped. It owns fmt_ctx->pb, which
+    // avformat_close_input leaves alone with AVFMT_FLAG_CUSTOM_IO; the
+    // destructor body closes fmt_ctx before members are destroyed, so the
+    // AVIOContext outlives every use of it.
+    std::unique_ptr<MappedInput> input;
+
+    AudioReader(const std::string& filename, const OpenOptions& options = OpenOptions()) : filename(filename) {
+        AVDictionary* dict = nullptr;
+        if (options.probesize > 0)
+            av_dict_set_int(&dict, "probesize", options.probesize, 0);
+        if (options.analyzeduration_us > 0)
+            av_dict_set_int(&dict, "analyzeduration", options.analyzeduration_us, 0);
+        if (options.mmap && MappedInput::mappable(filename)) {
+            // mapping is an optimisation, the file protocol still opens the file
+            try {
+                input.reset(new MappedInput(filename));
+            }
+            catch (const std::exception&) {
+                input.reset();
+            }
+        }
+        if (input) {
+            fmt_ctx = avformat_alloc_context();
+            if (!fmt_ctx) {
+                av_dict_free(&dict);
+                throw std::runtime_error("Failed to allocate format context");
+            }
+            fmt_ctx->pb = input->ctx;
+            fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        }
+        int ret = avformat_open_input(&fmt_ctx, filename.c_str(), nullptr, &dict);
+        av_dict_free(&dict);
+        if (ret < 0) {
+            // avformat_open_input frees a user supplied context on failure
+            fmt_ctx = nullptr;
+            throw std::runtime_error("Failed to open input file " + filename);
+        }
+
+        // the destructor does not run when the constructor throws
+        try {
+            StreamInfo info;
+            if (options.cache && options.cache->load(filename, info) && info.apply(fmt_ctx)) {
+                stream_index = info.stream_index;
+                cache_hit = true;
+            }
+            else {
+                if (avformat_find_stream_info(fmt_ctx, nullptr) < 0)
+                    throw std::runtime_error("Failed to find stream info " + filename);
+
+                stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+                if (stream_index < 0)
+                    throw std::runtime_error("Failed to find audio stream " + filename);
+                if (options.cache && info.capture(fmt_ctx, stream_index))
+                    options.cache->store(filename, info);
+            }
+            stream = fmt_ctx->streams[stream_index];
+        }
+        catch (...) {
+            avformat_close_input(&fmt_ctx);
+            throw;
+        }
+    }
+
+    ~AudioReader() {
+        if (fmt_ctx) avformat_close_input(&fmt_ctx);
+    }
+
+    AudioReader(const AudioReader&) = delete;
+    AudioReader& operator=(const AudioReader&) = delete;
+
+    // next packet of the audio stream, returns 0 at end of file or a negative AVERROR
+    int read(AVPacket* pkt) {
+        AVIO_TRACE_SPAN("read");
+        while (true) {
+            int ret = av_read_frame(fmt_ctx, pkt);
+            if (ret == AVERROR_EOF)
+                return 0;
+            if (ret < 0)
+                return ret;
+            if (pkt->stream_index == stream_index)
+                return 1;
+            av_packet_unref(pkt);
+        }
+    }
+
+    double duration() const {
+        if (stream->duration != AV_NOPTS_VALUE)
+            return stream->duration * av_q2d(stream->time_base);
+        if (fmt_ctx->duration != AV_NOPTS_VALUE)
+            return (double)fmt_ctx->duration / AV_TIME_BASE;
+        return 0;
+    }
+};
+
+}
+
+#endif // AUDIOREADER_HPP
@@ -0,0 +1,182 @@
+#ifndef AUDIOSINK_HPP
+#define AUDIOSINK_HPP
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "PcmRing.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+namespace avio {
+
+// One reading of a device clock: frames played since start, frames written
+// and not played yet (the padding), and the steady_clock time of the reading
+// in microseconds. PlaybackClock extrapolates between readings.
+
+struct DevicePosition {
+    uint64_t played = 0;
+    int queued = 0;
+    int64_t time_us = 0;
+};
+
+inline int64_t steadyTimeUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Portable view of a render device: a buffer of bufferFrames() sample frames
+// of which available() may currently be written through getBuffer/releaseBuffer.
+// Sinks that can signal the end of each device period return true from
+// eventDriven() and block in waitPeriod(), the others are polled. Sinks that
+// know where playback is return it from devicePosition().
+// WinAudio implements it on top of WASAPI, NullSink stands in for benchmarks.
+
+class AudioSink {
+public:
+    virtual ~AudioSink() { }
+
+    virtual int sampleRate() const = 0;
+    virtual int channels() const = 0;
+    virtual int blockAlign() const = 0;
+    virtual int bufferFrames() const = 0;
+    virtual int periodFrames() const { return bufferFrames(); }
+
+    virtual bool eventDriven() const { return false; }
+    virtual bool waitPeriod(int timeout_ms) { return false; }
+
+    // begin playback once the first audio has been queued
+    virtual void start() { }
+
+    // false when the sink has no clock to read
+    virtual bool devicePosition(DevicePosition& position) { return false; }
+
+    virtual int available() = 0;
+    virtual uint8_t* getBuffer(int frames) = 0;
+    virtual void releaseBuffer(int frames) = 0;
+
+protected:
+    // device sinks call this from releaseBuffer
+    static void rendered(int frames) {
+        Metrics& metrics = Metrics::instance();
+        metrics.frames_rendered.add(frames);
+        metrics.device_calls.add();
+        metrics.write_size.record(frames);
+    }
+};
+
+// Accepts everything immediately and throws the samples away
+
+class NullSink : public AudioSink {
+public:
+    NullSink(int sample_rate, int channels, int bytes_per_sample, int buffer_frames) :
+        sample_rate(sample_rate),
+        num_channels(channels),
+        block_align(channels * bytes_per_sample),
+        buffer_frames(buffer_frames),
+        buffer((size_t)buffer_frames * channels * bytes_per_sample)
+    { }
+
+    int sampleRate() const override { return sample_rate; }
+    int channels() const override { return num_channels; }
+    int blockAlign() const override { return block_align; }
+    int bufferFrames() const override { return buffer_frames; }
+
+    int available() override {
+        device_calls++;
+        return buffer_frames;
+    }
+
+    uint8_t* getBuffer(int frames) override {
+        device_calls++;
+        return buffer.data();
+    }
+
+    void releaseBuffer(int frames) override {
+        device_calls++;
+        frames_rendered += frames;
+        rendered(frames);
+    }
+
+    // everything written counts as played the moment it was accepted
+    bool devicePosition(DevicePosition& position) override {
+        position.played = frames_rendered;
+        position.queued = 0;
+        position.time_us = steadyTimeUs();
+        return true;
+    }
+
+    uint64_t frames_rendered = 0;
+    uint64_t device_calls = 0;      // available, getBuffer and releaseBuffer
+
+private:
+    int sample_rate;
+    int num_channels;
+    int block_align;
+    int buffer_frames;
+    std::vector<uint8_t> buffer;
+};
+
+// Move up to space frames from the ring into the sink, returns frames written.
+// One getBuffer/releaseBuffer round per call, when the ring wraps the second
+// region is copied into the same device buffer. Never blocks, the caller
+// decides how to wait when nothing could be written.
+
+inline int renderFromRing(AudioSink* sink, PcmRing* ring, int space) {
+    int total = (std::min)(space, ring->readable());
+    if (total <= 0) return 0;
+    AVIO_TRACE_SPAN("render");
+    uint8_t* dst = sink->getBuffer(total);
+    if (!dst) return 0;
+    int written = 0;
+    while (written < total) {
+        int count = 0;
+        const uint8_t* src = ring->readRegion(&count);
+        count = (std::min)(count, total - written);
+        memcpy(dst + (size_t)written * sink->blockAlign(), src, (size_t)count * sink->blockAlign());
+        ring->commitRead(count);
+        written += count;
+    }
+    sink->releaseBuffer(total);
+    return total;
+}
+
+inline int renderFromRing(AudioSink* sink, PcmRing* ring) {
+    return renderFromRing(sink, ring, sink->available());
+}
+
+// The producer side of a PcmRing seen as a sink, so a converter can write
+// straight into the ring. available() is the contiguous free region.
+
+class RingSink : public AudioSink {
+public:
+    RingSink(PcmRing* ring, int sample_rate, int channels) :
+        ring(ring), sample_rate(sample_rate), num_channels(channels) { }
+
+    int sampleRate() const override { return sample_rate; }
+    int channels() const override { return num_channels; }
+    int blockAlign() const override { return ring->blockAlign(); }
+    int bufferFrames() const override { return ring->size(); }
+
+    int available() override {
+        int frames = 0;
+        region = ring->writeRegion(&frames);
+        return frames;
+    }
+
+    uint8_t* getBuffer(int frames) override { return region; }
+    void releaseBuffer(int frames) override { ring->commitWrite(frames); }
+
+private:
+    PcmRing* ring;
+    int sample_rate;
+    int num_channels;
+    uint8_t* region = nullptr;
+};
+
+}
+
+#endif // AUDIOSINK_HPP
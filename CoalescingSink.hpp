@@ -0,0 +1,91 @@
+#ifndef COALESCINGSINK_HPP
+#define COALESCINGSINK_HPP
+
+#include <cstdint>
+#include <algorithm>
+
+#include "AudioSink.hpp"
+
+namespace avio {
+
+// Sits between the converter and a device sink and turns writes of any size
+// into period sized device writes. A period of the device buffer is acquired
+// once and filled by as many writes as it takes, decoded frames larger than
+// the remainder are split at the period boundary, so the device sees one
+// available/getBuffer/releaseBuffer round per period whatever the codec frame
+// size. Call flush() at the end of the stream to hand over a partial period.
+//
+// The device has to accept a whole period at once, sinks with a wrapping
+// write region like RingSink are not suitable.
+
+class CoalescingSink : public AudioSink {
+public:
+    uint64_t periods = 0;
+
+    CoalescingSink(AudioSink* device, int period_frames = 0) :
+        device(device),
+        period((std::max)(1, (std::min)(device->bufferFrames(),
+               period_frames > 0 ? period_frames : device->periodFrames())))
+    { }
+
+    CoalescingSink(const CoalescingSink&) = delete;
+    CoalescingSink& operator=(const CoalescingSink&) = delete;
+
+    int sampleRate() const override { return device->sampleRate(); }
+    int channels() const override { return device->channels(); }
+    int blockAlign() const override { return device->blockAlign(); }
+    int bufferFrames() const override { return device->bufferFrames(); }
+    int periodFrames() const override { return period; }
+
+    bool eventDriven() const override { return device->eventDriven(); }
+    bool waitPeriod(int timeout_ms) override { return device->waitPeriod(timeout_ms); }
+    void start() override { device->start(); }
+    bool devicePosition(DevicePosition& position) override { return device->devicePosition(position); }
+
+    // 0 while the device has no room for another period
+    int available() override {
+        if (!region) {
+            if (device->available() < period)
+                return 0;
+            region = device->getBuffer(period);
+            if (!region)
+                return 0;
+        }
+        return period - fill;
+    }
+
+    uint8_t* getBuffer(int frames) override {
+        return region ? region + (size_t)fill * device->blockAlign() : nullptr;
+    }
+
+    void releaseBuffer(int frames) override {
+        fill += frames;
+        if (fill >= period)
+            submit();
+    }
+
+    // frames written but not yet handed to the device
+    int pending() const { return fill; }
+
+    void flush() {
+        if (region)
+            submit();
+    }
+
+private:
+    AudioSink* device;
+    int period;
+    int fill = 0;
+    uint8_t* region = nullptr;
+
+    void submit() {
+        device->releaseBuffer(fill);
+        region = nullptr;
+        fill = 0;
+        periods++;
+    }
+};
+
+}
+
+#endif // COALESCINGSINK_HPP
@@ -0,0 +1,81 @@
+#ifndef LATENCYCONTROLLER_HPP
+#define LATENCYCONTROLLER_HPP
+
+#include <cstdint>
+#include <algorithm>
+
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+namespace avio {
+
+// Decides how many frames the render thread keeps queued in the device.
+// Starts at the configured latency (clamped to 10 - 200 ms), grows by a period
+// whenever the device ran dry or the producer could not keep up, and after
+// stable_periods quiet wakeups shrinks back toward the configured latency.
+
+class LatencyController {
+public:
+    static const int MIN_LATENCY_MS = 10;
+    static const int MAX_LATENCY_MS = 200;
+
+    int stable_periods = 500;
+
+    uint64_t underruns = 0;
+    uint64_t starvations = 0;
+    uint64_t grows = 0;
+    uint64_t shrinks = 0;
+
+    LatencyController(int sample_rate, int period_frames, int buffer_frames, int latency_ms) :
+        period_frames((std::max)(1, period_frames)),
+        max_target(buffer_frames)
+    {
+        latency_ms = clampLatency(latency_ms);
+        min_target = (std::min)(max_target, (int)((int64_t)sample_rate * latency_ms / 1000));
+        fill_target = min_target;
+    }
+
+    static int clampLatency(int latency_ms) {
+        return (std::max)(MIN_LATENCY_MS, (std::min)(MAX_LATENCY_MS, latency_ms));
+    }
+
+    int target() const { return fill_target; }
+
+    // once per render wakeup after the device started, padding is the fill level
+    // seen on waking, starved means the ring could not supply the requested frames
+    void observe(int padding, bool starved) {
+        Metrics::instance().device_padding.record(padding);
+        AVIO_TRACE_COUNTER("device padding", padding);
+        if (padding == 0 || starved) {
+            if (padding == 0) {
+                underruns++;
+                Metrics::instance().underruns.add();
+                AVIO_TRACE_INSTANT("underrun");
+            }
+            if (starved) starvations++;
+            quiet = 0;
+            if (fill_target < max_target) {
+                fill_target = (std::min)(max_target, fill_target + period_frames);
+                grows++;
+            }
+            return;
+        }
+
+        if (++quiet >= stable_periods && fill_target > min_target) {
+            fill_target = (std::max)(min_target, fill_target - (std::max)(1, period_frames / 4));
+            shrinks++;
+            quiet = 0;
+        }
+    }
+
+private:
+    int period_frames;
+    int max_target;
+    int min_target;
+    int fill_target;
+    int quiet = 0;
+};
+
+}
+
+#endif // LATENCYCONTROLLER_HPP
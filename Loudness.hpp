@@ -0,0 +1,479 @@
+#ifndef LOUDNESS_HPP
+#define LOUDNESS_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+#include "AudioSink.hpp"
+#include "SwrRender.hpp"
+#include "Playlist.hpp"
+#include "PacketIndex.hpp"
+#include "WorkerPool.hpp"
+
+namespace avio {
+
+// Loudness of a whole file after merging its segments, ITU-R BS.1770-4 /
+// EBU R128 integrated loudness and true peak, ReplayGain 2.0 from those
+struct Loudness {
+    static constexpr double REFERENCE_LUFS = -18.0;
+
+    double integrated = -HUGE_VAL;  // LUFS, -inf when every block is gated away
+    double true_peak = 0;           // linear, 4x oversampled below 96 kHz
+    double sample_peak = 0;         // linear
+    int64_t samples = 0;            // measured, per channel
+    int sample_rate = 0;
+
+    double truePeakDb() const { return 20.0 * std::log10(true_peak); }
+
+    // gain to the -18 LUFS reference, 0 for silence
+    double replayGain() const { return std::isfinite(integrated) ? REFERENCE_LUFS - integrated : 0.0; }
+};
+
+// Measures a run of interleaved float audio starting at sample position.
+// Samples before start only settle the K-weighting filters and the true peak
+// interpolator, from start on the weighted energy is summed per 100 ms
+// sub-block of the file, counted from sample 0, and the peaks are tracked.
+// Meters of consecutive runs that start on sub-block boundaries merge into
+// the meter of the whole file, the 400 ms gating blocks overlap 75% and are
+// only formed from the merged sub-blocks in result().
+
+class LoudnessMeter {
+public:
+    int sample_rate;
+    int channels;
+    int sub_block;                  // frames per 100 ms
+    int64_t start;
+    int64_t position;               // sample of the next input
+    std::vector<double> energy;     // weighted sum of squares per full sub-block
+    double sample_peak = 0;
+    double true_peak = 0;
+
+    LoudnessMeter(int sample_rate, int channels, int64_t start = 0, int64_t position = 0) :
+        sample_rate(sample_rate),
+        channels(channels),
+        sub_block((std::max)(1, sample_rate / 10)),
+        start(start),
+        position((std::min)(position, start)),
+        weights(channels, 1.0),
+        state((size_t)channels * 4, 0.0)
+    {
+        if (sample_rate <= 0 || channels <= 0)
+            throw std::runtime_error("Invalid format for loudness measurement");
+        designFilters();
+        designInterpolator();
+
+        // BS.1770 weights by position: LFE is left out, the surround pair counts +1.5 dB
+        AVChannelLayout layout;
+        av_channel_layout_default(&layout, channels);
+        for (int c = 0; c < channels; c++) {
+            AVChannel channel = av_channel_layout_channel_from_index(&layout, c);
+            if (channel == AV_CHAN_LOW_FREQUENCY || channel == AV_CHAN_LOW_FREQUENCY_2)
+                weights[c] = 0.0;
+            else if (channel == AV_CHAN_SIDE_LEFT || channel == AV_CHAN_SIDE_RIGHT
+                     || channel == AV_CHAN_BACK_LEFT || channel == AV_CHAN_BACK_RIGHT)
+                weights[c] = 1.41;
+        }
+        av_channel_layout_uninit(&layout);
+    }
+
+    void process(const float* in, int frames) {
+        for (int f = 0; f < frames; f++, in += channels) {
+            bool measured = position >= start;
+            for (int c = 0; c < channels; c++) {
+                double x = in[c];
+                double* z = &state[(size_t)c * 4];
+                // two biquads in transposed direct form II, the shelf then the high pass
+                double y = shelf[0] * x + z[0];
+                z[0] = shelf[1] * x - shelf[3] * y + z[1];
+                z[1] = shelf[2] * x - shelf[4] * y;
+                double k = y + z[2];
+                z[2] = -2.0 * y - highpass[3] * k + z[3];
+                z[3] = y - highpass[4] * k;
+
+                float peak = interpolate(c, in[c]);
+                if (measured) {
+                    block_energy += weights[c] * k * k;
+                    sample_peak = (std::max)(sample_peak, (double)std::fabs(in[c]));
+                    true_peak = (std::max)(true_peak, (double)peak);
+                }
+            }
+            position++;
+            if (measured && ++block_fill == sub_block) {
+                energy.push_back(block_energy);
+                block_energy = 0;
+                block_fill = 0;
+            }
+        }
+    }
+
+    // Appends the meter of the run that follows this one. False, leaving this
+    // meter as it was, when next does not start where this one ended.
+    bool merge(const LoudnessMeter& next) {
+        if (next.sample_rate != sample_rate || next.channels != channels || block_fill
+            || next.start != start + (int64_t)energy.size() * sub_block)
+        {
+            return false;
+        }
+        energy.insert(energy.end(), next.energy.begin(), next.energy.end());
+        block_energy = next.block_energy;
+        block_fill = next.block_fill;
+        position = next.position;
+        sample_peak = (std::max)(sample_peak, next.sample_peak);
+        true_peak = (std::max)(true_peak, next.true_peak);
+        return true;
+    }
+
+    Loudness result() const {
+        Loudness loudness;
+        loudness.samples = (int64_t)energy.size() * sub_block + block_fill;
+        loudness.sample_rate = sample_rate;
+        loudness.sample_peak = sample_peak;
+        loudness.true_peak = (std::max)(true_peak, sample_peak);
+
+        // mean square of every 400 ms block, absolute gate at -70 LUFS, then
+        // the relative gate 10 LU below the loudness of what passed it
+        std::vector<double> blocks;
+        for (size_t i = 0; i + 4 <= energy.size(); i++) {
+            double z = (energy[i] + energy[i + 1] + energy[i + 2] + energy[i + 3]) / (4.0 * sub_block);
+            if (lufs(z) > -70.0)
+                blocks.push_back(z);
+        }
+        if (blocks.empty())
+            return loudness;
+        double sum = 0;
+        for (double z : blocks)
+            sum += z;
+        double relative = lufs(sum / blocks.size()) - 10.0;
+        double gated = 0;
+        size_t count = 0;
+        for (double z : blocks) {
+            if (lufs(z) > relative) {
+                gated += z;
+                count++;
+            }
+        }
+        if (count)
+            loudness.integrated = lufs(gated / count);
+        return loudness;
+    }
+
+    static double lufs(double mean_square) { return -0.691 + 10.0 * std::log10(mean_square); }
+
+private:
+    static const int TAPS = 49;     // interpolation filter over all phases
+
+    std::vector<double> weights;
+    std::vector<double> state;      // z1, z2 of both biquads per channel
+    double shelf[5];                // b0 b1 b2 a1 a2, a0 normalized to 1
+    double highpass[5];
+    double block_energy = 0;
+    int block_fill = 0;
+
+    int factor = 1;                 // oversampling of the true peak
+    int phase_taps = 1;
+    std::vector<float> phases;      // factor rows of phase_taps coefficients
+    std::vector<float> history;     // per channel, written twice so one window is contiguous
+    int history_pos = 0;
+
+    // the BS.1770 pre-filter and RLB high pass for any rate, as derived in
+    // libebur128 from the 48 kHz coefficients of the standard
+    void designFilters() {
+        const double pi = 3.14159265358979323846;
+        double f0 = 1681.974450955533;
+        double gain_db = 3.999843853973347;
+        double q = 0.7071752369554196;
+        double k = std::tan(pi * f0 / sample_rate);
+        double vh = std::pow(10.0, gain_db / 20.0);
+        double vb = std::pow(vh, 0.4996667741545416);
+        double a0 = 1.0 + k / q + k * k;
+        shelf[0] = (vh + vb * k / q + k * k) / a0;
+        shelf[1] = 2.0 * (k * k - vh) / a0;
+        shelf[2] = (vh - vb * k / q + k * k) / a0;
+        shelf[3] = 2.0 * (k * k - 1.0) / a0;
+        shelf[4] = (1.0 - k / q + k * k) / a0;
+
+        f0 = 38.13547087602444;
+        q = 0.5003270373238773;
+        k = std::tan(pi * f0 / sample_rate);
+        a0 = 1.0 + k / q + k * k;
+        highpass[0] = 1.0;
+        highpass[1] = -2.0;
+        highpass[2] = 1.0;
+        highpass[3] = 2.0 * (k * k - 1.0) / a0;
+        highpass[4] = (1.0 - k / q + k * k) / a0;
+    }
+
+    // Hann windowed sinc split into polyphase rows, 4x below 96 kHz, 2x below
+    // 192 kHz, the sample peak above
+    void designInterpolator() {
+        const double pi = 3.14159265358979323846;
+        factor = sample_rate < 96000 ? 4 : (sample_rate < 192000 ? 2 : 1);
+        if (factor == 1)
+            return;
+        phase_taps = (TAPS + factor - 1) / factor;
+        phases.assign((size_t)factor * phase_taps, 0.0f);
+        for (int j = 0; j < TAPS; j++) {
+            double m = j - (TAPS - 1) / 2.0;
+            double c = std::fabs(m) > 1e-6 ? std::sin(m * pi / factor) / (m * pi / factor) : 1.0;
+            c *= 0.5 * (1.0 - std::cos(2.0 * pi * j / (TAPS - 1)));
+            phases[(size_t)(j % factor) * phase_taps + j / factor] = (float)c;
+        }
+        history.assign((size_t)channels * phase_taps * 2, 0.0f);
+    }
+
+    // largest interpolated magnitude between the previous sample and x
+    float interpolate(int channel, float x) {
+        if (factor == 1)
+            return std::fabs(x);
+        float* h = &history[(size_t)channel * phase_taps * 2];
+        h[history_pos] = x;
+        h[history_pos + phase_taps] = x;
+        // the write position moves backwards, so w[k] is x[n - k]
+        const float* w = h + history_pos;
+        float peak = 0;
+        for (int p = 0; p < factor; p++) {
+            const float* coef = &phases[(size_t)p * phase_taps];
+            float y = 0;
+            for (int k = 0; k < phase_taps; k++)
+                y += coef[k] * w[k];
+            peak = (std::max)(peak, std::fabs(y));
+        }
+        if (channel == channels - 1)
+            history_pos = history_pos ? history_pos - 1 : phase_taps - 1;
+        return peak;
+    }
+};
+
+// The converter output of a segment fed straight into its meter, samples from
+// end on are dropped
+
+class MeterSink : public AudioSink {
+public:
+    static const int FRAMES = 4096;
+
+    MeterSink(LoudnessMeter* meter, int64_t end) :
+        meter(meter), end(end), buffer((size_t)FRAMES * meter->channels) { }
+
+    int sampleRate() const override { return meter->sample_rate; }
+    int channels() const override { return meter->channels; }
+    int blockAlign() const override { return meter->channels * (int)sizeof(float); }
+    int bufferFrames() const override { return FRAMES; }
+
+    int available() override { return FRAMES; }
+    uint8_t* getBuffer(int frames) override { return (uint8_t*)buffer.data(); }
+
+    void releaseBuffer(int frames) override {
+        int64_t room = (std::max)(end - meter->position, (int64_t)0);
+        meter->process(buffer.data(), (int)(std::min)((int64_t)frames, room));
+    }
+
+    bool done() const { return meter->position >= end; }
+
+private:
+    LoudnessMeter* meter;
+    int64_t end;
+    std::vector<float> buffer;
+};
+
+// Offline loudness analysis of many files on a WorkerPool. The job of a file
+// opens it, builds its PacketIndex and cuts it into segment_ms segments on
+// sub-block boundaries, posts all but the first segment and measures the
+// first one itself on the track it already has open. The other segments are
+// stolen by idle workers; each opens its own Track on the shared index, seeks
+// sample exact to preroll_ms before its start to settle the filters and
+// measures up to the next segment. The last segment of a file to finish
+// merges the meters in order. Files whose index cannot be built are measured
+// in one piece.
+
+class LoudnessScanner {
+public:
+    struct Result {
+        std::string file;
+        Loudness loudness;
+        int segments = 0;
+        std::string error;
+    };
+
+    int segment_ms = 10000;
+    int preroll_ms = 500;
+    OpenOptions options;
+
+    LoudnessScanner(WorkerPool* pool) : pool(pool) { }
+
+    // runs every file on the pool and blocks until the pool is idle
+    std::vector<Result> scan(const std::vector<std::string>& files) {
+        std::vector<std::unique_ptr<File>> jobs;
+        for (const std::string& path : files) {
+            jobs.emplace_back(new File());
+            File* file = jobs.back().get();
+            file->result.file = path;
+            pool->post([this, file] { open(file); });
+        }
+        pool->drain();
+
+        std::vector<Result> results;
+        for (const std::unique_ptr<File>& file : jobs)
+            results.push_back(file->result);
+        return results;
+    }
+
+    // the whole file front to back on the calling thread, the reference
+    static Result analyze(const std::string& path, const OpenOptions& options = OpenOptions()) {
+        Result result;
+        result.file = path;
+        result.segments = 1;
+        try {
+            Track track(path, options);
+            LoudnessMeter meter(track.decoder.sampleRate(), track.decoder.channelLayout()->nb_channels);
+            measure(track, meter, INT64_MAX);
+            result.loudness = meter.result();
+        }
+        catch (const std::exception& e) {
+            result.error = e.what();
+        }
+        return result;
+    }
+
+private:
+    struct Segment {
+        int64_t start = 0;
+        int64_t end = INT64_MAX;
+        std::unique_ptr<LoudnessMeter> meter;
+        std::string error;
+    };
+
+    struct File {
+        PacketIndex index;
+        std::vector<Segment> segments;
+        std::atomic<int> remaining{ 0 };
+        Result result;
+    };
+
+    WorkerPool* pool;
+
+    // decodes from the current position of track into meter until end or the
+    // end of the file, throws on errors
+    static void measure(Track& track, LoudnessMeter& meter, int64_t end) {
+        MeterSink sink(&meter, end);
+        SwrRender render(nullptr, &sink, AV_SAMPLE_FMT_FLT, 0);
+        auto wait = [] {};
+        AVFrame* frame = av_frame_alloc();
+        int ret = 0;
+        while (!sink.done() && (ret = track.read(frame)) > 0) {
+            if ((ret = render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait)) < 0)
+                break;
+            render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+        }
+        if (ret == 0 && !sink.done())
+            render.render(nullptr, 0, wait);
+        av_frame_free(&frame);
+        if (ret < 0)
+            throw std::runtime_error("decode error");
+    }
+
+    void open(File* file) {
+        std::unique_ptr<Track> track;
+        try {
+            track.reset(new Track(file->result.file, options));
+        }
+        catch (const std::exception& e) {
+            file->result.error = e.what();
+            return;
+        }
+
+        int64_t sub_block = (std::max)(1, track->decoder.sampleRate() / 10);
+        int64_t length = (std::max)(1, segment_ms / 100) * sub_block;
+        int64_t total = track->nominalSamples();
+        int count = total > length ? (int)((total + length - 1) / length) : 1;
+        // segments start at seeks, which are only sample exact with an index
+        if (count > 1 && !buildIndex(file, track->reader.stream_index))
+            count = 1;
+
+        file->segments.resize(count);
+        for (int i = 0; i < count; i++) {
+            file->segments[i].start = i * length;
+            file->segments[i].end = i + 1 < count ? (i + 1) * length : INT64_MAX;
+        }
+        file->remaining = count;
+        // posted last to first, the nearest segment runs next on this worker
+        for (int i = count - 1; i > 0; i--)
+            pool->post([this, file, i] { runSegment(file, i, nullptr); });
+        runSegment(file, 0, std::move(track));
+    }
+
+    bool buildIndex(File* file, int stream_index) {
+        const std::string& path = file->result.file;
+        if (options.cache && file->index.load(*options.cache, path) && file->index.stream_index == stream_index)
+            return true;
+        OpenOptions scan_options = options;
+        scan_options.cache = nullptr;
+        if (!file->index.scan(path, stream_index, scan_options, 100))
+            return false;
+        if (options.cache)
+            file->index.save(*options.cache, path);
+        return true;
+    }
+
+    void runSegment(File* file, int index, std::unique_ptr<Track> track) {
+        Segment& segment = file->segments[index];
+        try {
+            if (!track) {
+                track.reset(new Track(file->result.file, options));
+                track->shared_index = &file->index;
+            }
+            int rate = track->decoder.sampleRate();
+            int64_t from = (std::max)(segment.start - (int64_t)rate * preroll_ms / 1000, (int64_t)0);
+            if (from > 0 && track->seek(from) < 0)
+                throw std::runtime_error("seek failed");
+            segment.meter.reset(new LoudnessMeter(rate, track->decoder.channelLayout()->nb_channels, segment.start, from));
+            measure(*track, *segment.meter, segment.end);
+        }
+        catch (const std::exception& e) {
+            segment.error = e.what();
+        }
+        if (file->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            finish(file);
+    }
+
+    // segments past the real end of the file (shorter than declared) measured
+    // nothing and are skipped, anything else has to line up
+    static void finish(File* file) {
+        Result& result = file->result;
+        result.segments = (int)file->segments.size();
+        std::unique_ptr<LoudnessMeter> meter;
+        for (Segment& segment : file->segments) {
+            if (!segment.error.empty()) {
+                result.error = segment.error;
+                return;
+            }
+            if (!meter) {
+                meter = std::move(segment.meter);
+                continue;
+            }
+            if (segment.meter->position <= segment.meter->start)
+                continue;
+            if (!meter->merge(*segment.meter)) {
+                result.error = "segments do not line up";
+                return;
+            }
+        }
+        result.loudness = meter->result();
+    }
+};
+
+}
+
+#endif // LOUDNESS_HPP
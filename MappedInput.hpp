@@ -0,0 +1,189 @@
+#ifndef MAPPEDINPUT_HPP
+#define MAPPEDINPUT_HPP
+
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+}
+
+namespace avio {
+
+// A local file mapped into memory and served to libavformat through a custom
+// AVIOContext. The read callback is a memcpy out of the mapping, pages come in
+// through the kernel read-ahead instead of a read() per buffer refill on the
+// reader thread. The mapping is advised sequential and the next window is
+// requested ahead of the read position, after a seek from the new position.
+// Only regular files can be mapped, check mappable() first, everything else
+// (pipes, devices, network URLs) keeps the buffered file protocol.
+
+class MappedInput {
+public:
+    AVIOContext* ctx = nullptr;
+    uint64_t advise_calls = 0;      // madvise / prefetch requests issued
+
+    static const int BUFFER_SIZE = 64 * 1024;
+    static const int64_t WINDOW = 2 * 1024 * 1024;
+
+    static bool mappable(const std::string& path) {
+        struct stat st;
+        return !stat(path.c_str(), &st) && (st.st_mode & S_IFMT) == S_IFREG && st.st_size > 0;
+    }
+
+    MappedInput(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER file_size;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size) || !file_size.QuadPart) {
+            close();
+            throw std::runtime_error("Failed to open " + path);
+        }
+        size = file_size.QuadPart;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+            data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) || st.st_size <= 0) {
+            close();
+            throw std::runtime_error("Failed to open " + path);
+        }
+        size = st.st_size;
+        void* addr = mmap(nullptr, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            data = (const uint8_t*)addr;
+            madvise(addr, (size_t)size, MADV_SEQUENTIAL);
+            advise_calls++;
+        }
+#endif
+        if (!data) {
+            close();
+            throw std::runtime_error("Failed to map " + path);
+        }
+        readAhead();
+
+        uint8_t* buffer = (uint8_t*)av_malloc(BUFFER_SIZE);
+        if (buffer)
+            ctx = avio_alloc_context(buffer, BUFFER_SIZE, 0, this, &MappedInput::read, nullptr, &MappedInput::seek);
+        if (!ctx) {
+            av_free(buffer);
+            close();
+            throw std::runtime_error("Failed to allocate AVIOContext");
+        }
+    }
+
+    // the AVFormatContext using ctx has to be closed first
+    ~MappedInput() {
+        if (ctx) {
+            av_freep(&ctx->buffer);
+            avio_context_free(&ctx);
+        }
+        close();
+    }
+
+    MappedInput(const MappedInput&) = delete;
+    MappedInput& operator=(const MappedInput&) = delete;
+
+    int64_t fileSize() const { return size; }
+
+private:
+    const uint8_t* data = nullptr;
+    int64_t size = 0;
+    int64_t pos = 0;
+    int64_t advised = 0;            // end of the window requested so far
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    void close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap((void*)data, (size_t)size);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        data = nullptr;
+    }
+
+    // keeps one window requested ahead of pos, one call per window
+    void readAhead() {
+        if (pos + WINDOW / 2 < advised || advised >= size)
+            return;
+        int64_t start = (std::max)(advised, pos);
+        int64_t end = (std::min)(size, pos + WINDOW);
+        if (end <= start)
+            return;
+#ifdef _WIN32
+        WIN32_MEMORY_RANGE_ENTRY range{ (PVOID)(data + start), (SIZE_T)(end - start) };
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+        // madvise wants a page aligned start
+        int64_t page = sysconf(_SC_PAGESIZE);
+        int64_t aligned = start / page * page;
+        madvise((void*)(data + aligned), (size_t)(end - aligned), MADV_WILLNEED);
+#endif
+        advise_calls++;
+        advised = end;
+    }
+
+    static int read(void* opaque, uint8_t* buf, int buf_size) {
+        MappedInput* in = (MappedInput*)opaque;
+        if (in->pos >= in->size)
+            return AVERROR_EOF;
+        int count = (int)(std::min)((int64_t)buf_size, in->size - in->pos);
+        memcpy(buf, in->data + in->pos, count);
+        in->pos += count;
+        in->readAhead();
+        return count;
+    }
+
+    static int64_t seek(void* opaque, int64_t offset, int whence) {
+        MappedInput* in = (MappedInput*)opaque;
+        int64_t target;
+        switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE: return in->size;
+        case SEEK_SET: target = offset; break;
+        case SEEK_CUR: target = in->pos + offset; break;
+        case SEEK_END: target = in->size + offset; break;
+        default: return AVERROR(EINVAL);
+        }
+        if (target < 0 || target > in->size)
+            return AVERROR(EINVAL);
+        if (target < in->pos || target > in->advised)
+            in->advised = target;
+        in->pos = target;
+        in->readAhead();
+        return target;
+    }
+};
+
+}
+
+#endif // MAPPEDINPUT_HPP
@@ -0,0 +1,248 @@
+#ifndef MEDIAQUEUE_HPP
+#define MEDIAQUEUE_HPP
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <algorithm>
+
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/mathematics.h>
+}
+
+namespace avio {
+
+inline void mediaFree(AVPacket* pkt) { av_packet_free(&pkt); }
+inline void mediaFree(AVFrame* frame) { av_frame_free(&frame); }
+
+// Playing time of an item in microseconds, 0 when unknown. Packets use the
+// stream time base the queue was given, or their own if it has none.
+inline int64_t mediaDurationUs(const AVPacket* pkt, AVRational time_base) {
+    if (!time_base.num) time_base = pkt->time_base;
+    if (pkt->duration <= 0 || !time_base.num) return 0;
+    return av_rescale_q(pkt->duration, time_base, AVRational{ 1, 1000000 });
+}
+
+inline int64_t mediaDurationUs(const AVFrame* frame, AVRational) {
+    if (frame->sample_rate <= 0) return 0;
+    return (int64_t)frame->nb_samples * 1000000 / frame->sample_rate;
+}
+
+inline size_t mediaBytes(const AVPacket* pkt) { return pkt->size > 0 ? pkt->size : 0; }
+inline size_t mediaBytes(const AVFrame* frame) {
+    int size = av_samples_get_buffer_size(nullptr, frame->ch_layout.nb_channels, frame->nb_samples,
+                                          (AVSampleFormat)frame->format, 1);
+    return size > 0 ? size : 0;
+}
+
+// Bounds of one queue, push blocks once any of them is reached, 0 disables a
+// bound. A single item larger than the bounds is still let into an empty
+// queue so an odd packet cannot stall the pipeline.
+
+struct QueueLimits {
+    int max_ms = 0;
+    size_t max_bytes = 0;
+    size_t max_items = 0;
+};
+
+// Item count for a fixed capacity queue (avio::Queue) that approximates the
+// limits, given the duration and size of a typical item
+inline size_t queueCapacity(const QueueLimits& limits, int64_t item_us, size_t item_bytes) {
+    size_t capacity = limits.max_items ? limits.max_items : SIZE_MAX;
+    if (limits.max_ms && item_us > 0)
+        capacity = (std::min)(capacity, (size_t)((int64_t)limits.max_ms * 1000 / item_us));
+    if (limits.max_bytes && item_bytes)
+        capacity = (std::min)(capacity, limits.max_bytes / item_bytes);
+    if (capacity == SIZE_MAX)
+        capacity = 128;
+    return (std::max)(capacity, (size_t)2);
+}
+
+// Blocking queue of owned AVPacket / AVFrame pointers between the stages of
+// the portable pipeline, bounded by buffered playing time and bytes so memory
+// and latency stay the same whatever the codec frame size. close() marks end
+// of stream, pop() then drains what is left and returns nullptr.
+//
+// Stages that must not block (PipelineScheduler tasks) use tryPush/tryPop and
+// are woken through on_readable, called after an item arrived or the queue
+// was closed, and on_writable, called after an item left or the queue was
+// closed. Both run on the thread that changed the queue, outside the lock,
+// and are set before the queue is used. A queue with a trace_name (a string
+// literal) records its depth as a trace counter on every change.
+
+template <typename T>
+class MediaQueue {
+public:
+    std::function<void()> on_readable;
+    std::function<void()> on_writable;
+    const char* trace_name = nullptr;
+
+    MediaQueue(size_t max_size = 128) { limits.max_items = max_size; }
+
+    MediaQueue(const QueueLimits& limits, AVRational time_base = AVRational{ 0, 1 }) :
+        limits(limits), time_base(time_base) { }
+
+    ~MediaQueue() {
+        for (Entry& entry : items)
+            mediaFree(entry.item);
+    }
+
+    MediaQueue(const MediaQueue&) = delete;
+    MediaQueue& operator=(const MediaQueue&) = delete;
+
+    // takes ownership, returns false if the queue was closed and the item freed
+    bool push(T* item) {
+        Entry entry{ item, mediaDurationUs(item, time_base), mediaBytes(item) };
+        std::unique_lock<std::mutex> lock(mutex);
+        cond_push.wait(lock, [&] { return !full() || closed; });
+        if (closed) {
+            mediaFree(item);
+            return false;
+        }
+        add(entry);
+        cond_pop.notify_one();
+        lock.unlock();
+        if (on_readable) on_readable();
+        return true;
+    }
+
+    // 1 when the item was taken, 0 when the queue is full and the caller
+    // keeps it, -1 when the queue was closed and the item freed
+    int tryPush(T* item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (closed) {
+            lock.unlock();
+            mediaFree(item);
+            return -1;
+        }
+        if (full())
+            return 0;
+        add(Entry{ item, mediaDurationUs(item, time_base), mediaBytes(item) });
+        cond_pop.notify_one();
+        lock.unlock();
+        if (on_readable) on_readable();
+        return 1;
+    }
+
+    T* pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond_pop.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty())
+            return nullptr;
+        T* item = take();
+        lock.unlock();
+        if (on_writable) on_writable();
+        return item;
+    }
+
+    // false while the queue is empty and open, otherwise true with the next
+    // item, or nullptr once the queue is closed and drained
+    bool tryPop(T*& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (items.empty()) {
+            item = nullptr;
+            return closed;
+        }
+        item = take();
+        lock.unlock();
+        if (on_writable) on_writable();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            cond_pop.notify_all();
+            cond_push.notify_all();
+        }
+        if (on_readable) on_readable();
+        if (on_writable) on_writable();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+    }
+
+    // playing time currently buffered
+    int fillMs() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (int)(buffered_us / 1000);
+    }
+
+    size_t bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return buffered_bytes;
+    }
+
+    int peakMs() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (int)(peak_us / 1000);
+    }
+
+    size_t peakBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return peak_bytes;
+    }
+
+private:
+    struct Entry {
+        T* item;
+        int64_t duration_us;
+        size_t bytes;
+    };
+
+    QueueLimits limits;
+    AVRational time_base = AVRational{ 0, 1 };
+    bool closed = false;
+    std::deque<Entry> items;
+    int64_t buffered_us = 0;
+    size_t buffered_bytes = 0;
+    int64_t peak_us = 0;
+    size_t peak_bytes = 0;
+    std::mutex mutex;
+    std::condition_variable cond_push;
+    std::condition_variable cond_pop;
+
+    void add(const Entry& entry) {
+        items.push_back(entry);
+        buffered_us += entry.duration_us;
+        buffered_bytes += entry.bytes;
+        peak_us = (std::max)(peak_us, buffered_us);
+        peak_bytes = (std::max)(peak_bytes, buffered_bytes);
+        Metrics& metrics = Metrics::instance();
+        metrics.queue_depth.record(items.size());
+        metrics.queue_fill_ms.record(buffered_us / 1000);
+        if (trace_name) AVIO_TRACE_COUNTER(trace_name, items.size());
+    }
+
+    T* take() {
+        Entry entry = items.front();
+        items.pop_front();
+        buffered_us -= entry.duration_us;
+        buffered_bytes -= entry.bytes;
+        if (trace_name) AVIO_TRACE_COUNTER(trace_name, items.size());
+        cond_push.notify_one();
+        return entry.item;
+    }
+
+    bool full() const {
+        if (items.empty()) return false;
+        return (limits.max_items && items.size() >= limits.max_items)
+            || (limits.max_ms && buffered_us >= (int64_t)limits.max_ms * 1000)
+            || (limits.max_bytes && buffered_bytes >= limits.max_bytes);
+    }
+};
+
+}
+
+#endif // MEDIAQUEUE_HPP
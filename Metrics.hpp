@@ -0,0 +1,245 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace avio {
+
+// Hot path instrumentation. Counters and histograms are updated with relaxed
+// atomics and never format or lock, the text is produced on demand by
+// report() or by a MetricsReporter thread. Logging goes through AVIO_LOG,
+// which skips the formatting entirely unless the runtime level allows it.
+
+enum LogLevel { LOG_QUIET = 0, LOG_INFO = 1, LOG_DEBUG = 2 };
+
+class Counter {
+public:
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+    void reset() { value.store(0, std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Power of two buckets, bucket i holds values in [2^(i-1), 2^i), bucket 0 holds 0
+
+class Histogram {
+public:
+    static const int BUCKETS = 40;
+
+    struct Snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        uint64_t buckets[BUCKETS] = {};
+
+        double mean() const { return count ? (double)sum / count : 0; }
+
+        // upper bound of the bucket holding the given fraction of samples
+        uint64_t percentile(double fraction) const {
+            uint64_t target = (uint64_t)(fraction * count);
+            uint64_t seen = 0;
+            for (int i = 0; i < BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen > target) return i ? ((uint64_t)1 << i) - 1 : 0;
+            }
+            return max;
+        }
+    };
+
+    void record(uint64_t value) {
+        int index = 0;
+        for (uint64_t v = value; v && index < BUCKETS - 1; v >>= 1) index++;
+        buckets[index].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+
+    Snapshot snapshot() const {
+        Snapshot result;
+        result.count = count.load(std::memory_order_relaxed);
+        result.sum = sum.load(std::memory_order_relaxed);
+        result.max = max.load(std::memory_order_relaxed);
+        for (int i = 0; i < BUCKETS; i++)
+            result.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        return result;
+    }
+
+    void reset() {
+        count.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+        for (int i = 0; i < BUCKETS; i++)
+            buckets[i].store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> buckets[BUCKETS] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+// The process wide registry. Members are fixed so the hot path reaches them
+// without a lookup, the name tables let report() walk all of them.
+
+class Metrics {
+public:
+    Counter frames_converted;
+    Counter frames_rendered;
+    Counter device_calls;
+    Counter underruns;
+    Counter source_underruns;       // mixer periods a source could not fill
+
+    Histogram device_padding;       // frames queued in the device at each wakeup
+    Histogram write_size;           // frames per GetBuffer/ReleaseBuffer round
+    Histogram queue_depth;          // items or frames waiting between stages
+    Histogram queue_fill_ms;        // playing time buffered in a MediaQueue at each push
+    Histogram reader_latency_us;    // per packet read
+    Histogram decoder_latency_us;   // per packet decoded
+    Histogram filter_latency_us;    // per frame converted
+    Histogram render_latency_us;    // per render pass
+    Histogram mix_latency_us;       // per mixed period
+
+    std::atomic<int> level{ LOG_QUIET };
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    static bool enabled(int level) { return instance().level.load(std::memory_order_relaxed) >= level; }
+
+    struct Named {
+        const char* name;
+        Counter* counter;
+        Histogram* histogram;
+    };
+
+    const std::vector<Named>& all() const { return names; }
+
+    void reset() {
+        for (const Named& named : names) {
+            if (named.counter) named.counter->reset();
+            if (named.histogram) named.histogram->reset();
+        }
+    }
+
+    std::string report() const {
+        std::stringstream str;
+        for (const Named& named : names) {
+            str << named.name << ": ";
+            if (named.counter) {
+                str << named.counter->get();
+            }
+            else {
+                Histogram::Snapshot snap = named.histogram->snapshot();
+                str << "n=" << snap.count << " mean=" << (uint64_t)snap.mean()
+                    << " p50<=" << snap.percentile(0.5) << " p99<=" << snap.percentile(0.99)
+                    << " max=" << snap.max;
+            }
+            str << "\n";
+        }
+        return str.str();
+    }
+
+private:
+    std::vector<Named> names;
+
+    Metrics() {
+        names = {
+            { "frames_converted", &frames_converted, nullptr },
+            { "frames_rendered", &frames_rendered, nullptr },
+            { "device_calls", &device_calls, nullptr },
+            { "underruns", &underruns, nullptr },
+            { "source_underruns", &source_underruns, nullptr },
+            { "device_padding", nullptr, &device_padding },
+            { "write_size", nullptr, &write_size },
+            { "queue_depth", nullptr, &queue_depth },
+            { "queue_fill_ms", nullptr, &queue_fill_ms },
+            { "reader_latency_us", nullptr, &reader_latency_us },
+            { "decoder_latency_us", nullptr, &decoder_latency_us },
+            { "filter_latency_us", nullptr, &filter_latency_us },
+            { "render_latency_us", nullptr, &render_latency_us },
+            { "mix_latency_us", nullptr, &mix_latency_us },
+        };
+    }
+};
+
+#define AVIO_LOG(lvl, expr) \
+    do { if (avio::Metrics::enabled(lvl)) { std::cout << expr << std::endl; } } while (0)
+
+// Microseconds since construction, for the *_latency_us histograms
+
+class StageTimer {
+public:
+    StageTimer() : start(std::chrono::steady_clock::now()) { }
+    uint64_t us() const {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+// Prints the registry every interval_ms from a low priority thread while the
+// level is at least LOG_INFO
+
+class MetricsReporter {
+public:
+    MetricsReporter(int interval_ms = 1000) : interval_ms(interval_ms), thread([this] { run(); }) { }
+
+    ~MetricsReporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+private:
+    int interval_ms;
+    bool running = true;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+
+    void run() {
+#ifdef _WIN32
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+        sched_param param{};
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cond.wait_for(lock, std::chrono::milliseconds(interval_ms), [this] { return !running; })) {
+            if (Metrics::enabled(LOG_INFO))
+                std::cout << Metrics::instance().report() << std::endl;
+        }
+    }
+};
+
+}
+
+#endif // METRICS_HPP
@@ -0,0 +1,238 @@
+#ifndef MIXER_HPP
+#define MIXER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+#include "AudioSink.hpp"
+#include "PcmRing.hpp"
+#include "SwrRender.hpp"
+#include "SampleConvert.hpp"
+#include "Playlist.hpp"
+#include "WorkerPool.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+namespace avio {
+
+// One input of a Mixer. A worker decodes the track and converts it to float
+// at the device rate and channel count into a ring holding buffer_ms, the
+// render thread takes one period at a time out of it. The ring has room for
+// a decoded frame beyond the target so the worker never waits on it.
+
+class MixerSource {
+public:
+    std::string filename;
+    std::atomic<float> gain;
+    Track track;
+    uint64_t underruns = 0;         // periods it could not fill, render thread only
+    std::string error;              // set by the worker before the ring is closed
+
+    MixerSource(const std::string& filename, float gain, int sample_rate, int channels, int buffer_ms,
+                const OpenOptions& options) :
+        filename(filename),
+        gain(gain),
+        track(filename, options),
+        target((std::max)(1, (int)((int64_t)sample_rate * buffer_ms / 1000))),
+        ring(channels * (int)sizeof(float), sample_rate, buffer_ms + 250),
+        ring_sink(&ring, sample_rate, channels),
+        render(nullptr, &ring_sink, AV_SAMPLE_FMT_FLT, 0),
+        frame(av_frame_alloc())
+    { }
+
+    ~MixerSource() {
+        av_frame_free(&frame);
+    }
+
+    MixerSource(const MixerSource&) = delete;
+    MixerSource& operator=(const MixerSource&) = delete;
+
+    bool finished() const { return ring.finished(); }
+
+private:
+    friend class Mixer;
+
+    const int target;
+    PcmRing ring;
+    RingSink ring_sink;
+    SwrRender render;
+    AVFrame* frame;
+    std::atomic<bool> ended{ false };
+    std::atomic<bool> scheduled{ false };
+
+    // worker: decode until target frames are buffered, closes the ring at the end
+    void fill() {
+        auto wait = [] { std::this_thread::sleep_for(std::chrono::microseconds(200)); };
+        while (!ended && ring.readable() < target) {
+            int ret = track.read(frame);
+            if (ret > 0 && render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait) < 0) {
+                error = "Failed to initialize SwrContext";
+                ret = -1;
+            }
+            if (ret <= 0) {
+                if (ret < 0 && error.empty())
+                    error = "decode error";
+                render.render(nullptr, 0, wait);
+                ended = true;
+                ring.close();
+                break;
+            }
+            render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+        }
+        scheduled.store(false, std::memory_order_release);
+    }
+};
+
+// Mixes up to max_sources tracks into one sink. Sources are decoded and
+// resampled on a shared WorkerPool; mix(), called from the render thread,
+// sums one period of every source with its gain into a float accumulator and
+// clamps it into the sink format with the SIMD kernels of SampleConvert.hpp,
+// so the render thread costs one multiply-add pass per source and period.
+// A source with too little buffered contributes what it has and counts an
+// underrun; with offline set mix() waits for it instead, for rendering faster
+// than real time. The pool has to outlive the mixer.
+
+class Mixer {
+public:
+    bool offline = false;
+    uint64_t periods = 0;
+
+    Mixer(AudioSink* sink, AVSampleFormat out_fmt, WorkerPool* pool, int max_sources = 64, int buffer_ms = 100) :
+        sink(sink), out_fmt(out_fmt), pool(pool), buffer_ms(buffer_ms),
+        sources((size_t)(std::max)(1, max_sources)),
+        accumulator((size_t)sink->bufferFrames() * sink->channels())
+    { }
+
+    // waits for fills still running on the pool
+    ~Mixer() {
+        for (int i = 0; i < count(); i++) {
+            while (sources[i]->scheduled.load(std::memory_order_acquire))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    Mixer(const Mixer&) = delete;
+    Mixer& operator=(const Mixer&) = delete;
+
+    // Opens a source and starts decoding it, returns its id or -1 when all
+    // slots are taken. Throws like Track when the file cannot be opened. One
+    // control thread adds sources while the render thread mixes.
+    int add(const std::string& filename, float gain = 1.0f, const OpenOptions& options = OpenOptions()) {
+        int id = added.load(std::memory_order_relaxed);
+        if (id >= (int)sources.size())
+            return -1;
+        if (out_fmt != AV_SAMPLE_FMT_FLT && out_fmt != AV_SAMPLE_FMT_S16)
+            throw std::runtime_error("Mixer output has to be flt or s16");
+        sources[id].reset(new MixerSource(filename, gain, sink->sampleRate(), sink->channels(), buffer_ms, options));
+        kick(sources[id].get());
+        added.store(id + 1, std::memory_order_release);
+        return id;
+    }
+
+    void setGain(int id, float gain) { sources[id]->gain.store(gain, std::memory_order_relaxed); }
+
+    int count() const { return added.load(std::memory_order_acquire); }
+    MixerSource* source(int id) { return sources[id].get(); }
+
+    // every source played to the end
+    bool finished() const {
+        int n = count();
+        for (int i = 0; i < n; i++) {
+            if (!sources[i]->finished())
+                return false;
+        }
+        return n > 0;
+    }
+
+    // Mixes as much as the sink takes, at most its buffer. Returns frames
+    // written, 0 when the sink is full or, offline, a source is not ready.
+    int mix() {
+        int frames = (std::min)(sink->available(), sink->bufferFrames());
+        if (frames <= 0)
+            return 0;
+        int n = count();
+        if (offline) {
+            for (int i = 0; i < n; i++) {
+                MixerSource* source = sources[i].get();
+                if (!source->ring.finished() && source->ring.readable() < frames && !source->ended) {
+                    kick(source);
+                    return 0;
+                }
+            }
+        }
+
+        uint8_t* out = sink->getBuffer(frames);
+        if (!out)
+            return 0;
+
+        AVIO_TRACE_SPAN("mix");
+        StageTimer timer;
+        int channels = sink->channels();
+        float* acc = accumulator.data();
+        memset(acc, 0, (size_t)frames * channels * sizeof(float));
+        for (int i = 0; i < n; i++) {
+            MixerSource* source = sources[i].get();
+            if (source->ring.finished())
+                continue;
+            float gain = source->gain.load(std::memory_order_relaxed);
+            int mixed = 0;
+            while (mixed < frames) {
+                int count = 0;
+                const float* region = (const float*)source->ring.readRegion(&count);
+                count = (std::min)(count, frames - mixed);
+                if (count == 0)
+                    break;
+                kernel::mixAddRun(acc + (size_t)mixed * channels, region, count * channels, gain);
+                source->ring.commitRead(count);
+                mixed += count;
+            }
+            if (mixed < frames && !source->ended) {
+                source->underruns++;
+                Metrics::instance().source_underruns.add(1);
+                AVIO_TRACE_INSTANT("source underrun");
+            }
+            if (source->ring.readable() < source->target)
+                kick(source);
+        }
+
+        if (out_fmt == AV_SAMPLE_FMT_FLT)
+            kernel::clampRun((float*)out, acc, frames * channels);
+        else
+            kernel::fltToS16Run((int16_t*)out, acc, frames * channels);
+        sink->releaseBuffer(frames);
+        periods++;
+        Metrics::instance().mix_latency_us.record(timer.us());
+        return frames;
+    }
+
+private:
+    AudioSink* sink;
+    AVSampleFormat out_fmt;
+    WorkerPool* pool;
+    int buffer_ms;
+    std::vector<std::unique_ptr<MixerSource>> sources;
+    std::atomic<int> added{ 0 };
+    std::vector<float> accumulator;
+
+    void kick(MixerSource* source) {
+        if (source->ended || source->scheduled.exchange(true, std::memory_order_acq_rel))
+            return;
+        pool->post([source] { source->fill(); });
+    }
+};
+
+}
+
+#endif // MIXER_HPP
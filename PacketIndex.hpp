@@ -0,0 +1,275 @@
+#ifndef PACKETINDEX_HPP
+#define PACKETINDEX_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/mathematics.h>
+}
+
+#include "AudioReader.hpp"
+#include "StreamInfoCache.hpp"
+#include "Metrics.hpp"
+
+namespace avio {
+
+// Timestamp to byte offset map of the key packets of one stream, thinned to
+// one entry per spacing. byte_seekable is cleared when packets share or lack
+// a position (Ogg pages, some containers), seeks then go by timestamp.
+
+class PacketIndex {
+public:
+    struct Entry {
+        int64_t pts;                // stream time base
+        int64_t pos;                // byte offset of the packet
+    };
+
+    int stream_index = -1;
+    AVRational time_base{ 0, 1 };
+    bool byte_seekable = true;
+    bool complete = false;          // the scan reached the end of the file
+    std::vector<Entry> entries;
+
+    // last entry at or before pts, nullptr if there is none
+    const Entry* find(int64_t pts) const {
+        auto it = std::upper_bound(entries.begin(), entries.end(), pts,
+                                   [](int64_t value, const Entry& entry) { return value < entry.pts; });
+        return it == entries.begin() ? nullptr : &*(it - 1);
+    }
+
+    // Demuxes the file with its own reader, never decodes, and keeps a key
+    // packet every spacing_ms. Stops early when *stop is set, complete then
+    // stays false. False if the scan failed or was stopped.
+    bool scan(const std::string& filename, int index, const OpenOptions& options, int spacing_ms,
+              const std::atomic<bool>* stop = nullptr)
+    {
+        *this = PacketIndex();
+        try {
+            AudioReader reader(filename, options);
+            if (index < 0 || index >= (int)reader.fmt_ctx->nb_streams)
+                return false;
+            AVStream* st = reader.fmt_ctx->streams[index];
+            reader.stream_index = index;
+            reader.stream = st;
+            stream_index = index;
+            time_base = st->time_base;
+            int64_t spacing = av_rescale_q(spacing_ms, AVRational{ 1, 1000 }, st->time_base);
+            int64_t last_pos = -1;
+
+            AVPacket* pkt = av_packet_alloc();
+            int ret = 0;
+            while (!(stop && *stop) && (ret = reader.read(pkt)) > 0) {
+                int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+                if (pkt->pos < 0 || pkt->pos <= last_pos)
+                    byte_seekable = false;
+                last_pos = (std::max)(last_pos, pkt->pos);
+                if (pts != AV_NOPTS_VALUE && (pkt->flags & AV_PKT_FLAG_KEY)
+                    && (entries.empty() || pts - entries.back().pts >= spacing))
+                {
+                    entries.push_back(Entry{ pts, pkt->pos });
+                }
+                av_packet_unref(pkt);
+            }
+            av_packet_free(&pkt);
+            complete = !(stop && *stop) && ret == 0;
+            return complete;
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+    }
+
+    // Stored next to the stream info of the file, keyed by path, size and
+    // mtime the same way. Entries are delta coded varints, a few bytes each.
+    bool save(const StreamInfoCache& cache, const std::string& path) const {
+        int64_t size, mtime;
+        if (!StreamInfoCache::fileKey(path, size, mtime))
+            return false;
+        std::vector<uint8_t> out;
+        putVarint(out, VERSION);
+        putVarint(out, zigzag(size));
+        putVarint(out, zigzag(mtime));
+        putVarint(out, path.size());
+        out.insert(out.end(), path.begin(), path.end());
+        putVarint(out, stream_index);
+        putVarint(out, time_base.num);
+        putVarint(out, time_base.den);
+        putVarint(out, byte_seekable);
+        putVarint(out, entries.size());
+        Entry last{ 0, 0 };
+        for (const Entry& entry : entries) {
+            putVarint(out, zigzag(entry.pts - last.pts));
+            putVarint(out, zigzag(entry.pos - last.pos));
+            last = entry;
+        }
+
+        std::string target = cache.entryPath(path, ".idx");
+        std::string temp = target + ".tmp";
+        {
+            std::ofstream file(temp, std::ios::binary);
+            if (!file.write((const char*)out.data(), out.size()))
+                return false;
+        }
+        std::remove(target.c_str());
+        return std::rename(temp.c_str(), target.c_str()) == 0;
+    }
+
+    bool load(const StreamInfoCache& cache, const std::string& path) {
+        int64_t size, mtime;
+        std::ifstream file(cache.entryPath(path, ".idx"), std::ios::binary);
+        if (!StreamInfoCache::fileKey(path, size, mtime) || !file)
+            return false;
+        std::vector<uint8_t> in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        const uint8_t* p = in.data();
+        const uint8_t* end = p + in.size();
+
+        uint64_t value;
+        if (!getVarint(p, end, value) || value != VERSION
+            || !getVarint(p, end, value) || unzigzag(value) != size
+            || !getVarint(p, end, value) || unzigzag(value) != mtime
+            || !getVarint(p, end, value) || value != path.size() || (uint64_t)(end - p) < value
+            || std::string((const char*)p, (size_t)value) != path)
+        {
+            return false;
+        }
+        p += value;
+
+        uint64_t index, num, den, seekable, count;
+        if (!getVarint(p, end, index) || !getVarint(p, end, num) || !getVarint(p, end, den)
+            || !getVarint(p, end, seekable) || !getVarint(p, end, count))
+        {
+            return false;
+        }
+        std::vector<Entry> loaded;
+        Entry last{ 0, 0 };
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t pts, pos;
+            if (!getVarint(p, end, pts) || !getVarint(p, end, pos))
+                return false;
+            last.pts += unzigzag(pts);
+            last.pos += unzigzag(pos);
+            loaded.push_back(last);
+        }
+        stream_index = (int)index;
+        time_base = AVRational{ (int)num, (int)den };
+        byte_seekable = seekable != 0;
+        complete = true;
+        entries.swap(loaded);
+        return true;
+    }
+
+private:
+    static const int VERSION = 1;
+
+    static uint64_t zigzag(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+    static int64_t unzigzag(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+
+    static void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((uint8_t)value);
+    }
+
+    static bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+        value = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t byte = *p++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+};
+
+// Builds the PacketIndex of a file on a low priority thread after it was
+// opened for playback, the scan stops early when the owner goes away. With a
+// cache the index of an unchanged file is loaded instead and a finished scan
+// is stored.
+
+class PacketIndexer {
+public:
+    int spacing_ms = 100;
+
+    PacketIndexer(const std::string& filename, int stream_index, const OpenOptions& options) :
+        filename(filename), stream_index(stream_index), options(options), cache(options.cache)
+    {
+        // the cache is only used for the index, not concurrently by a second reader
+        this->options.cache = nullptr;
+        thread = std::thread([this] { run(); });
+    }
+
+    ~PacketIndexer() {
+        stop = true;
+        thread.join();
+    }
+
+    PacketIndexer(const PacketIndexer&) = delete;
+    PacketIndexer& operator=(const PacketIndexer&) = delete;
+
+    // the finished index, nullptr while the scan is running or if it failed
+    const PacketIndex* index() const {
+        return ready.load(std::memory_order_acquire) ? &result : nullptr;
+    }
+
+    // valid once index() returned the index
+    bool loadedFromCache() const { return from_cache; }
+    double buildMs() const { return build_ms; }
+
+private:
+    std::string filename;
+    int stream_index;
+    OpenOptions options;
+    StreamInfoCache* cache = nullptr;
+    PacketIndex result;
+    std::atomic<bool> ready{ false };
+    std::atomic<bool> stop{ false };
+    bool from_cache = false;
+    double build_ms = 0;
+    std::thread thread;
+
+    void run() {
+#ifdef _WIN32
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+        sched_param param{};
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+        StageTimer timer;
+        if (cache && result.load(*cache, filename) && result.stream_index == stream_index) {
+            from_cache = true;
+            build_ms = timer.us() / 1000.0;
+            ready.store(true, std::memory_order_release);
+            return;
+        }
+        if (!result.scan(filename, stream_index, options, spacing_ms, &stop))
+            return;
+        build_ms = timer.us() / 1000.0;
+        if (cache)
+            result.save(*cache, filename);
+        ready.store(true, std::memory_order_release);
+    }
+};
+
+}
+
+#endif // PACKETINDEX_HPP
@@ -0,0 +1,310 @@
+#ifndef PCMCACHE_HPP
+#define PCMCACHE_HPP
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/mathematics.h>
+#include <libswresample/swresample.h>
+}
+
+#include "AudioSink.hpp"
+#include "SwrRender.hpp"
+#include "AudioReader.hpp"
+#include "StreamInfoCache.hpp"
+#include "Playlist.hpp"
+
+namespace avio {
+
+// A whole file decoded, trimmed and converted to an interleaved sink format.
+// Never changed once built, any number of ClipPlayers and the cache share it
+// through a shared_ptr and the last one to let go frees the samples.
+
+struct PcmClip {
+    std::vector<uint8_t> data;
+    int64_t frames = 0;
+    int sample_rate = 0;
+    int channels = 0;
+    AVSampleFormat format = AV_SAMPLE_FMT_NONE;
+    int block_align = 0;
+
+    size_t bytes() const { return data.capacity() + sizeof(PcmClip); }
+};
+
+// Plays a PcmClip into a sink of the same format, a plain copy per call with
+// no decoder, resampler or ring in between. Safe on the render thread, the
+// clip stays alive as long as the player does.
+
+class ClipPlayer {
+public:
+    std::shared_ptr<const PcmClip> clip;
+    int64_t position = 0;
+
+    ClipPlayer(std::shared_ptr<const PcmClip> clip) : clip(std::move(clip)) { }
+
+    // frames written, at most space, one getBuffer/releaseBuffer round
+    int render(AudioSink* sink, int space) {
+        int total = (int)(std::min)((int64_t)space, clip->frames - position);
+        if (total <= 0) return 0;
+        uint8_t* dst = sink->getBuffer(total);
+        if (!dst) return 0;
+        memcpy(dst, clip->data.data() + (size_t)position * clip->block_align, (size_t)total * clip->block_align);
+        sink->releaseBuffer(total);
+        position += total;
+        return total;
+    }
+
+    int render(AudioSink* sink) { return render(sink, sink->available()); }
+
+    bool finished() const { return position >= clip->frames; }
+};
+
+// In-memory LRU cache of PcmClips for short sounds that are played again and
+// again. An entry is keyed by path and output format and, like the
+// StreamInfoCache, only used while the size and modification time of the
+// file still match. The clips held are bounded by max_bytes, the least
+// recently used go first; an evicted clip lives on until its last player is
+// done, that memory is not counted. Files that decode to more than
+// max_clip_bytes are not cached at all, get() returns nullptr for them and
+// the caller streams them through the usual pipeline. Lookups stat the file
+// and take a mutex, they belong on a control thread, the render thread only
+// sees the ClipPlayer. Two threads missing the same entry at once both decode
+// it, the first one stored is kept.
+
+class PcmCache {
+public:
+    size_t max_bytes;
+    size_t max_clip_bytes;
+    OpenOptions options;
+    std::atomic<uint64_t> hits{ 0 };
+    std::atomic<uint64_t> misses{ 0 };
+    std::atomic<uint64_t> evictions{ 0 };
+
+    PcmCache(size_t max_bytes) : max_bytes(max_bytes), max_clip_bytes(max_bytes / 4) { }
+
+    PcmCache(const PcmCache&) = delete;
+    PcmCache& operator=(const PcmCache&) = delete;
+
+    // the cached clip, nullptr when there is none or the file has changed
+    std::shared_ptr<const PcmClip> find(const std::string& path, int sample_rate, int channels, AVSampleFormat format) {
+        int64_t size, mtime;
+        if (!StreamInfoCache::fileKey(path, size, mtime)) {
+            misses++;
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(key(path, sample_rate, channels, format));
+        if (found == index.end()) {
+            misses++;
+            return nullptr;
+        }
+        if (found->second->size != size || found->second->mtime != mtime) {
+            drop(found->second);
+            misses++;
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, found->second);
+        hits++;
+        return found->second->clip;
+    }
+
+    // the cached clip, or the file decoded now and stored; nullptr with error
+    // set when it cannot be decoded or is longer than max_clip_bytes
+    std::shared_ptr<const PcmClip> get(const std::string& path, int sample_rate, int channels, AVSampleFormat format,
+                                       std::string* error = nullptr)
+    {
+        std::shared_ptr<const PcmClip> clip = find(path, sample_rate, channels, format);
+        if (clip)
+            return clip;
+
+        // the version of the file before decoding, a rewrite meanwhile shows
+        // up as a changed key on the next lookup
+        int64_t size, mtime;
+        std::string message;
+        if (!StreamInfoCache::fileKey(path, size, mtime))
+            message = "not a regular file";
+        else
+            clip = decode(path, sample_rate, channels, format, options, max_clip_bytes, message);
+        if (!clip) {
+            if (error) *error = message;
+            return nullptr;
+        }
+        return store(path, size, mtime, clip);
+    }
+
+    // drops every format kept for path
+    void erase(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = lru.begin(); it != lru.end();) {
+            auto next = std::next(it);
+            if (it->path == path)
+                drop(it);
+            it = next;
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        lru.clear();
+        index.clear();
+        total_bytes = 0;
+    }
+
+    // held by the cache, not counting evicted clips still playing
+    size_t bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total_bytes;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return lru.size();
+    }
+
+    // Decodes all of path into a new clip without touching any cache, gapless
+    // trimmed like a Track. nullptr with error set on failure or once the
+    // samples pass max_bytes.
+    static std::shared_ptr<PcmClip> decode(const std::string& path, int sample_rate, int channels, AVSampleFormat format,
+                                           const OpenOptions& options, size_t max_bytes, std::string& error)
+    {
+        if (sample_rate <= 0 || channels <= 0 || av_sample_fmt_is_planar(format) || av_get_bytes_per_sample(format) <= 0) {
+            error = "unsupported clip format";
+            return nullptr;
+        }
+        std::shared_ptr<PcmClip> clip = std::make_shared<PcmClip>();
+        clip->sample_rate = sample_rate;
+        clip->channels = channels;
+        clip->format = format;
+        clip->block_align = channels * av_get_bytes_per_sample(format);
+
+        AVFrame* frame = av_frame_alloc();
+        int ret = 0;
+        bool too_long = false;
+        try {
+            Track track(path, options);
+            int64_t expected = av_rescale(track.nominalSamples(), sample_rate, (std::max)(1, track.decoder.sampleRate()));
+            if (expected > 0 && (uint64_t)expected * clip->block_align <= max_bytes)
+                clip->data.reserve((size_t)expected * clip->block_align);
+
+            ClipSink sink(clip.get());
+            SwrRender render(nullptr, &sink, format, 0);
+            auto wait = [] {};
+            while (!(too_long = clip->data.size() > max_bytes) && (ret = track.read(frame)) > 0) {
+                if ((ret = render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait)) < 0)
+                    break;
+                render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+            }
+            if (ret == 0 && !too_long) {
+                render.render(nullptr, 0, wait);
+                too_long = clip->data.size() > max_bytes;
+            }
+        }
+        catch (const std::exception& e) {
+            av_frame_free(&frame);
+            error = e.what();
+            return nullptr;
+        }
+        av_frame_free(&frame);
+
+        if (too_long) {
+            error = "longer than the clip limit";
+            return nullptr;
+        }
+        if (ret < 0) {
+            error = "decode error";
+            return nullptr;
+        }
+        clip->data.shrink_to_fit();
+        return clip;
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::string path;
+        int64_t size;
+        int64_t mtime;
+        std::shared_ptr<const PcmClip> clip;
+    };
+
+    // converter output appended to the clip, never full
+    class ClipSink : public AudioSink {
+    public:
+        static const int FRAMES = 4096;
+
+        ClipSink(PcmClip* clip) : clip(clip) { }
+
+        int sampleRate() const override { return clip->sample_rate; }
+        int channels() const override { return clip->channels; }
+        int blockAlign() const override { return clip->block_align; }
+        int bufferFrames() const override { return FRAMES; }
+
+        int available() override { return FRAMES; }
+
+        uint8_t* getBuffer(int frames) override {
+            clip->data.resize((size_t)(clip->frames + frames) * clip->block_align);
+            return clip->data.data() + (size_t)clip->frames * clip->block_align;
+        }
+
+        void releaseBuffer(int frames) override {
+            clip->frames += frames;
+            clip->data.resize((size_t)clip->frames * clip->block_align);
+        }
+
+    private:
+        PcmClip* clip;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> lru;           // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t total_bytes = 0;
+
+    static std::string key(const std::string& path, int sample_rate, int channels, AVSampleFormat format) {
+        return path + '\n' + std::to_string(sample_rate) + ' ' + std::to_string(channels) + ' ' + std::to_string((int)format);
+    }
+
+    void drop(std::list<Entry>::iterator it) {
+        total_bytes -= it->clip->bytes();
+        index.erase(it->key);
+        lru.erase(it);
+    }
+
+    std::shared_ptr<const PcmClip> store(const std::string& path, int64_t size, int64_t mtime,
+                                         std::shared_ptr<const PcmClip> clip)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string entry_key = key(path, clip->sample_rate, clip->channels, clip->format);
+        auto found = index.find(entry_key);
+        if (found != index.end()) {
+            if (found->second->size == size && found->second->mtime == mtime)
+                return found->second->clip;
+            drop(found->second);
+        }
+        if (clip->bytes() > max_bytes)
+            return clip;
+        lru.push_front(Entry{ entry_key, path, size, mtime, clip });
+        index[entry_key] = lru.begin();
+        total_bytes += clip->bytes();
+        while (total_bytes > max_bytes) {
+            drop(std::prev(lru.end()));
+            evictions++;
+        }
+        return clip;
+    }
+};
+
+}
+
+#endif // PCMCACHE_HPP
@@ -0,0 +1,114 @@
+#ifndef PCMRING_HPP
+#define PCMRING_HPP
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+namespace avio {
+
+// Single producer / single consumer ring of interleaved PCM sample frames.
+// Storage is allocated once in the constructor; push and pop never lock or
+// allocate, so the render thread can drain it while the filter thread fills it.
+
+class PcmRing {
+public:
+
+    PcmRing(int block_align, int sample_rate, int duration_ms) :
+        block_align(block_align),
+        capacity((size_t)(std::max)(1, (int)((int64_t)sample_rate * duration_ms / 1000))),
+        buffer(capacity * block_align)
+    { }
+
+    PcmRing(const PcmRing&) = delete;
+    PcmRing& operator=(const PcmRing&) = delete;
+
+    int blockAlign() const { return block_align; }
+    int size() const { return (int)capacity; }
+
+    // frames ready for the consumer
+    int readable() const {
+        return (int)(head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed));
+    }
+
+    // frames of free space for the producer
+    int writable() const {
+        return (int)(capacity - (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire)));
+    }
+
+    // producer: contiguous free region starting at the write position,
+    // frames is set to its length, which may be shorter than writable()
+    uint8_t* writeRegion(int* frames) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        size_t index = h % capacity;
+        size_t space = capacity - (h - tail.load(std::memory_order_acquire));
+        *frames = (int)(std::min)(space, capacity - index);
+        return buffer.data() + index * block_align;
+    }
+
+    void commitWrite(int frames) {
+        head.store(head.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+    }
+
+    // consumer: contiguous filled region starting at the read position
+    const uint8_t* readRegion(int* frames) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        size_t index = t % capacity;
+        size_t filled = head.load(std::memory_order_acquire) - t;
+        *frames = (int)(std::min)(filled, capacity - index);
+        return buffer.data() + index * block_align;
+    }
+
+    void commitRead(int frames) {
+        tail.store(tail.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+    }
+
+    // copy up to frames from src, returns the number of frames accepted
+    int push(const uint8_t* src, int frames) {
+        int written = 0;
+        while (written < frames) {
+            int count = 0;
+            uint8_t* dst = writeRegion(&count);
+            count = (std::min)(count, frames - written);
+            if (count == 0) break;
+            memcpy(dst, src + (size_t)written * block_align, (size_t)count * block_align);
+            commitWrite(count);
+            written += count;
+        }
+        return written;
+    }
+
+    // copy up to frames into dst, returns the number of frames delivered
+    int pop(uint8_t* dst, int frames) {
+        int read = 0;
+        while (read < frames) {
+            int count = 0;
+            const uint8_t* src = readRegion(&count);
+            count = (std::min)(count, frames - read);
+            if (count == 0) break;
+            memcpy(dst + (size_t)read * block_align, src, (size_t)count * block_align);
+            commitRead(count);
+            read += count;
+        }
+        return read;
+    }
+
+    // producer signals end of stream, consumer sees it once the ring is empty
+    void close() { closed.store(true, std::memory_order_release); }
+    bool finished() const { return closed.load(std::memory_order_acquire) && readable() == 0; }
+
+private:
+    const int block_align;
+    const size_t capacity;
+    std::vector<uint8_t> buffer;
+
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<bool> closed{false};
+};
+
+}
+
+#endif // PCMRING_HPP
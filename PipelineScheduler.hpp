@@ -0,0 +1,384 @@
+#ifndef PIPELINESCHEDULER_HPP
+#define PIPELINESCHEDULER_HPP
+
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libswresample/swresample.h>
+}
+
+#include "AudioSink.hpp"
+#include "PcmRing.hpp"
+#include "SwrRender.hpp"
+#include "MediaQueue.hpp"
+#include "AudioReader.hpp"
+#include "AudioDecoder.hpp"
+#include "WorkerPool.hpp"
+#include "Metrics.hpp"
+
+namespace avio {
+
+// A stage that never blocks. step() does a bounded amount of work and says
+// whether it wants to run again right away (Again), has to wait for a queue
+// (Wait) or is finished (Done). A waiting task runs again once something
+// calls PipelineScheduler::wake() for it.
+
+class PipelineTask {
+public:
+    enum Status { Again, Wait, Done };
+
+    virtual ~PipelineTask() { }
+    virtual Status step() = 0;
+
+    bool finished() const { return state.load(std::memory_order_acquire) == Finished; }
+
+private:
+    friend class PipelineScheduler;
+
+    enum State { Idle, Queued, Running, Notified, Finished };
+    std::atomic<int> state{ Idle };
+};
+
+// Runs the stages of any number of pipelines as tasks on a shared WorkerPool
+// instead of a thread per stage. A task is queued at most once: a wake while
+// it is queued is dropped, a wake while it runs makes it run once more after
+// the current step, so no readiness is lost between a failed tryPop and the
+// task going idle. The pool has to outlive the scheduler and its tasks.
+
+class PipelineScheduler {
+public:
+    PipelineScheduler(WorkerPool* pool) : pool(pool) { }
+
+    PipelineScheduler(const PipelineScheduler&) = delete;
+    PipelineScheduler& operator=(const PipelineScheduler&) = delete;
+
+    void start(PipelineTask* task) { wake(task); }
+
+    // any thread, cheap when the task is already queued or running
+    void wake(PipelineTask* task) {
+        int state = task->state.load(std::memory_order_acquire);
+        while (true) {
+            if (state == PipelineTask::Idle) {
+                if (task->state.compare_exchange_weak(state, PipelineTask::Queued, std::memory_order_acq_rel)) {
+                    post(task);
+                    return;
+                }
+            }
+            else if (state == PipelineTask::Running) {
+                if (task->state.compare_exchange_weak(state, PipelineTask::Notified, std::memory_order_acq_rel))
+                    return;
+            }
+            else {
+                return;
+            }
+        }
+    }
+
+    int workers() const { return pool->size(); }
+
+    // steps run and jobs posted to the pool so far
+    uint64_t steps() const { return step_count.load(std::memory_order_relaxed); }
+    uint64_t posts() const { return post_count.load(std::memory_order_relaxed); }
+
+private:
+    WorkerPool* pool;
+    std::atomic<uint64_t> step_count{ 0 };
+    std::atomic<uint64_t> post_count{ 0 };
+
+    void post(PipelineTask* task) {
+        post_count.fetch_add(1, std::memory_order_relaxed);
+        pool->post([this, task] { run(task); });
+    }
+
+    // the task is not touched after it is marked finished, its owner may
+    // destroy it from then on
+    void run(PipelineTask* task) {
+        task->state.store(PipelineTask::Running, std::memory_order_release);
+        PipelineTask::Status status = task->step();
+        step_count.fetch_add(1, std::memory_order_relaxed);
+        if (status == PipelineTask::Done) {
+            task->state.store(PipelineTask::Finished, std::memory_order_release);
+            return;
+        }
+        if (status == PipelineTask::Wait) {
+            int state = PipelineTask::Running;
+            if (task->state.compare_exchange_strong(state, PipelineTask::Idle, std::memory_order_acq_rel))
+                return;
+        }
+        task->state.store(PipelineTask::Queued, std::memory_order_release);
+        post(task);
+    }
+};
+
+// Reader -> decoder -> converter of one file as three PipelineTasks, linked
+// by MediaQueues whose readiness hooks wake the stage on the other side. The
+// converter writes float at the sink rate and channel count into ring, it
+// only converts a frame once the ring has room for all of it and otherwise
+// parks until kick(), which the render thread calls after taking audio out
+// of the ring, sees the room. The render stage itself stays on its own
+// thread. Throws like AudioReader / AudioDecoder when the file cannot be
+// opened. The destructor stops the tasks of a pipeline that has not finished
+// and waits until none of them is queued or running.
+
+class ScheduledPipeline {
+public:
+    std::string filename;
+    AudioReader reader;
+    AudioDecoder decoder;
+    MediaQueue<AVPacket> pkts;
+    MediaQueue<AVFrame> frames;
+    PcmRing ring;
+    std::string error;              // set by the converter before the ring is closed
+    bool use_kernels = true;
+
+    ScheduledPipeline(PipelineScheduler* scheduler, const std::string& filename, int sample_rate, int channels,
+                      const QueueLimits& packet_limits, const QueueLimits& frame_limits,
+                      int ring_ms = 200, const OpenOptions& options = OpenOptions()) :
+        filename(filename),
+        reader(filename, options),
+        decoder(reader.stream),
+        pkts(packet_limits, reader.stream->time_base),
+        frames(frame_limits),
+        ring(channels * (int)sizeof(float), sample_rate, ring_ms),
+        scheduler(scheduler),
+        reader_task(this),
+        decoder_task(this),
+        filter_task(this, sample_rate, channels)
+    {
+        pkts.on_readable = [this] { this->scheduler->wake(&decoder_task); };
+        pkts.on_writable = [this] { this->scheduler->wake(&reader_task); };
+        frames.on_readable = [this] { this->scheduler->wake(&filter_task); };
+        frames.on_writable = [this] { this->scheduler->wake(&decoder_task); };
+    }
+
+    ~ScheduledPipeline() {
+        if (!started)
+            return;
+        stopping.store(true, std::memory_order_release);
+        scheduler->wake(&reader_task);
+        scheduler->wake(&decoder_task);
+        scheduler->wake(&filter_task);
+        while (!reader_task.finished() || !decoder_task.finished() || !filter_task.finished())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    ScheduledPipeline(const ScheduledPipeline&) = delete;
+    ScheduledPipeline& operator=(const ScheduledPipeline&) = delete;
+
+    void start() {
+        started = true;
+        filter_task.render.use_kernels = use_kernels;
+        scheduler->start(&reader_task);
+        scheduler->start(&decoder_task);
+        scheduler->start(&filter_task);
+    }
+
+    // render thread, after reading from the ring: wakes the converter when it
+    // is parked and the room it waits for is there
+    void kick() {
+        // pairs with the fence in FilterTask::reserve, either side sees the other
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int needed = filter_task.space_needed.load(std::memory_order_acquire);
+        if (needed > 0 && ring.writable() >= needed
+            && filter_task.space_needed.exchange(0, std::memory_order_acq_rel) > 0)
+            scheduler->wake(&filter_task);
+    }
+
+    // all audio is in the ring and the render thread took it
+    bool finished() const { return ring.finished(); }
+
+private:
+    // packets or frames a task handles per step before it lets the others run
+    static const int STEP_BUDGET = 16;
+
+    struct ReaderTask : PipelineTask {
+        ScheduledPipeline* pipeline;
+        AVPacket* pkt = nullptr;
+
+        ReaderTask(ScheduledPipeline* pipeline) : pipeline(pipeline) { }
+        ~ReaderTask() { av_packet_free(&pkt); }
+
+        Status step() override {
+            Metrics& metrics = Metrics::instance();
+            if (pipeline->stopping.load(std::memory_order_acquire)) {
+                pipeline->pkts.close();
+                return Done;
+            }
+            for (int i = 0; i < STEP_BUDGET; i++) {
+                if (!pkt) {
+                    pkt = av_packet_alloc();
+                    StageTimer timer;
+                    if (pipeline->reader.read(pkt) <= 0) {
+                        av_packet_free(&pkt);
+                        pipeline->pkts.close();
+                        return Done;
+                    }
+                    metrics.reader_latency_us.record(timer.us());
+                }
+                int ret = pipeline->pkts.tryPush(pkt);
+                if (ret == 0)
+                    return Wait;
+                pkt = nullptr;
+                if (ret < 0)
+                    return Done;
+            }
+            return Again;
+        }
+    };
+
+    // frames the decoder hands out are held in pending until the frame queue
+    // takes them, a new packet is only sent once the decoder has no more output
+    struct DecoderTask : PipelineTask {
+        ScheduledPipeline* pipeline;
+        AVFrame* frame = av_frame_alloc();
+        AVFrame* pending = nullptr;
+        bool draining = false;
+
+        DecoderTask(ScheduledPipeline* pipeline) : pipeline(pipeline) { }
+        ~DecoderTask() {
+            av_frame_free(&frame);
+            av_frame_free(&pending);
+        }
+
+        Status step() override {
+            Metrics& metrics = Metrics::instance();
+            if (pipeline->stopping.load(std::memory_order_acquire)) {
+                pipeline->pkts.close();
+                pipeline->frames.close();
+                return Done;
+            }
+            for (int i = 0; i < STEP_BUDGET; i++) {
+                if (pending) {
+                    int ret = pipeline->frames.tryPush(pending);
+                    if (ret == 0)
+                        return Wait;
+                    pending = nullptr;
+                    if (ret < 0) {
+                        pipeline->pkts.close();
+                        return Done;
+                    }
+                }
+                StageTimer timer;
+                if (pipeline->decoder.receive(frame) > 0) {
+                    metrics.decoder_latency_us.record(timer.us());
+                    pending = frame;
+                    frame = av_frame_alloc();
+                    continue;
+                }
+                if (draining) {
+                    pipeline->frames.close();
+                    return Done;
+                }
+                AVPacket* pkt;
+                if (!pipeline->pkts.tryPop(pkt))
+                    return Wait;
+                pipeline->decoder.send(pkt);
+                if (pkt)
+                    av_packet_free(&pkt);
+                else
+                    draining = true;
+            }
+            return Again;
+        }
+    };
+
+    // Follows the decoded format like the filter thread of the threaded
+    // pipeline. Before converting it reserves the frames swr will produce, so
+    // render() never has to wait for the ring; wait() only yields for the
+    // odd frame larger than the whole ring and for what swr still holds when
+    // the format changes.
+    struct FilterTask : PipelineTask {
+        ScheduledPipeline* pipeline;
+        RingSink ring_sink;
+        SwrRender render;
+        AVFrame* frame = nullptr;
+        std::atomic<int> space_needed{ 0 };
+
+        FilterTask(ScheduledPipeline* pipeline, int sample_rate, int channels) :
+            pipeline(pipeline),
+            ring_sink(&pipeline->ring, sample_rate, channels),
+            render(nullptr, &ring_sink, AV_SAMPLE_FMT_FLT, 0)
+        { }
+
+        ~FilterTask() {
+            av_frame_free(&frame);
+        }
+
+        // frames render() writes for in_samples, nullptr flushes
+        int outFrames(int in_samples) const {
+            if (render.swr && !render.kernel)
+                return swr_get_out_samples(render.swr, in_samples);
+            return in_samples;
+        }
+
+        // true when the ring has room for frames, otherwise publishes what is
+        // needed for kick() and sets parked to the status to return
+        bool reserve(int frames, Status& parked) {
+            frames = (std::min)(frames, pipeline->ring.size());
+            if (pipeline->ring.writable() >= frames)
+                return true;
+            space_needed.store((std::max)(1, frames), std::memory_order_release);
+            // a kick() between the check above and the store saw nothing to
+            // wake, look again; when kick() took the request it wakes the task
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            parked = Wait;
+            if (pipeline->ring.writable() >= frames && space_needed.exchange(0, std::memory_order_acq_rel) > 0)
+                parked = Again;
+            return false;
+        }
+
+        Status step() override {
+            Metrics& metrics = Metrics::instance();
+            auto wait = [] { std::this_thread::yield(); };
+            if (pipeline->stopping.load(std::memory_order_acquire)) {
+                pipeline->frames.close();
+                pipeline->ring.close();
+                return Done;
+            }
+            for (int i = 0; i < STEP_BUDGET; i++) {
+                if (!frame && !pipeline->frames.tryPop(frame))
+                    return Wait;
+                Status parked;
+                if (!frame) {
+                    if (!reserve(outFrames(0), parked))
+                        return parked;
+                    render.render(nullptr, 0, wait);
+                    pipeline->ring.close();
+                    return Done;
+                }
+                if (render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait) < 0) {
+                    pipeline->error = "Failed to initialize SwrContext";
+                    av_frame_free(&frame);
+                    pipeline->frames.close();
+                    pipeline->ring.close();
+                    return Done;
+                }
+                if (!reserve(outFrames(frame->nb_samples), parked))
+                    return parked;
+                StageTimer timer;
+                render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+                metrics.filter_latency_us.record(timer.us());
+                av_frame_free(&frame);
+            }
+            return Again;
+        }
+    };
+
+    PipelineScheduler* scheduler;
+    std::atomic<bool> stopping{ false };
+    ReaderTask reader_task;
+    DecoderTask decoder_task;
+    FilterTask filter_task;
+    bool started = false;
+};
+
+}
+
+#endif // PIPELINESCHEDULER_HPP
@@ -0,0 +1,158 @@
+#ifndef PLAYBACKCLOCK_HPP
+#define PLAYBACKCLOCK_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "AudioSink.hpp"
+
+namespace avio {
+
+// Where playback is, in frames at the sink rate since the device started.
+// update() reads the device clock of the sink (AudioSink::devicePosition)
+// on the render thread, frames() may be called from any thread and moves
+// the last reading forward by the time passed since, at the device rate
+// measured against steady_clock and never past the frames written. The rate
+// is measured over the time since the device last ran dry, so it converges
+// on the real crystal offset within a few seconds of steady playback.
+
+class PlaybackClock {
+public:
+    PlaybackClock(AudioSink* sink) : sink(sink), sample_rate(sink->sampleRate()) { }
+
+    PlaybackClock(const PlaybackClock&) = delete;
+    PlaybackClock& operator=(const PlaybackClock&) = delete;
+
+    // render thread, false when the sink has no clock
+    bool update() {
+        DevicePosition position;
+        if (!sink->devicePosition(position))
+            return false;
+
+        // an empty device stops its position, measure from where it restarts
+        if (!anchored || position.queued <= 0) {
+            anchor = position;
+            anchored = position.queued > 0;
+        }
+        else if (position.time_us - anchor.time_us >= RATE_WINDOW_US) {
+            double expected = (double)(position.time_us - anchor.time_us) * sample_rate / 1e6;
+            ratio.store((double)(position.played - anchor.played) / expected, std::memory_order_relaxed);
+        }
+
+        sequence.fetch_add(1, std::memory_order_acq_rel);
+        played.store(position.played, std::memory_order_relaxed);
+        queued.store(position.queued, std::memory_order_relaxed);
+        time_us.store(position.time_us, std::memory_order_relaxed);
+        sequence.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    // frame heard at now_us (steady_clock), sample accurate up to the
+    // device clock's own resolution
+    uint64_t frames(int64_t now_us) const {
+        uint64_t base;
+        int ahead;
+        int64_t at;
+        uint32_t seq;
+        do {
+            seq = sequence.load(std::memory_order_acquire);
+            base = played.load(std::memory_order_relaxed);
+            ahead = queued.load(std::memory_order_relaxed);
+            at = time_us.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((seq & 1) || seq != sequence.load(std::memory_order_relaxed));
+        if (!at)
+            return 0;
+        double since = (double)(std::max)((int64_t)0, now_us - at) * sample_rate / 1e6;
+        int64_t moved = (int64_t)(since * ratio.load(std::memory_order_relaxed));
+        return base + (uint64_t)(std::min)(moved, (int64_t)(std::max)(0, ahead));
+    }
+
+    uint64_t frames() const { return frames(steadyTimeUs()); }
+    double seconds() const { return (double)frames() / sample_rate; }
+
+    // measured device rate against steady_clock, parts per million
+    double ppm() const { return (ratio.load(std::memory_order_relaxed) - 1.0) * 1e6; }
+
+    int sampleRate() const { return sample_rate; }
+
+private:
+    static const int64_t RATE_WINDOW_US = 1000000;
+
+    AudioSink* sink;
+    int sample_rate;
+
+    // render thread only
+    DevicePosition anchor;
+    bool anchored = false;
+
+    // last reading, written under an odd sequence number
+    std::atomic<uint32_t> sequence{ 0 };
+    std::atomic<uint64_t> played{ 0 };
+    std::atomic<int> queued{ 0 };
+    std::atomic<int64_t> time_us{ 0 };
+    std::atomic<double> ratio{ 1.0 };
+};
+
+// Keeps the audio buffered ahead of the device at a target when the producer
+// runs on another clock than the device, a stream paced by its source or a
+// file paced by a wall clock. Fed the buffered frames (frames written less
+// the PlaybackClock position) once per chunk, it answers with the fraction
+// the resampler has to stretch (> 0) or shrink its output by, in ppm, from a
+// PI loop on the low passed fill: bandwidth is the natural frequency of the
+// loop in rad/s at critical damping, max_ppm bounds the correction so it
+// stays inaudible. delta() turns it into swr_set_compensation arguments and
+// carries the fractions over, so the mean correction is exact.
+
+class DriftController {
+public:
+    double bandwidth = 0.1;
+    double smoothing_s = 1.0;       // time constant of the fill filter
+    int max_ppm = 1000;
+
+    DriftController(int sample_rate, int target_frames) :
+        sample_rate(sample_rate), target(target_frames), fill(target_frames) { }
+
+    // buffered: frames ahead of the playback position, frames: frames
+    // produced since the last update. Returns the correction in ppm.
+    double update(int64_t buffered, int frames) {
+        double dt = (double)frames / sample_rate;
+        fill += (buffered - fill) * (std::min)(1.0, dt / smoothing_s);
+        double error = (target - fill) / sample_rate;
+        double kp = 2 * bandwidth;
+        double ki = bandwidth * bandwidth;
+        double limit = max_ppm / 1e6;
+        double out = kp * error + ki * (integral + error * dt);
+        // no wind up while the output is clamped
+        if (std::fabs(out) < limit)
+            integral += error * dt;
+        correction = (std::max)(-limit, (std::min)(limit, kp * error + ki * integral));
+        return correction * 1e6;
+    }
+
+    // sample_delta for swr_set_compensation over the next distance output frames
+    int delta(int distance) {
+        double exact = correction * distance + carry;
+        int delta = (int)std::lround(exact);
+        carry = exact - delta;
+        return delta;
+    }
+
+    double ppm() const { return correction * 1e6; }
+    double fillFrames() const { return fill; }
+    int targetFrames() const { return target; }
+
+private:
+    int sample_rate;
+    int target;
+    double fill;
+    double integral = 0;
+    double correction = 0;
+    double carry = 0;
+};
+
+}
+
+#endif // PLAYBACKCLOCK_HPP
@@ -0,0 +1,451 @@
+#ifndef PLAYLIST_HPP
+#define PLAYLIST_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <stdexcept>
+#include <cstdint>
+#include <algorithm>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/mathematics.h>
+}
+
+#include "AudioReader.hpp"
+#include "AudioDecoder.hpp"
+#include "PacketIndex.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+namespace avio {
+
+// Drops count samples from the start of a decoded audio frame by moving the
+// plane pointers, the buffers stay referenced through frame->buf
+inline void frameSkipStart(AVFrame* frame, int count, AVRational time_base) {
+    AVSampleFormat fmt = (AVSampleFormat)frame->format;
+    int channels = frame->ch_layout.nb_channels;
+    bool planar = av_sample_fmt_is_planar(fmt);
+    size_t step = (size_t)count * av_get_bytes_per_sample(fmt) * (planar ? 1 : channels);
+    int planes = planar ? channels : 1;
+    for (int i = 0; i < planes; i++) {
+        frame->extended_data[i] += step;
+        if (frame->extended_data != frame->data && i < AV_NUM_DATA_POINTERS)
+            frame->data[i] += step;
+    }
+    frame->nb_samples -= count;
+    if (frame->pts != AV_NOPTS_VALUE && frame->sample_rate > 0)
+        frame->pts += av_rescale_q(count, AVRational{ 1, frame->sample_rate }, time_base);
+}
+
+// One entry of a playlist, reader and decoder with the encoder delay and
+// padding removed. The decoder runs with AV_CODEC_FLAG2_SKIP_MANUAL, the
+// priming and padding the demuxer knows about (LAME tag, mp4 edit lists, Ogg
+// pre-skip and end trimming) arrive as skip side data and are cut here, so
+// consecutive tracks splice sample exact and the amounts can be reported.
+//
+// seek() is sample accurate. It jumps to the last PacketIndex entry at least
+// a decoder preroll before the target, by byte offset where the container
+// allows it, and decodes forward discarding up to the exact sample. Without
+// an index yet it falls back to av_seek_frame on the computed timestamp and
+// trusts the packet timestamps the demuxer reports after it.
+
+class Track {
+public:
+    StageTimer created;
+    AudioReader reader;
+    AudioDecoder decoder;
+
+    double open_ms = 0;             // open, probe and decoder setup
+    double first_frame_ms = -1;     // until the first frame was decoded
+    int64_t samples = 0;            // handed out after trimming
+    int64_t trimmed_start = 0;
+    int64_t trimmed_end = 0;
+    std::unique_ptr<PacketIndexer> indexer;     // with OpenOptions::index
+    const PacketIndex* shared_index = nullptr;  // built elsewhere, used without an indexer, not owned
+
+    Track(const std::string& filename, const OpenOptions& options = OpenOptions()) :
+        reader(filename, options),
+        decoder(reader.stream, AV_CODEC_FLAG2_SKIP_MANUAL),
+        pkt(av_packet_alloc())
+    {
+        if (options.index)
+            indexer.reset(new PacketIndexer(filename, reader.stream_index, options));
+        open_ms = created.us() / 1000.0;
+    }
+
+    ~Track() {
+        clearAhead();
+        av_packet_free(&pkt);
+    }
+
+    Track(const Track&) = delete;
+    Track& operator=(const Track&) = delete;
+
+    // length the container declares, 0 if unknown
+    int64_t nominalSamples() const {
+        return (int64_t)(reader.duration() * decoder.sampleRate() + 0.5);
+    }
+
+    // decode ahead until ms of audio are waiting, run by the prefetch thread
+    int prefetch(int ms) {
+        int64_t buffered_us = 0;
+        while (buffered_us < (int64_t)ms * 1000) {
+            AVFrame* frame = av_frame_alloc();
+            int ret = decode(frame);
+            if (ret <= 0) {
+                av_frame_free(&frame);
+                return ret;
+            }
+            buffered_us += (int64_t)frame->nb_samples * 1000000 / frame->sample_rate;
+            ahead.push_back(frame);
+        }
+        return 1;
+    }
+
+    // Moves to sample, counted in trimmed samples from the start of the track,
+    // the next read() starts exactly there. 0 or a negative AVERROR.
+    int seek(int64_t sample) {
+        int ret = origin_known ? 0 : prefetch(1);
+        if (ret < 0)
+            return ret;
+        clearAhead();
+        discard_to = (std::max)(sample, (int64_t)0);
+
+        int rate = decoder.sampleRate();
+        int64_t start = discard_to - (std::max)(reader.stream->codecpar->seek_preroll, rate / 10);
+        if (start <= 0 || rate <= 0)
+            return rewind();
+
+        AVRational time_base = reader.stream->time_base;
+        int64_t target = origin_pts + av_rescale_q(start, AVRational{ 1, rate }, time_base);
+        const PacketIndex* index = indexer ? indexer->index() : shared_index;
+        if (index) {
+            const PacketIndex::Entry* entry = index->find(target);
+            if (!entry || entry == &index->entries.front())
+                return rewind();
+            target = entry->pts;
+            if (index->byte_seekable && !(reader.fmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+                restart();
+                if (av_seek_frame(reader.fmt_ctx, reader.stream_index, entry->pos, AVSEEK_FLAG_BYTE) < 0)
+                    return rewind();
+                anchoring = true;
+                anchor_pos = entry->pos;
+                anchor_pts = entry->pts;
+                return 0;
+            }
+        }
+        restart();
+        if (av_seek_frame(reader.fmt_ctx, reader.stream_index, target, AVSEEK_FLAG_BACKWARD) < 0)
+            return rewind();
+        anchoring = true;
+        anchor_pos = -1;
+        return 0;
+    }
+
+    // sample the next read() starts at
+    int64_t position() const {
+        int64_t buffered = 0;
+        for (const AVFrame* frame : ahead)
+            buffered += frame->nb_samples;
+        return next_sample - buffered;
+    }
+
+    // 1 with a frame, 0 at the end of the track or a negative AVERROR
+    int read(AVFrame* frame) {
+        av_frame_unref(frame);
+        if (!ahead.empty()) {
+            AVFrame* front = ahead.front();
+            ahead.pop_front();
+            av_frame_move_ref(frame, front);
+            av_frame_free(&front);
+            return 1;
+        }
+        return decode(frame);
+    }
+
+private:
+    AVPacket* pkt;
+    std::deque<AVFrame*> ahead;
+    bool draining = false;
+    int64_t skip_pending = 0;
+    int64_t next_sample = 0;        // position after the last decoded frame
+    int64_t discard_to = 0;         // decoded samples before this are dropped after a seek
+    bool origin_known = false;
+    int64_t origin_pts = 0;         // pts of trimmed sample 0
+    bool anchoring = false;         // waiting for the first packet after a seek
+    int64_t anchor_pos = -1;        // byte offset of that packet, -1 to go by its pts
+    int64_t anchor_pts = 0;
+
+    void clearAhead() {
+        for (AVFrame* frame : ahead)
+            av_frame_free(&frame);
+        ahead.clear();
+    }
+
+    void restart() {
+        decoder.flush();
+        draining = false;
+        skip_pending = 0;
+        anchoring = false;
+    }
+
+    // back to the first packet, trimming starts over from the skip side data
+    int rewind() {
+        restart();
+        int64_t start = reader.stream->start_time != AV_NOPTS_VALUE ? reader.stream->start_time : 0;
+        int ret = av_seek_frame(reader.fmt_ctx, reader.stream_index, start, AVSEEK_FLAG_BACKWARD);
+        if (ret < 0 && !(reader.fmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK))
+            ret = av_seek_frame(reader.fmt_ctx, reader.stream_index, 0, AVSEEK_FLAG_BYTE);
+        next_sample = 0;
+        return ret < 0 ? ret : 0;
+    }
+
+    // the first packet after a seek tells where decoding resumes, a byte seek
+    // that resynced past the indexed packet falls back to a rewind
+    bool anchor(const AVPacket* packet) {
+        int64_t pts;
+        if (anchor_pos >= 0) {
+            if (packet->pos >= 0 && packet->pos < anchor_pos)
+                return false;
+            if (packet->pos != anchor_pos) {
+                rewind();
+                return false;
+            }
+            pts = anchor_pts;
+        }
+        else {
+            if (packet->pts == AV_NOPTS_VALUE)
+                return false;
+            pts = packet->pts;
+        }
+        next_sample = av_rescale_q(pts - origin_pts, reader.stream->time_base, AVRational{ 1, decoder.sampleRate() });
+        anchoring = false;
+        return true;
+    }
+
+    int decode(AVFrame* frame) {
+        while (true) {
+            int ret = decoder.receive(frame);
+            if (ret < 0)
+                return ret;
+            if (ret > 0) {
+                trim(frame);
+                if (frame->nb_samples > 0 && !origin_known) {
+                    origin_pts = frame->pts != AV_NOPTS_VALUE ? frame->pts : 0;
+                    origin_known = true;
+                }
+                if (next_sample < discard_to && frame->nb_samples > 0) {
+                    int drop = (int)(std::min)(discard_to - next_sample, (int64_t)frame->nb_samples);
+                    frameSkipStart(frame, drop, reader.stream->time_base);
+                    next_sample += drop;
+                }
+                if (frame->nb_samples > 0) {
+                    if (first_frame_ms < 0)
+                        first_frame_ms = created.us() / 1000.0;
+                    samples += frame->nb_samples;
+                    next_sample += frame->nb_samples;
+                    return 1;
+                }
+                av_frame_unref(frame);
+                continue;
+            }
+            if (draining)
+                return 0;
+
+            ret = reader.read(pkt);
+            if (ret < 0)
+                return ret;
+            if (ret == 0) {
+                draining = true;
+                decoder.send(nullptr);
+                continue;
+            }
+            if (anchoring && !anchor(pkt)) {
+                av_packet_unref(pkt);
+                continue;
+            }
+            ret = decoder.send(pkt);
+            av_packet_unref(pkt);
+            if (ret < 0 && ret != AVERROR(EAGAIN))
+                return ret;
+        }
+    }
+
+    static int64_t readLE32(const uint8_t* p) {
+        return (int64_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    }
+
+    // side data holds le32 samples to skip at the start, le32 to discard at the end
+    void trim(AVFrame* frame) {
+        int64_t discard = 0;
+        AVFrameSideData* side = av_frame_get_side_data(frame, AV_FRAME_DATA_SKIP_SAMPLES);
+        if (side && side->size >= 10) {
+            skip_pending += readLE32(side->data);
+            discard = readLE32(side->data + 4);
+        }
+        int skip = (int)(std::min)(skip_pending, (int64_t)frame->nb_samples);
+        if (skip) {
+            frameSkipStart(frame, skip, reader.stream->time_base);
+            skip_pending -= skip;
+            trimmed_start += skip;
+        }
+        int cut = (int)(std::min)(discard, (int64_t)frame->nb_samples);
+        frame->nb_samples -= cut;
+        trimmed_end += cut;
+    }
+};
+
+// Plays a list of files as one continuous stream of frames. While a track
+// plays, the next one is opened, probed and decoded prefetch_ms ahead on a
+// background thread, so at the boundary next() carries straight on with its
+// first frame. Consumers keep their sink and resampler across tracks and
+// follow format changes with SwrRender::reconfigure. Files that fail to open
+// are skipped with the error kept in their stats. A track that opened but
+// failed to decode ahead still plays, decoded at the boundary, with the
+// failure kept in its prefetch_error and counted in prefetch_failures.
+
+class Playlist {
+public:
+    struct TrackStats {
+        std::string filename;
+        double open_ms = 0;
+        double first_frame_ms = 0;
+        double boundary_ms = 0;     // next() stalled between the last frame before and the first of this track
+        int64_t samples = 0;
+        int64_t nominal_samples = 0;
+        int64_t trimmed_start = 0;
+        int64_t trimmed_end = 0;
+        bool cache_hit = false;     // stream info came from open_options.cache
+        std::string error;
+        std::string prefetch_error; // decoding ahead failed, the boundary was not covered
+    };
+
+    std::vector<std::string> files;
+    std::vector<TrackStats> stats;
+    bool prefetch;
+    int prefetch_ms = 500;
+    int prefetch_failures = 0;
+    OpenOptions open_options;       // used for every track, set before the first next()
+
+    Playlist(const std::vector<std::string>& files, bool prefetch = true) :
+        files(files), stats(files.size()), prefetch(prefetch)
+    {
+        for (size_t i = 0; i < files.size(); i++)
+            stats[i].filename = files[i];
+    }
+
+    ~Playlist() {
+        if (loader.joinable())
+            loader.join();
+    }
+
+    Playlist(const Playlist&) = delete;
+    Playlist& operator=(const Playlist&) = delete;
+
+    // 1 with the next frame of the playlist, 0 after the last track
+    int next(AVFrame* frame) {
+        while (true) {
+            if (current) {
+                int ret = current->read(frame);
+                if (ret > 0) {
+                    if (boundary) {
+                        stats[index].boundary_ms = boundary->us() / 1000.0;
+                        boundary.reset();
+                    }
+                    return 1;
+                }
+                if (ret < 0)
+                    stats[index].error = "decode error";
+                finish();
+                boundary.reset(new StageTimer());
+                index++;
+            }
+            if (index >= files.size())
+                return 0;
+
+            if (loader.joinable())
+                loader.join();
+            else
+                load(index);
+
+            current = std::move(upcoming);
+            if (!current) {
+                stats[index].error = upcoming_error;
+                index++;
+                continue;
+            }
+            if (!upcoming_prefetch_error.empty()) {
+                stats[index].prefetch_error = upcoming_prefetch_error;
+                prefetch_failures++;
+            }
+            if (prefetch && index + 1 < files.size()) {
+                size_t following = index + 1;
+                loader = std::thread([this, following] {
+                    AVIO_TRACE_THREAD("prefetch");
+                    load(following);
+                });
+            }
+        }
+    }
+
+    size_t trackIndex() const { return index; }
+    Track* track() { return current.get(); }
+
+private:
+    size_t index = 0;
+    std::unique_ptr<Track> current;
+    std::unique_ptr<Track> upcoming;
+    std::string upcoming_error;
+    std::string upcoming_prefetch_error;
+    std::unique_ptr<StageTimer> boundary;
+    std::thread loader;
+
+    void load(size_t i) {
+        upcoming_error.clear();
+        upcoming_prefetch_error.clear();
+        std::unique_ptr<Track> track;
+        try {
+            track.reset(new Track(files[i], open_options));
+        }
+        catch (const std::exception& e) {
+            upcoming_error = e.what();
+            return;
+        }
+        // the track is kept when decoding ahead fails, read() decodes on
+        // demand and reports its own errors
+        if (prefetch) {
+            try {
+                int ret = track->prefetch(prefetch_ms);
+                if (ret < 0)
+                    upcoming_prefetch_error = "decode error " + std::to_string(ret);
+            }
+            catch (const std::exception& e) {
+                upcoming_prefetch_error = e.what();
+            }
+        }
+        upcoming = std::move(track);
+    }
+
+    void finish() {
+        TrackStats& s = stats[index];
+        s.open_ms = current->open_ms;
+        s.first_frame_ms = current->first_frame_ms;
+        s.samples = current->samples;
+        s.nominal_samples = current->nominalSamples();
+        s.trimmed_start = current->trimmed_start;
+        s.trimmed_end = current->trimmed_end;
+        s.cache_hit = current->reader.cache_hit;
+        current.reset();
+    }
+};
+
+}
+
+#endif // PLAYLIST_HPP
@@ -0,0 +1,133 @@
+#ifndef REALTIME_HPP
+#define REALTIME_HPP
+
+#include <atomic>
+#include <cstdint>
+
+namespace avio {
+
+enum RenderError {
+    RENDER_OK = 0,
+    RENDER_DEVICE_PADDING,      // the device fill could not be read
+    RENDER_DEVICE_BUFFER,       // no device buffer to write into
+    RENDER_DEVICE_RELEASE,      // the written frames were not accepted
+    RENDER_DEVICE_START,        // the device did not start
+    RENDER_DEVICE_TIMEOUT,      // no period was signalled within the timeout
+    RENDER_NOT_PREPARED,        // run() before prepare() in realtime mode
+    RENDER_NOT_REALTIME,        // a path that locks or allocates in realtime mode
+    RENDER_ERRORS
+};
+
+// Errors of the render thread, kept in preallocated atomics so reporting one
+// never allocates, locks, throws or prints. The first and the latest error
+// are kept with a detail code (an HRESULT or AVERROR) next to a count per
+// kind, another thread reads them and turns them into text with message().
+
+class RenderStatus {
+public:
+    void fail(RenderError error, int64_t detail = 0) {
+        int expected = RENDER_OK;
+        if (first_error.compare_exchange_strong(expected, error, std::memory_order_relaxed))
+            first_detail.store(detail, std::memory_order_relaxed);
+        last_error.store(error, std::memory_order_relaxed);
+        last_detail.store(detail, std::memory_order_relaxed);
+        counts[error].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool ok() const { return first() == RENDER_OK; }
+    RenderError first() const { return (RenderError)first_error.load(std::memory_order_relaxed); }
+    RenderError last() const { return (RenderError)last_error.load(std::memory_order_relaxed); }
+    int64_t firstDetail() const { return first_detail.load(std::memory_order_relaxed); }
+    int64_t lastDetail() const { return last_detail.load(std::memory_order_relaxed); }
+    uint64_t count(RenderError error) const { return counts[error].load(std::memory_order_relaxed); }
+    uint64_t failures() const { return total.load(std::memory_order_relaxed); }
+
+    void reset() {
+        first_error.store(RENDER_OK, std::memory_order_relaxed);
+        last_error.store(RENDER_OK, std::memory_order_relaxed);
+        first_detail.store(0, std::memory_order_relaxed);
+        last_detail.store(0, std::memory_order_relaxed);
+        for (int i = 0; i < RENDER_ERRORS; i++)
+            counts[i].store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+    }
+
+    static const char* message(RenderError error) {
+        static const char* const messages[RENDER_ERRORS] = {
+            "ok",
+            "device padding",
+            "device buffer",
+            "device release",
+            "device start",
+            "device timeout",
+            "not prepared",
+            "not realtime safe",
+        };
+        return error >= 0 && error < RENDER_ERRORS ? messages[error] : "unknown";
+    }
+
+private:
+    std::atomic<int> first_error{ RENDER_OK };
+    std::atomic<int> last_error{ RENDER_OK };
+    std::atomic<int64_t> first_detail{ 0 };
+    std::atomic<int64_t> last_detail{ 0 };
+    std::atomic<uint64_t> counts[RENDER_ERRORS] = {};
+    std::atomic<uint64_t> total{ 0 };
+};
+
+// Heap and lock calls made by threads while they are inside a RealtimeScope.
+// Nothing is counted unless the process interposes the allocator and
+// pthread_mutex_lock and forwards each call here, as bench_render rt does on
+// glibc. The state is constant initialized, the hooks may run before main.
+
+class RealtimeAudit {
+public:
+    struct Counts {
+        uint64_t allocations = 0;
+        uint64_t frees = 0;
+        uint64_t locks = 0;
+    };
+
+    // called by the hooks on every thread, counts only inside a scope
+    static void allocated() { if (inside) allocations.fetch_add(1, std::memory_order_relaxed); }
+    static void freed() { if (inside) frees.fetch_add(1, std::memory_order_relaxed); }
+    static void locked() { if (inside) lock_count.fetch_add(1, std::memory_order_relaxed); }
+
+    static Counts counts() {
+        Counts result;
+        result.allocations = allocations.load(std::memory_order_relaxed);
+        result.frees = frees.load(std::memory_order_relaxed);
+        result.locks = lock_count.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    static void reset() {
+        allocations.store(0, std::memory_order_relaxed);
+        frees.store(0, std::memory_order_relaxed);
+        lock_count.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    friend class RealtimeScope;
+
+    static inline thread_local bool inside = false;
+    static inline std::atomic<uint64_t> allocations{ 0 };
+    static inline std::atomic<uint64_t> frees{ 0 };
+    static inline std::atomic<uint64_t> lock_count{ 0 };
+};
+
+// Marks the calling thread as realtime for its lifetime, scopes do not nest
+
+class RealtimeScope {
+public:
+    RealtimeScope() { RealtimeAudit::inside = true; }
+    ~RealtimeScope() { RealtimeAudit::inside = false; }
+
+    RealtimeScope(const RealtimeScope&) = delete;
+    RealtimeScope& operator=(const RealtimeScope&) = delete;
+};
+
+}
+
+#endif // REALTIME_HPP
@@ -0,0 +1,129 @@
+#ifndef RENDERSCHEDULER_HPP
+#define RENDERSCHEDULER_HPP
+
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "AudioSink.hpp"
+#include "PcmRing.hpp"
+#include "LatencyController.hpp"
+#include "Realtime.hpp"
+#include "Trace.hpp"
+#include "Metrics.hpp"
+
+namespace avio {
+
+// Drives the render thread. In Event mode the thread sleeps until the sink
+// reports a free period and then fills it from the ring, in Polling mode it
+// retries every poll_ms while the device buffer is full, which is how
+// WinAudio::run worked originally. Event mode falls back to polling for
+// sinks that cannot signal.
+//
+// The device is kept filled to the LatencyController target rather than to
+// the whole buffer, and it is started once the first decoded audio reaches
+// that target. prefill_silence restores the old behavior of starting on a
+// full buffer of silence and keeping the whole buffer filled, for comparison.
+//
+// step() neither allocates nor locks, a period the sink does not signal in
+// time is recorded in status when one is set.
+
+class RenderScheduler {
+public:
+    enum Mode { Polling, Event };
+    using Clock = std::chrono::steady_clock;
+
+    AudioSink* sink;
+    PcmRing* ring;
+    Mode mode;
+    LatencyController latency;
+    int poll_ms = 5;
+    int timeout_ms = 2000;
+    bool prefill_silence = false;
+    RenderStatus* status = nullptr;
+
+    uint64_t wakeups = 0;
+    uint64_t frames_rendered = 0;
+
+    RenderScheduler(AudioSink* sink, PcmRing* ring, Mode mode = Event, int latency_ms = 100) :
+        sink(sink),
+        ring(ring),
+        mode(sink->eventDriven() ? mode : Polling),
+        latency(sink->sampleRate(), sink->periodFrames(), sink->bufferFrames(), latency_ms),
+        created(Clock::now())
+    { }
+
+    // one pass of the render loop, returns 0 once the ring is drained and closed
+    int step() {
+        if (!started && prefill_silence)
+            startOnSilence();
+
+        if (ring->finished()) {
+            start();
+            return 0;
+        }
+
+        StageTimer timer;
+        int padding = sink->bufferFrames() - sink->available();
+        int target = prefill_silence ? sink->bufferFrames() : latency.target();
+        int room = (std::max)(0, target - padding);
+        int written = renderFromRing(sink, ring, room);
+        frames_rendered += written;
+        AVIO_TRACE_COUNTER("ring fill", ring->readable());
+        Metrics::instance().render_latency_us.record(timer.us());
+
+        if (!started) {
+            if (padding + written >= target)
+                start();
+            else
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return 1;
+        }
+
+        latency.observe(padding, written < room);
+
+        if (mode == Event) {
+            if (!sink->waitPeriod(timeout_ms) && status)
+                status->fail(RENDER_DEVICE_TIMEOUT);
+            wakeups++;
+        }
+        else if (!written) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+            wakeups++;
+        }
+        return 1;
+    }
+
+    // milliseconds from construction until the first decoded sample reaches
+    // the speaker, including any silence queued ahead of it, -1 before start
+    double timeToFirstSample() const { return first_sample_ms; }
+
+private:
+    bool started = false;
+    Clock::time_point created;
+    double first_sample_ms = -1;
+
+    void start(int silent_frames = 0) {
+        if (started) return;
+        sink->start();
+        started = true;
+        first_sample_ms = std::chrono::duration<double, std::milli>(Clock::now() - created).count()
+                        + 1000.0 * silent_frames / sink->sampleRate();
+    }
+
+    void startOnSilence() {
+        int frames = sink->available();
+        if (frames > 0) {
+            memset(sink->getBuffer(frames), 0, (size_t)frames * sink->blockAlign());
+            sink->releaseBuffer(frames);
+        }
+        start(frames);
+    }
+};
+
+}
+
+#endif // RENDERSCHEDULER_HPP
@@ -0,0 +1,340 @@
+#ifndef SAMPLECONVERT_HPP
+#define SAMPLECONVERT_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+}
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define AVIO_SIMD_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AVIO_SIMD_SSE2 1
+#endif
+
+namespace avio {
+
+// Sample format kernels for the case where the decoder already runs at the
+// device rate and layout and only the sample format or packing differs, e.g.
+// fltp -> flt or s16 -> flt. They produce the same bits as swr_convert for the
+// same conversion: integer to float multiplies by 2^-15 / 2^-31, float to s16
+// rounds to nearest even and saturates.
+//
+// Each kernel converts frames starting at frame offset of src (one pointer per
+// plane for planar input) into interleaved dst. The vector width is chosen at
+// compile time, AVX2 when built with -mavx2 or /arch:AVX2, SSE2 on any x86-64,
+// scalar otherwise, and stereo/mono get their own instantiations.
+
+typedef void (*ConvertKernel)(uint8_t* dst, const uint8_t* const* src, int offset, int frames, int channels);
+
+namespace kernel {
+
+// NaN comes out as 32767
+inline int16_t toS16(float sample) {
+    float scaled = sample * 32768.0f;
+    if (!(scaled < 32767.0f)) return 32767;
+    if (scaled <= -32768.0f) return -32768;
+    return (int16_t)lrintf(scaled);
+}
+
+// fmt -> fmt, nothing but a copy
+inline void copyPacked(uint8_t* dst, const uint8_t* const* src, int offset, int frames, int block_align) {
+    memcpy(dst, src[0] + (size_t)offset * block_align, (size_t)frames * block_align);
+}
+
+template <int BYTES>
+void same(uint8_t* dst, const uint8_t* const* src, int offset, int frames, int channels) {
+    copyPacked(dst, src, offset, frames, BYTES * channels);
+}
+
+// planar float -> interleaved float
+
+template <int CH>
+void fltpToFlt(uint8_t* dst_bytes, const uint8_t* const* src, int offset, int frames, int channels) {
+    const int ch_count = CH ? CH : channels;
+    float* dst = (float*)dst_bytes;
+
+    if (ch_count == 1) {
+        memcpy(dst, (const float*)src[0] + offset, (size_t)frames * sizeof(float));
+        return;
+    }
+
+    int i = 0;
+    if (CH == 2) {
+        const float* left = (const float*)src[0] + offset;
+        const float* right = (const float*)src[1] + offset;
+#if AVIO_SIMD_AVX2
+        for (; i + 8 <= frames; i += 8) {
+            __m256 l = _mm256_loadu_ps(left + i);
+            __m256 r = _mm256_loadu_ps(right + i);
+            __m256 lo = _mm256_unpacklo_ps(l, r);
+            __m256 hi = _mm256_unpackhi_ps(l, r);
+            _mm256_storeu_ps(dst + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+            _mm256_storeu_ps(dst + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+        }
+#endif
+#if AVIO_SIMD_SSE2
+        for (; i + 4 <= frames; i += 4) {
+            __m128 l = _mm_loadu_ps(left + i);
+            __m128 r = _mm_loadu_ps(right + i);
+            _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(l, r));
+        }
+#endif
+        for (; i < frames; i++) {
+            dst[2 * i] = left[i];
+            dst[2 * i + 1] = right[i];
+        }
+        return;
+    }
+
+    for (int ch = 0; ch < ch_count; ch++) {
+        const float* plane = (const float*)src[ch] + offset;
+        for (i = 0; i < frames; i++)
+            dst[(size_t)i * ch_count + ch] = plane[i];
+    }
+}
+
+// s16 / s32 -> float, packed input is one long run of samples
+
+inline void s16ToFltRun(float* dst, const int16_t* src, int count) {
+    const float scale = 1.0f / (1 << 15);
+    int i = 0;
+#if AVIO_SIMD_AVX2
+    const __m256 scale8 = _mm256_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m256i wide = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(wide), scale8));
+    }
+#endif
+#if AVIO_SIMD_SSE2
+    const __m128 scale4 = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale4));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale4));
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] = src[i] * scale;
+}
+
+inline void s32ToFltRun(float* dst, const int32_t* src, int count) {
+    const float scale = 1.0f / (1U << 31);
+    int i = 0;
+#if AVIO_SIMD_AVX2
+    const __m256 scale8 = _mm256_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale8));
+    }
+#endif
+#if AVIO_SIMD_SSE2
+    const __m128 scale4 = _mm_set1_ps(scale);
+    for (; i + 4 <= count; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale4));
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] = src[i] * scale;
+}
+
+// float -> s16 with round to nearest even and saturation, the same bits as
+// toS16 for every input. The clamp comes before cvtps2dq, which would turn
+// NaN and overflow into INT32_MIN; minps returns its second operand for NaN.
+inline void fltToS16Run(int16_t* dst, const float* src, int count) {
+    int i = 0;
+#if AVIO_SIMD_SSE2
+    const __m128 scale4 = _mm_set1_ps(32768.0f);
+    const __m128 hi4 = _mm_set1_ps(32767.0f);
+    const __m128 lo4 = _mm_set1_ps(-32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128 a = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(src + i), scale4), hi4), lo4);
+        __m128 b = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale4), hi4), lo4);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] = toS16(src[i]);
+}
+
+inline void s16ToFlt(uint8_t* dst, const uint8_t* const* src, int offset, int frames, int channels) {
+    s16ToFltRun((float*)dst, (const int16_t*)src[0] + (size_t)offset * channels, frames * channels);
+}
+
+inline void s32ToFlt(uint8_t* dst, const uint8_t* const* src, int offset, int frames, int channels) {
+    s32ToFltRun((float*)dst, (const int32_t*)src[0] + (size_t)offset * channels, frames * channels);
+}
+
+inline void fltToS16(uint8_t* dst, const uint8_t* const* src, int offset, int frames, int channels) {
+    fltToS16Run((int16_t*)dst, (const float*)src[0] + (size_t)offset * channels, frames * channels);
+}
+
+// planar input through a small stack buffer: convert each plane in blocks,
+// then interleave the floats
+
+template <typename T, void (*RUN)(float*, const T*, int), int CH>
+void planarToFlt(uint8_t* dst_bytes, const uint8_t* const* src, int offset, int frames, int channels) {
+    const int ch_count = CH ? CH : channels;
+    const int BLOCK = 256;
+    float block[BLOCK * 2];
+    float* dst = (float*)dst_bytes;
+
+    if (ch_count == 1) {
+        RUN(dst, (const T*)src[0] + offset, frames);
+        return;
+    }
+
+    for (int start = 0; start < frames; start += BLOCK) {
+        int count = (frames - start < BLOCK) ? frames - start : BLOCK;
+        if (CH == 2) {
+            RUN(block, (const T*)src[0] + offset + start, count);
+            RUN(block + BLOCK, (const T*)src[1] + offset + start, count);
+            const uint8_t* planes[2] = { (const uint8_t*)block, (const uint8_t*)(block + BLOCK) };
+            fltpToFlt<2>((uint8_t*)(dst + (size_t)start * 2), planes, 0, count, 2);
+        }
+        else {
+            for (int ch = 0; ch < ch_count; ch++) {
+                RUN(block, (const T*)src[ch] + offset + start, count);
+                for (int i = 0; i < count; i++)
+                    dst[(size_t)(start + i) * ch_count + ch] = block[i];
+            }
+        }
+    }
+}
+
+template <int CH>
+void fltpToS16(uint8_t* dst_bytes, const uint8_t* const* src, int offset, int frames, int channels) {
+    const int ch_count = CH ? CH : channels;
+    const int BLOCK = 256;
+    float block[BLOCK * (CH ? CH : 1)];
+    int16_t* dst = (int16_t*)dst_bytes;
+
+    for (int start = 0; start < frames; start += BLOCK) {
+        int count = (frames - start < BLOCK) ? frames - start : BLOCK;
+        if (CH) {
+            const uint8_t* planes[CH ? CH : 1];
+            for (int ch = 0; ch < CH; ch++)
+                planes[ch] = src[ch] + (size_t)(offset + start) * sizeof(float);
+            fltpToFlt<CH>((uint8_t*)block, planes, 0, count, CH);
+            fltToS16Run(dst + (size_t)start * CH, block, count * CH);
+        }
+        else {
+            int16_t converted[BLOCK];
+            for (int ch = 0; ch < ch_count; ch++) {
+                fltToS16Run(converted, (const float*)src[ch] + offset + start, count);
+                for (int i = 0; i < count; i++)
+                    dst[(size_t)(start + i) * ch_count + ch] = converted[i];
+            }
+        }
+    }
+}
+
+// mixing, runs of interleaved float at the device format
+
+// dst += src * gain
+inline void mixAddRun(float* dst, const float* src, int count, float gain) {
+    int i = 0;
+#if AVIO_SIMD_AVX2
+    const __m256 gain8 = _mm256_set1_ps(gain);
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), gain8)));
+#endif
+#if AVIO_SIMD_SSE2
+    const __m128 gain4 = _mm_set1_ps(gain);
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), gain4)));
+#endif
+    for (; i < count; i++)
+        dst[i] += src[i] * gain;
+}
+
+// dst = src limited to [-1, 1], NaN becomes 1 as with minps/maxps
+inline void clampRun(float* dst, const float* src, int count) {
+    int i = 0;
+#if AVIO_SIMD_AVX2
+    const __m256 lo8 = _mm256_set1_ps(-1.0f);
+    const __m256 hi8 = _mm256_set1_ps(1.0f);
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_max_ps(_mm256_min_ps(_mm256_loadu_ps(src + i), hi8), lo8));
+#endif
+#if AVIO_SIMD_SSE2
+    const __m128 lo4 = _mm_set1_ps(-1.0f);
+    const __m128 hi4 = _mm_set1_ps(1.0f);
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(dst + i, _mm_max_ps(_mm_min_ps(_mm_loadu_ps(src + i), hi4), lo4));
+#endif
+    for (; i < count; i++) {
+        float sample = src[i] < 1.0f ? src[i] : 1.0f;
+        dst[i] = sample > -1.0f ? sample : -1.0f;
+    }
+}
+
+template <template <int> class K>
+ConvertKernel byChannels(int channels) {
+    if (channels == 1) return K<1>::run;
+    if (channels == 2) return K<2>::run;
+    return K<0>::run;
+}
+
+template <int CH> struct FltpToFlt { static void run(uint8_t* d, const uint8_t* const* s, int o, int f, int c) { fltpToFlt<CH>(d, s, o, f, c); } };
+template <int CH> struct S16pToFlt { static void run(uint8_t* d, const uint8_t* const* s, int o, int f, int c) { planarToFlt<int16_t, s16ToFltRun, CH>(d, s, o, f, c); } };
+template <int CH> struct S32pToFlt { static void run(uint8_t* d, const uint8_t* const* s, int o, int f, int c) { planarToFlt<int32_t, s32ToFltRun, CH>(d, s, o, f, c); } };
+template <int CH> struct FltpToS16 { static void run(uint8_t* d, const uint8_t* const* s, int o, int f, int c) { fltpToS16<CH>(d, s, o, f, c); } };
+
+}
+
+// Kernel for in_fmt -> out_fmt, nullptr when swr is needed for the pair
+inline ConvertKernel findConvertKernel(AVSampleFormat in_fmt, AVSampleFormat out_fmt, int channels) {
+    using namespace kernel;
+    if (out_fmt == AV_SAMPLE_FMT_FLT) {
+        switch (in_fmt) {
+        case AV_SAMPLE_FMT_FLT:  return same<4>;
+        case AV_SAMPLE_FMT_FLTP: return byChannels<FltpToFlt>(channels);
+        case AV_SAMPLE_FMT_S16:  return s16ToFlt;
+        case AV_SAMPLE_FMT_S16P: return byChannels<S16pToFlt>(channels);
+        case AV_SAMPLE_FMT_S32:  return s32ToFlt;
+        case AV_SAMPLE_FMT_S32P: return byChannels<S32pToFlt>(channels);
+        default: return nullptr;
+        }
+    }
+    if (out_fmt == AV_SAMPLE_FMT_S16) {
+        switch (in_fmt) {
+        case AV_SAMPLE_FMT_S16:  return same<2>;
+        case AV_SAMPLE_FMT_FLT:  return fltToS16;
+        case AV_SAMPLE_FMT_FLTP: return byChannels<FltpToS16>(channels);
+        default: return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+// Kernel when the stream needs no resampling or remixing to reach the sink,
+// nullptr when it does and swr has to be used
+inline ConvertKernel findConvertKernel(const AVChannelLayout* in_layout, AVSampleFormat in_fmt, int in_rate,
+                                       int out_channels, AVSampleFormat out_fmt, int out_rate)
+{
+    if (in_rate != out_rate || in_layout->nb_channels != out_channels)
+        return nullptr;
+
+    AVChannelLayout out_layout;
+    av_channel_layout_default(&out_layout, out_channels);
+    if (av_channel_layout_compare(in_layout, &out_layout) != 0)
+        return nullptr;
+
+    return findConvertKernel(in_fmt, out_fmt, out_channels);
+}
+
+}
+
+#endif // SAMPLECONVERT_HPP
@@ -0,0 +1,84 @@
+#ifndef SAMPLEPOOL_HPP
+#define SAMPLEPOOL_HPP
+
+#include <vector>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+#include <libavutil/mem.h>
+}
+
+namespace avio {
+
+// Reusable sample buffers keyed on format and channel count. A buffer is only
+// reallocated when a request exceeds its capacity, so once the largest frame of
+// a stream has been seen the decode loop runs without touching the heap.
+
+class SamplePool {
+public:
+
+    struct Buffer {
+        AVSampleFormat fmt;
+        int channels;
+        int capacity;
+        int linesize;
+        std::vector<uint8_t*> data;
+    };
+
+    uint64_t allocations = 0;
+
+    SamplePool() { }
+    SamplePool(const SamplePool&) = delete;
+    SamplePool& operator=(const SamplePool&) = delete;
+
+    ~SamplePool() {
+        for (Buffer& buffer : buffers)
+            av_freep(&buffer.data[0]);
+    }
+
+    // data pointers for at least samples frames, one per plane, nullptr on failure
+    uint8_t** get(AVSampleFormat fmt, int channels, int samples) {
+        Buffer* buffer = find(fmt, channels);
+        if (!buffer) {
+            buffers.push_back({ fmt, channels, 0, 0, std::vector<uint8_t*>(planes(fmt, channels), nullptr) });
+            buffer = &buffers.back();
+        }
+
+        if (samples > buffer->capacity) {
+            av_freep(&buffer->data[0]);
+            if (av_samples_alloc(buffer->data.data(), &buffer->linesize, channels, samples, fmt, 1) < 0) {
+                buffer->capacity = 0;
+                return nullptr;
+            }
+            buffer->capacity = samples;
+            allocations++;
+        }
+
+        return buffer->data.data();
+    }
+
+    int capacity(AVSampleFormat fmt, int channels) {
+        Buffer* buffer = find(fmt, channels);
+        return buffer ? buffer->capacity : 0;
+    }
+
+private:
+    std::vector<Buffer> buffers;
+
+    Buffer* find(AVSampleFormat fmt, int channels) {
+        for (Buffer& buffer : buffers) {
+            if (buffer.fmt == fmt && buffer.channels == channels)
+                return &buffer;
+        }
+        return nullptr;
+    }
+
+    static int planes(AVSampleFormat fmt, int channels) {
+        return av_sample_fmt_is_planar(fmt) ? channels : 1;
+    }
+};
+
+}
+
+#endif // SAMPLEPOOL_HPP
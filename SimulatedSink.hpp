@@ -0,0 +1,149 @@
+#ifndef SIMULATEDSINK_HPP
+#define SIMULATEDSINK_HPP
+
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "AudioSink.hpp"
+
+namespace avio {
+
+// A render device without hardware. The device clock is steady_clock and it
+// consumes period_frames at every period boundary, the way a shared mode
+// endpoint drains its buffer. waitPeriod() wakes at the next boundary plus a
+// random scheduling delay of up to jitter_us. When the device wants more
+// than has been written it plays silence and counts an underrun.
+//
+// ppm skews the device clock against steady_clock like a crystal running
+// fast (> 0) or slow, so a nominal 48000 Hz device plays 48000 * (1 + ppm
+// / 1e6) frames per second. With simulated_time set before start() time
+// only moves through advance() and waitPeriod(), which jumps to the next
+// boundary instead of sleeping, so hours of playback run in seconds.
+
+class SimulatedSink : public AudioSink {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    uint64_t underruns = 0;
+    uint64_t underrun_frames = 0;
+    bool simulated_time = false;
+
+    SimulatedSink(int sample_rate, int channels, int bytes_per_sample, int buffer_frames,
+                  int period_frames, int jitter_us = 0, double ppm = 0) :
+        sample_rate(sample_rate),
+        num_channels(channels),
+        block_align(channels * bytes_per_sample),
+        buffer_frames(buffer_frames),
+        period_frames(period_frames),
+        jitter_us(jitter_us),
+        ppm(ppm),
+        period(std::chrono::nanoseconds((int64_t)std::llround(period_frames * 1e9 / (sample_rate * (1 + ppm / 1e6))))),
+        buffer((size_t)buffer_frames * channels * bytes_per_sample)
+    { }
+
+    int sampleRate() const override { return sample_rate; }
+    int channels() const override { return num_channels; }
+    int blockAlign() const override { return block_align; }
+    int bufferFrames() const override { return buffer_frames; }
+    int periodFrames() const override { return period_frames; }
+    bool eventDriven() const override { return true; }
+
+    // the device clock starts running here, like IAudioClient::Start
+    void start() override {
+        if (running) return;
+        start_time = Clock::now();
+        elapsed = Clock::duration::zero();
+        running = true;
+    }
+
+    bool waitPeriod(int timeout_ms) override {
+        if (!running) return false;
+        update();
+        Clock::time_point next = start_time + period * (periods + 1);
+        std::uniform_int_distribution<int> delay(0, jitter_us);
+        next += std::chrono::microseconds(jitter_us ? delay(rng) : 0);
+        if (simulated_time)
+            elapsed = next - start_time;
+        else
+            std::this_thread::sleep_until(next);
+        return true;
+    }
+
+    // simulated_time only
+    void advance(Clock::duration step) { elapsed += step; }
+
+    Clock::time_point now() const { return simulated_time ? start_time + elapsed : Clock::now(); }
+
+    // The frame being heard right now. Each boundary removes the period played
+    // since the one before from the buffer, in between the position moves on
+    // at the device rate through what is still queued.
+    bool devicePosition(DevicePosition& position) override {
+        if (!running) return false;
+        update();
+        Clock::time_point time = now();
+        double into = std::chrono::duration<double>(time - (start_time + period * periods)).count();
+        uint64_t progress = (uint64_t)(std::max)(0.0, into * sample_rate * (1 + ppm / 1e6));
+        position.played = played + (std::min)(progress, written - played);
+        position.queued = (int)(written - position.played);
+        position.time_us = std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+        return true;
+    }
+
+    int available() override {
+        update();
+        return buffer_frames - padding();
+    }
+
+    uint8_t* getBuffer(int frames) override { return buffer.data(); }
+    void releaseBuffer(int frames) override {
+        written += frames;
+        rendered(frames);
+    }
+
+    int padding() const { return (int)(written - played); }
+    uint64_t framesPlayed() const { return played; }
+
+private:
+    int sample_rate;
+    int num_channels;
+    int block_align;
+    int buffer_frames;
+    int period_frames;
+    int jitter_us;
+    double ppm;
+    Clock::duration period;
+    std::vector<uint8_t> buffer;
+    std::mt19937 rng{ 1234 };
+
+    bool running = false;
+    Clock::time_point start_time;
+    Clock::duration elapsed{};
+    int64_t periods = 0;
+    uint64_t written = 0;
+    uint64_t played = 0;
+
+    void update() {
+        if (!running) return;
+        int64_t boundary = (now() - start_time) / period;
+        for (; periods < boundary; periods++) {
+            uint64_t queued = written - played;
+            if (queued < (uint64_t)period_frames) {
+                underruns++;
+                underrun_frames += period_frames - queued;
+                played = written;
+            }
+            else {
+                played += period_frames;
+            }
+        }
+    }
+};
+
+}
+
+#endif // SIMULATEDSINK_HPP
@@ -0,0 +1,309 @@
+#ifndef STREAMINFOCACHE_HPP
+#define STREAMINFOCACHE_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+}
+
+namespace avio {
+
+// What avformat_find_stream_info resolved for the audio stream of a file,
+// enough to set up the stream and the decoder again without probing
+struct StreamInfo {
+    int stream_index = -1;
+    int codec_id = 0;
+    uint32_t codec_tag = 0;
+    int format = -1;
+    int64_t bit_rate = 0;
+    int sample_rate = 0;
+    int channels = 0;
+    int channel_order = 0;
+    uint64_t channel_mask = 0;
+    int frame_size = 0;
+    int initial_padding = 0;
+    int trailing_padding = 0;
+    int seek_preroll = 0;
+    int block_align = 0;
+    int bits_per_coded_sample = 0;
+    int profile = 0;
+    AVRational time_base{ 0, 1 };
+    int64_t start_time = AV_NOPTS_VALUE;
+    int64_t duration = AV_NOPTS_VALUE;
+    int64_t format_duration = AV_NOPTS_VALUE;
+    std::vector<uint8_t> extradata;
+
+    // false for layouts that do not fit a mask, those are not cached
+    bool capture(const AVFormatContext* fmt_ctx, int index) {
+        const AVStream* st = fmt_ctx->streams[index];
+        const AVCodecParameters* par = st->codecpar;
+        if (par->ch_layout.order != AV_CHANNEL_ORDER_NATIVE && par->ch_layout.order != AV_CHANNEL_ORDER_UNSPEC)
+            return false;
+        stream_index = index;
+        codec_id = par->codec_id;
+        codec_tag = par->codec_tag;
+        format = par->format;
+        bit_rate = par->bit_rate;
+        sample_rate = par->sample_rate;
+        channels = par->ch_layout.nb_channels;
+        channel_order = par->ch_layout.order;
+        channel_mask = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0;
+        frame_size = par->frame_size;
+        initial_padding = par->initial_padding;
+        trailing_padding = par->trailing_padding;
+        seek_preroll = par->seek_preroll;
+        block_align = par->block_align;
+        bits_per_coded_sample = par->bits_per_coded_sample;
+        profile = par->profile;
+        time_base = st->time_base;
+        start_time = st->start_time;
+        duration = st->duration;
+        format_duration = fmt_ctx->duration;
+        extradata.assign(par->extradata, par->extradata + (par->extradata ? par->extradata_size : 0));
+        return true;
+    }
+
+    // Fills in the stream the demuxer created from the header alone. Returns
+    // false, leaving the stream untouched, when it does not look like the one
+    // that was cached, the caller then probes as usual.
+    bool apply(AVFormatContext* fmt_ctx) const {
+        if (stream_index < 0 || stream_index >= (int)fmt_ctx->nb_streams)
+            return false;
+        AVStream* st = fmt_ctx->streams[stream_index];
+        AVCodecParameters* par = st->codecpar;
+        if (par->codec_type != AVMEDIA_TYPE_AUDIO && par->codec_type != AVMEDIA_TYPE_UNKNOWN)
+            return false;
+        if (par->codec_id != AV_CODEC_ID_NONE && par->codec_id != codec_id)
+            return false;
+        // packet timestamps are in the time base the demuxer chose
+        if (st->time_base.num != time_base.num || st->time_base.den != time_base.den)
+            return false;
+
+        if (!extradata.empty()) {
+            uint8_t* data = (uint8_t*)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (!data)
+                return false;
+            memcpy(data, extradata.data(), extradata.size());
+            av_freep(&par->extradata);
+            par->extradata = data;
+            par->extradata_size = (int)extradata.size();
+        }
+        par->codec_type = AVMEDIA_TYPE_AUDIO;
+        par->codec_id = (AVCodecID)codec_id;
+        par->codec_tag = codec_tag;
+        par->format = format;
+        par->bit_rate = bit_rate;
+        par->sample_rate = sample_rate;
+        av_channel_layout_uninit(&par->ch_layout);
+        if (channel_order == AV_CHANNEL_ORDER_NATIVE) {
+            par->ch_layout.order = AV_CHANNEL_ORDER_NATIVE;
+            par->ch_layout.nb_channels = channels;
+            par->ch_layout.u.mask = channel_mask;
+        }
+        else {
+            par->ch_layout.order = AV_CHANNEL_ORDER_UNSPEC;
+            par->ch_layout.nb_channels = channels;
+        }
+        par->frame_size = frame_size;
+        par->initial_padding = initial_padding;
+        par->trailing_padding = trailing_padding;
+        par->seek_preroll = seek_preroll;
+        par->block_align = block_align;
+        par->bits_per_coded_sample = bits_per_coded_sample;
+        par->profile = profile;
+        st->start_time = start_time;
+        st->duration = duration;
+        fmt_ctx->duration = format_duration;
+        return true;
+    }
+};
+
+// On-disk cache of StreamInfo, one small text file per media file in dir,
+// named after a hash of the path. An entry is only used while the size and
+// modification time of the file match what was stored with it, a rewritten
+// file is probed again and its entry replaced. The directory has to exist,
+// entries that cannot be written are silently skipped. Several threads may
+// share an instance as long as they do not store the same file at once.
+
+class StreamInfoCache {
+public:
+    std::string dir;
+    std::atomic<uint64_t> hits{ 0 };
+    std::atomic<uint64_t> misses{ 0 };
+
+    StreamInfoCache(const std::string& dir) : dir(dir) { }
+
+    bool load(const std::string& path, StreamInfo& info) {
+        int64_t size, mtime;
+        std::ifstream file(entryPath(path));
+        if (!fileKey(path, size, mtime) || !file) {
+            misses++;
+            return false;
+        }
+
+        std::string line, stored_path;
+        int64_t stored_size = -1, stored_mtime = -1;
+        int version = 0;
+        bool malformed = false;
+        StreamInfo entry;
+        while (std::getline(file, line)) {
+            std::istringstream in(line);
+            std::string key;
+            in >> key;
+            if (key == "path") std::getline(in >> std::ws, stored_path);
+            else if (key == "avio-streaminfo") in >> version;
+            else if (key == "size") in >> stored_size;
+            else if (key == "mtime") in >> stored_mtime;
+            else if (key == "stream_index") in >> entry.stream_index;
+            else if (key == "codec_id") in >> entry.codec_id;
+            else if (key == "codec_tag") in >> entry.codec_tag;
+            else if (key == "format") in >> entry.format;
+            else if (key == "bit_rate") in >> entry.bit_rate;
+            else if (key == "sample_rate") in >> entry.sample_rate;
+            else if (key == "channels") in >> entry.channels;
+            else if (key == "channel_order") in >> entry.channel_order;
+            else if (key == "channel_mask") in >> entry.channel_mask;
+            else if (key == "frame_size") in >> entry.frame_size;
+            else if (key == "initial_padding") in >> entry.initial_padding;
+            else if (key == "trailing_padding") in >> entry.trailing_padding;
+            else if (key == "seek_preroll") in >> entry.seek_preroll;
+            else if (key == "block_align") in >> entry.block_align;
+            else if (key == "bits_per_coded_sample") in >> entry.bits_per_coded_sample;
+            else if (key == "profile") in >> entry.profile;
+            else if (key == "time_base") in >> entry.time_base.num >> entry.time_base.den;
+            else if (key == "start_time") in >> entry.start_time;
+            else if (key == "duration") in >> entry.duration;
+            else if (key == "format_duration") in >> entry.format_duration;
+            else if (key == "extradata") {
+                std::string hex;
+                in >> hex;
+                malformed = malformed || !parseHex(hex, entry.extradata);
+            }
+        }
+
+        if (malformed || version != VERSION || stored_path != path || stored_size != size || stored_mtime != mtime
+            || entry.stream_index < 0 || entry.sample_rate <= 0 || entry.channels <= 0)
+        {
+            misses++;
+            return false;
+        }
+        info = entry;
+        hits++;
+        return true;
+    }
+
+    // written to a temporary file first so a reader never sees half an entry
+    bool store(const std::string& path, const StreamInfo& info) {
+        int64_t size, mtime;
+        if (!fileKey(path, size, mtime))
+            return false;
+
+        std::string target = entryPath(path);
+        std::string temp = target + ".tmp";
+        {
+            std::ofstream file(temp);
+            if (!file)
+                return false;
+            file << "avio-streaminfo " << VERSION << "\n"
+                 << "path " << path << "\n"
+                 << "size " << size << "\n"
+                 << "mtime " << mtime << "\n"
+                 << "stream_index " << info.stream_index << "\n"
+                 << "codec_id " << info.codec_id << "\n"
+                 << "codec_tag " << info.codec_tag << "\n"
+                 << "format " << info.format << "\n"
+                 << "bit_rate " << info.bit_rate << "\n"
+                 << "sample_rate " << info.sample_rate << "\n"
+                 << "channels " << info.channels << "\n"
+                 << "channel_order " << info.channel_order << "\n"
+                 << "channel_mask " << info.channel_mask << "\n"
+                 << "frame_size " << info.frame_size << "\n"
+                 << "initial_padding " << info.initial_padding << "\n"
+                 << "trailing_padding " << info.trailing_padding << "\n"
+                 << "seek_preroll " << info.seek_preroll << "\n"
+                 << "block_align " << info.block_align << "\n"
+                 << "bits_per_coded_sample " << info.bits_per_coded_sample << "\n"
+                 << "profile " << info.profile << "\n"
+                 << "time_base " << info.time_base.num << " " << info.time_base.den << "\n"
+                 << "start_time " << info.start_time << "\n"
+                 << "duration " << info.duration << "\n"
+                 << "format_duration " << info.format_duration << "\n"
+                 << "extradata ";
+            static const char digits[] = "0123456789abcdef";
+            for (uint8_t byte : info.extradata)
+                file << digits[byte >> 4] << digits[byte & 15];
+            file << "\n";
+            if (!file)
+                return false;
+        }
+        std::remove(target.c_str());
+        return std::rename(temp.c_str(), target.c_str()) == 0;
+    }
+
+    // drops everything kept for path, stream info and packet index
+    void erase(const std::string& path) {
+        std::remove(entryPath(path).c_str());
+        std::remove(entryPath(path, ".idx").c_str());
+    }
+
+    // other data about a file (PacketIndex) is kept under the same name
+    std::string entryPath(const std::string& path, const char* extension = ".txt") const {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : path)
+            hash = (hash ^ c) * 1099511628211ULL;
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+        return dir + "/" + name + extension;
+    }
+
+    // size and modification time identify the version of a file
+    static bool fileKey(const std::string& path, int64_t& size, int64_t& mtime) {
+        struct stat st;
+        if (stat(path.c_str(), &st) || (st.st_mode & S_IFMT) != S_IFREG)
+            return false;
+        size = (int64_t)st.st_size;
+        mtime = (int64_t)st.st_mtime;
+        return true;
+    }
+
+private:
+    static const int VERSION = 1;
+
+    // false on an odd length or anything but hex digits
+    static bool parseHex(const std::string& hex, std::vector<uint8_t>& out) {
+        if (hex.size() % 2)
+            return false;
+        out.clear();
+        for (size_t i = 0; i < hex.size(); i += 2) {
+            int high = hexDigit(hex[i]), low = hexDigit(hex[i + 1]);
+            if (high < 0 || low < 0)
+                return false;
+            out.push_back((uint8_t)(high << 4 | low));
+        }
+        return true;
+    }
+
+    static int hexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+};
+
+}
+
+#endif // STREAMINFOCACHE_HPP
@@ -0,0 +1,274 @@
+#ifndef SWRRENDER_HPP
+#define SWRRENDER_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/error.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#include "AudioSink.hpp"
+#include "SamplePool.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+#include "SampleConvert.hpp"
+
+namespace avio {
+
+struct RenderStats {
+    uint64_t frames_rendered = 0;
+    uint64_t bytes_rendered = 0;
+    uint64_t bytes_copied = 0;
+    uint64_t device_calls = 0;
+};
+
+// Converts decoded samples into an AudioSink. In ZeroCopy mode the sink's
+// writable region is requested first and swr_convert writes into it directly,
+// whatever does not fit stays buffered inside swr until the next period frees up.
+// Copy mode keeps the scratch buffer + memcpy path for comparison, the scratch
+// buffer comes from a SamplePool so steady state playback does not allocate.
+// When the stream only differs from the sink in sample format or packing, set
+// kernel (see findConvertKernel) and the samples are converted straight into
+// the sink without swr. A null SwrContext and no kernel means the input is
+// already in the sink format (passthrough).
+// A sink that returns nullptr from getBuffer is treated as full.
+// reconfigure() picks between kernel and swr from the input format and
+// follows format changes, e.g. between the tracks of a playlist.
+
+class SwrRender {
+public:
+    enum Mode { ZeroCopy, Copy };
+
+    SwrContext* swr;
+    AudioSink* sink;
+    AVSampleFormat out_fmt;
+    int in_sample_rate;
+    Mode mode;
+    RenderStats stats;
+    SamplePool pool;
+    ConvertKernel kernel = nullptr;
+    bool use_kernels = true;
+
+    SwrRender(SwrContext* swr, AudioSink* sink, AVSampleFormat out_fmt, int in_sample_rate, Mode mode = ZeroCopy) :
+        swr(swr), sink(sink), out_fmt(out_fmt), in_sample_rate(in_sample_rate), mode(mode) { }
+
+    // owns swr, whether passed in or allocated by reconfigure()
+    ~SwrRender() {
+        swr_free(&swr);
+        av_channel_layout_uninit(&in_layout);
+    }
+
+    SwrRender(const SwrRender&) = delete;
+    SwrRender& operator=(const SwrRender&) = delete;
+
+    // resampler from a decoder's output to the sink format, nullptr on failure
+    static SwrContext* create(const AVChannelLayout* in_layout, AVSampleFormat in_fmt, int in_rate,
+                              int out_channels, AVSampleFormat out_fmt, int out_rate)
+    {
+        SwrContext* swr = nullptr;
+        AVChannelLayout out_layout;
+        av_channel_layout_default(&out_layout, out_channels);
+        if (swr_alloc_set_opts2(&swr, &out_layout, out_fmt, out_rate, in_layout, in_fmt, in_rate, 0, nullptr) < 0)
+            return nullptr;
+        if (swr_init(swr) < 0)
+            swr_free(&swr);
+        return swr;
+    }
+
+    // Sets up for the given input format unless it is the current one. What swr
+    // still holds for the old format is flushed to the sink first, the sink and
+    // the swr context itself are kept, so tracks of the same format splice
+    // without touching the resampler state. May allocate swr, freed with the
+    // render. Returns 0 or a negative AVERROR.
+    template <typename Wait>
+    int reconfigure(const AVChannelLayout* layout, AVSampleFormat fmt, int rate, Wait wait) {
+        if (fmt == in_fmt && rate == in_sample_rate && !av_channel_layout_compare(layout, &in_layout))
+            return 0;
+
+        if (swr && !kernel)
+            render(nullptr, 0, wait);
+
+        in_fmt = fmt;
+        in_sample_rate = rate;
+        av_channel_layout_uninit(&in_layout);
+        int ret = av_channel_layout_copy(&in_layout, layout);
+        if (ret < 0)
+            return ret;
+
+        kernel = nullptr;
+        if (use_kernels)
+            kernel = findConvertKernel(layout, fmt, rate, sink->channels(), out_fmt, sink->sampleRate());
+        if (kernel)
+            return 0;
+
+        AVChannelLayout out_layout;
+        av_channel_layout_default(&out_layout, sink->channels());
+        ret = swr_alloc_set_opts2(&swr, &out_layout, out_fmt, sink->sampleRate(), layout, fmt, rate, 0, nullptr);
+        if (ret < 0)
+            return ret;
+        return swr_init(swr);
+    }
+
+    // Stretches (sample_delta > 0) or shrinks the output of the next distance
+    // frames by sample_delta frames, for drift compensation. Needs swr, so set
+    // use_kernels = false before the first reconfigure(); swr switches to its
+    // resampler on the first call even when the rates match. Returns 0 or a
+    // negative AVERROR.
+    int compensate(int sample_delta, int distance) {
+        if (!swr || kernel)
+            return AVERROR(EINVAL);
+        return swr_set_compensation(swr, sample_delta, distance);
+    }
+
+    // Blocks through wait() whenever the sink is full, returns frames written
+    // to the sink or a negative AVERROR. Pass in = nullptr to flush swr at the end.
+    template <typename Wait>
+    int render(const uint8_t** in, int in_samples, Wait wait) {
+        AVIO_TRACE_SPAN("convert");
+        if (kernel)
+            return convert(in, in_samples, wait);
+        if (!swr)
+            return passthrough(in, in_samples, wait);
+        if (mode == Copy)
+            return copy(in, in_samples, wait);
+
+        static const uint8_t* empty[64] = { nullptr };
+        int total = 0;
+        bool fed = false;
+        while (true) {
+            int space = sink->available();
+            stats.device_calls++;
+            if (space <= 0) {
+                wait();
+                continue;
+            }
+
+            uint8_t* out = sink->getBuffer(space);
+            stats.device_calls++;
+            if (!out) {
+                wait();
+                continue;
+            }
+            const uint8_t** src = (fed && in) ? empty : in;
+            int converted = swr_convert(swr, &out, space, src, fed ? 0 : in_samples);
+            fed = true;
+            if (converted < 0) {
+                sink->releaseBuffer(0);
+                return converted;
+            }
+            sink->releaseBuffer(converted);
+            stats.device_calls++;
+            Metrics::instance().frames_converted.add(converted);
+            account(converted);
+            total += converted;
+
+            // swr had less to give than the room offered, nothing is left inside
+            if (converted < space)
+                return total;
+        }
+    }
+
+private:
+    AVSampleFormat in_fmt = AV_SAMPLE_FMT_NONE;
+    AVChannelLayout in_layout = {};
+
+    void account(int frames) {
+        stats.frames_rendered += frames;
+        stats.bytes_rendered += (uint64_t)frames * sink->blockAlign();
+    }
+
+    template <typename Wait>
+    int write(const uint8_t* src, int frames, Wait wait) {
+        int offset = 0;
+        while (offset < frames) {
+            int space = sink->available();
+            stats.device_calls++;
+            int to_write = (std::min)(space, frames - offset);
+            if (to_write > 0) {
+                uint8_t* dst = sink->getBuffer(to_write);
+                stats.device_calls++;
+                if (!dst) {
+                    wait();
+                    continue;
+                }
+                memcpy(dst, src + (size_t)offset * sink->blockAlign(), (size_t)to_write * sink->blockAlign());
+                sink->releaseBuffer(to_write);
+                stats.device_calls++;
+                stats.bytes_copied += (uint64_t)to_write * sink->blockAlign();
+                account(to_write);
+                offset += to_write;
+            }
+            else {
+                wait();
+            }
+        }
+        return offset;
+    }
+
+    template <typename Wait>
+    int convert(const uint8_t** in, int in_samples, Wait wait) {
+        if (!in) return 0;
+        int offset = 0;
+        while (offset < in_samples) {
+            int space = sink->available();
+            stats.device_calls++;
+            int count = (std::min)(space, in_samples - offset);
+            if (count <= 0) {
+                wait();
+                continue;
+            }
+            uint8_t* dst = sink->getBuffer(count);
+            stats.device_calls++;
+            if (!dst) {
+                wait();
+                continue;
+            }
+            kernel(dst, in, offset, count, sink->channels());
+            sink->releaseBuffer(count);
+            stats.device_calls++;
+            Metrics::instance().frames_converted.add(count);
+            account(count);
+            offset += count;
+        }
+        return offset;
+    }
+
+    template <typename Wait>
+    int passthrough(const uint8_t** in, int in_samples, Wait wait) {
+        if (!in) return 0;
+        Metrics::instance().frames_converted.add(in_samples);
+        return write(in[0], in_samples, wait);
+    }
+
+    template <typename Wait>
+    int copy(const uint8_t** in, int in_samples, Wait wait) {
+        int out_samples = (int)av_rescale_rnd(
+            swr_get_delay(swr, in_sample_rate) + in_samples,
+            sink->sampleRate(),
+            in_sample_rate,
+            AV_ROUND_UP);
+
+        uint8_t** out_data = pool.get(out_fmt, sink->channels(), out_samples);
+        if (!out_data)
+            return AVERROR(ENOMEM);
+
+        int converted = swr_convert(swr, out_data, out_samples, in, in_samples);
+        if (converted > 0) {
+            Metrics::instance().frames_converted.add(converted);
+            converted = write(out_data[0], converted, wait);
+        }
+
+        return converted;
+    }
+};
+
+}
+
+#endif // SWRRENDER_HPP
@@ -0,0 +1,266 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <ostream>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+
+namespace avio {
+
+// Timeline of the pipeline in the Chrome trace event format, for
+// chrome://tracing and ui.perfetto.dev: spans of the stages (read, decode,
+// convert, render, mix), counters such as queue depths, ring fill and device
+// padding, and instants such as underruns. Every thread records into a buffer
+// of its own without locking; a buffer keeps the latest capacity events and
+// overwrites older ones, so a long session still holds the seconds before a
+// dropout. While stopped an event costs one relaxed load, built with
+// AVIO_NO_TRACE the AVIO_TRACE_ macros compile to nothing.
+//
+// Names have to be string literals, only the pointer is kept. A thread's
+// buffer is allocated at its first event, or at AVIO_TRACE_THREAD while
+// tracing is on, which is where a realtime thread should get it. The buffer
+// of a thread that exited stays for write() until max_buffers are held, then
+// a new thread takes over the oldest one. write() belongs after stop(), an
+// event recorded while it runs may come out torn.
+
+class Tracer {
+public:
+    struct Event {
+        const char* name;
+        int64_t ts_ns;
+        int64_t value;              // duration of a span, value of a counter
+        char phase;                 // 'X' span, 'C' counter, 'i' instant
+    };
+
+    size_t capacity = 1 << 14;      // events per thread, rounded up to a power of two
+    size_t max_buffers = 64;        // before buffers of exited threads are reused
+
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // timestamps in the trace count from the first start()
+    void start() {
+        int64_t zero = 0;
+        epoch.compare_exchange_strong(zero, now(), std::memory_order_relaxed);
+        active.store(true, std::memory_order_release);
+    }
+
+    void stop() { active.store(false, std::memory_order_release); }
+
+    // forgets all events, not while recording
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::unique_ptr<Buffer>& buffer : buffers)
+            buffer->head.store(0, std::memory_order_relaxed);
+        discarded = 0;
+        epoch.store(0, std::memory_order_relaxed);
+    }
+
+    static void span(const char* name, int64_t start_ns, int64_t end_ns) {
+        if (enabled()) record(name, 'X', start_ns, end_ns - start_ns);
+    }
+
+    static void counter(const char* name, int64_t value) {
+        if (enabled()) record(name, 'C', now(), value);
+    }
+
+    static void instant(const char* name) {
+        if (enabled()) record(name, 'i', now(), 0);
+    }
+
+    // names the calling thread, and allocates its buffer when tracing is on
+    static void thread(const char* name) {
+        thread_name = name;
+        if (local().buffer)
+            local().buffer->name = name;
+        else if (enabled())
+            instance().attach();
+    }
+
+    // events held over all threads, and events overwritten before write()
+    uint64_t events() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t total = 0;
+        for (std::unique_ptr<Buffer>& buffer : buffers)
+            total += (std::min)(buffer->head.load(std::memory_order_acquire), (uint64_t)buffer->events.size());
+        return total;
+    }
+
+    uint64_t overwritten() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t total = discarded;
+        for (std::unique_ptr<Buffer>& buffer : buffers) {
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            if (head > buffer->events.size())
+                total += head - buffer->events.size();
+        }
+        return total;
+    }
+
+    void write(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t zero = epoch.load(std::memory_order_relaxed);
+        char line[256];
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"avio\"}}";
+        for (std::unique_ptr<Buffer>& buffer : buffers) {
+            if (buffer->name) {
+                snprintf(line, sizeof(line), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                         buffer->tid, buffer->name);
+                out << line;
+            }
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            uint64_t size = buffer->events.size();
+            for (uint64_t i = head > size ? head - size : 0; i < head; i++) {
+                const Event& event = buffer->events[i & (size - 1)];
+                double ts = (event.ts_ns - zero) / 1000.0;
+                if (event.phase == 'X')
+                    snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                             event.name, buffer->tid, ts, event.value / 1000.0);
+                else if (event.phase == 'C')
+                    snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                             event.name, buffer->tid, ts, (long long)event.value);
+                else
+                    snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                             event.name, buffer->tid, ts);
+                out << line;
+            }
+        }
+        out << "\n]}\n";
+    }
+
+    bool write(const std::string& path) {
+        std::ofstream file(path);
+        if (!file)
+            return false;
+        write(file);
+        return (bool)file;
+    }
+
+private:
+    struct Buffer {
+        std::vector<Event> events;
+        std::atomic<uint64_t> head{ 0 };   // events ever recorded, only the owner writes
+        std::atomic<bool> retired{ false }; // the owner has exited
+        const char* name = nullptr;
+        int tid = 0;
+    };
+
+    // retires the buffer when its thread exits
+    struct Owner {
+        Buffer* buffer = nullptr;
+        ~Owner() { if (buffer) buffer->retired.store(true, std::memory_order_release); }
+    };
+
+    static inline std::atomic<bool> active{ false };
+    static inline thread_local const char* thread_name = nullptr;
+
+    std::mutex mutex;               // buffer list only, never taken to record
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::atomic<int64_t> epoch{ 0 };
+    uint64_t discarded = 0;         // events of reused buffers
+    int next_tid = 1;
+
+    Tracer() { }
+
+    static Owner& local() {
+        static thread_local Owner owner;
+        return owner;
+    }
+
+    static void record(const char* name, char phase, int64_t ts_ns, int64_t value) {
+        Buffer* buffer = local().buffer;
+        if (!buffer)
+            buffer = instance().attach();
+        uint64_t head = buffer->head.load(std::memory_order_relaxed);
+        buffer->events[head & (buffer->events.size() - 1)] = Event{ name, ts_ns, value, phase };
+        buffer->head.store(head + 1, std::memory_order_release);
+    }
+
+    Buffer* attach() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Buffer* buffer = nullptr;
+        if (buffers.size() >= max_buffers) {
+            for (size_t i = 0; i < buffers.size(); i++) {
+                if (!buffers[i]->retired.load(std::memory_order_acquire))
+                    continue;
+                // oldest first, to the back as the newest
+                std::unique_ptr<Buffer> reused = std::move(buffers[i]);
+                buffers.erase(buffers.begin() + i);
+                discarded += reused->head.load(std::memory_order_relaxed);
+                reused->head.store(0, std::memory_order_relaxed);
+                reused->retired.store(false, std::memory_order_relaxed);
+                buffers.push_back(std::move(reused));
+                buffer = buffers.back().get();
+                break;
+            }
+        }
+        if (!buffer) {
+            size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+            buffers.emplace_back(new Buffer());
+            buffer = buffers.back().get();
+            buffer->events.resize(size);
+        }
+        buffer->name = thread_name;
+        buffer->tid = next_tid++;
+        local().buffer = buffer;
+        return buffer;
+    }
+};
+
+// A span from construction to destruction, recorded at the end as one
+// complete event. Only started while tracing is on.
+
+class TraceSpan {
+public:
+    TraceSpan(const char* name) : name(Tracer::enabled() ? name : nullptr), start(this->name ? Tracer::now() : 0) { }
+
+    ~TraceSpan() {
+        if (name)
+            Tracer::span(name, start, Tracer::now());
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    int64_t start;
+};
+
+}
+
+#ifndef AVIO_NO_TRACE
+#define AVIO_TRACE_CONCAT_(a, b) a##b
+#define AVIO_TRACE_CONCAT(a, b) AVIO_TRACE_CONCAT_(a, b)
+#define AVIO_TRACE_SPAN(name) avio::TraceSpan AVIO_TRACE_CONCAT(avio_trace_span_, __LINE__)(name)
+#define AVIO_TRACE_COUNTER(name, value) avio::Tracer::counter(name, (int64_t)(value))
+#define AVIO_TRACE_INSTANT(name) avio::Tracer::instant(name)
+#define AVIO_TRACE_THREAD(name) avio::Tracer::thread(name)
+#else
+#define AVIO_TRACE_SPAN(name) ((void)0)
+#define AVIO_TRACE_COUNTER(name, value) ((void)0)
+#define AVIO_TRACE_INSTANT(name) ((void)0)
+#define AVIO_TRACE_THREAD(name) ((void)0)
+#endif
+
+#endif // TRACE_HPP
@@ -13,6 +13,7 @@
 #include <thread>
 #include <tchar.h>
 #include <exception>
+#include <memory>
 
 extern "C" {
 #include <libswresample/swresample.h>
@@ -22,10 +23,23 @@ extern "C" {
 #include "Frame.hpp"
 #include "Reader.hpp"
 #include "Exception.hpp"
+#include "AudioSink.hpp"
+#include "PcmRing.hpp"
+#include "RenderScheduler.hpp"
+#include "CoalescingSink.hpp"
+#include "Realtime.hpp"
 
 namespace avio {
 
-class WinAudio {
+// Shared mode WASAPI endpoint. run() is the render thread: from ring through a
+// RenderScheduler, or from the input queue of converted frames. With realtime
+// set the render thread only takes the ring path, prepare() allocates what it
+// needs beforehand, and a failing device call is recorded in status and
+// returned once as a negative RenderError instead of throwing; it never
+// prints. A caller that loops on run() stops on anything but 1, or keeps
+// calling to ride out a transient error.
+
+class WinAudio : public AudioSink {
 public:
 
     IMMDeviceEnumerator* pEnumerator = nullptr;
@@ -35,10 +49,26 @@ public:
     UINT32 bufferFrameCount;
     UINT32 numFramesPadding;
     WAVEFORMATEX* pwfx = nullptr;
-    REFERENCE_TIME hnsBufferDuration = 10000000; // 1s
-    avio::Queue<avio::Frame>* input;
-
-    WinAudio() {
+    REFERENCE_TIME hnsBufferDuration;
+    REFERENCE_TIME hnsDevicePeriod = 0;
+    HANDLE hEvent = nullptr;
+    int latency_ms;
+    bool event_driven;
+    bool started = false;
+    bool realtime = false;
+    RenderStatus status;
+    avio::Queue<avio::Frame>* input = nullptr;
+    avio::PcmRing* ring = nullptr;
+    std::unique_ptr<avio::RenderScheduler> scheduler;
+    std::unique_ptr<avio::CoalescingSink> coalescer;
+
+    // latency_ms is the fill level kept in the device (10 - 200 ms), the
+    // buffer is allocated at twice that so the controller has room to grow
+    WinAudio(int latency_ms = 100, bool event_driven = true) :
+        latency_ms(LatencyController::clampLatency(latency_ms)),
+        event_driven(event_driven)
+    {
+        hnsBufferDuration = (REFERENCE_TIME)this->latency_ms * 2 * 10000;
         CoInitialize(nullptr);
 
         error(CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL,
@@ -54,19 +84,25 @@ public:
         error(pAudioClient->GetMixFormat(&pwfx), 
                 "IAudioClient::GetMixFormat");
 
-        error(pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, 0, hnsBufferDuration, 0, pwfx, nullptr),
+        DWORD stream_flags = event_driven ? AUDCLNT_STREAMFLAGS_EVENTCALLBACK : 0;
+        error(pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, stream_flags, hnsBufferDuration, 0, pwfx, nullptr),
                 "IAudioClient::Initialize");
 
+        if (event_driven) {
+            hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+            if (!hEvent)
+                error(HRESULT_FROM_WIN32(GetLastError()), "CreateEvent");
+            error(pAudioClient->SetEventHandle(hEvent), "IAudioClient::SetEventHandle");
+        }
+
         pAudioClient->GetBufferSize(&bufferFrameCount);
+        error(pAudioClient->GetDevicePeriod(&hnsDevicePeriod, nullptr), "IAudioClient::GetDevicePeriod");
 
         error(pAudioClient->GetService(__uuidof(IAudioRenderClient), (void**)&pRenderClient),
                 "IAudioClient::GetService");
 
-        BYTE* pData = nullptr;
-        error(pRenderClient->GetBuffer(bufferFrameCount, &pData), "IAudioRenderClient::GetBuffer");
-        memset(pData, 0, bufferFrameCount * pwfx->nBlockAlign);
-        error(pRenderClient->ReleaseBuffer(bufferFrameCount, 0), "IAudioRenderClient::ReleaseBuffer");
-        error(pAudioClient->Start(), "IAudioClient::Start");
+        // no silence prefill, the client is started by start() once the
+        // first decoded audio has been queued
     }
 
     ~WinAudio() {
@@ -77,32 +113,120 @@ public:
         if (pDevice) pDevice->Release();
         if (pEnumerator) pEnumerator->Release();
         if (pwfx) CoTaskMemFree(pwfx);
+        if (hEvent) CloseHandle(hEvent);
         CoUninitialize();
     }
 
+    int sampleRate() const override { return pwfx->nSamplesPerSec; }
+    int channels() const override { return pwfx->nChannels; }
+    int blockAlign() const override { return pwfx->nBlockAlign; }
+    int bufferFrames() const override { return bufferFrameCount; }
+    int periodFrames() const override { return (int)(hnsDevicePeriod * pwfx->nSamplesPerSec / 10000000); }
+    bool eventDriven() const override { return event_driven; }
+
+    bool waitPeriod(int timeout_ms) override {
+        if (!event_driven) return false;
+        return WaitForSingleObject(hEvent, timeout_ms) == WAIT_OBJECT_0;
+    }
+
+    void start() override {
+        if (started) return;
+        if (check(pAudioClient->Start(), RENDER_DEVICE_START, "IAudioClient::Start"))
+            started = true;
+    }
+
+    void wait() {
+        if (!started) {
+            start();
+            return;
+        }
+        if (!waitPeriod(2000))
+            Sleep(5);
+    }
+
+    // a full device when the padding cannot be read
+    int available() override {
+        if (!check(pAudioClient->GetCurrentPadding(&numFramesPadding), RENDER_DEVICE_PADDING,
+                   "IAudioClient::GetCurrentPadding"))
+            return 0;
+        return bufferFrameCount - numFramesPadding;
+    }
+
+    uint8_t* getBuffer(int frames) override {
+        BYTE* pData = nullptr;
+        if (!check(pRenderClient->GetBuffer(frames, &pData), RENDER_DEVICE_BUFFER, "IAudioRenderClient::GetBuffer"))
+            return nullptr;
+        return pData;
+    }
+
+    void releaseBuffer(int frames) override {
+        if (check(pRenderClient->ReleaseBuffer(frames, 0), RENDER_DEVICE_RELEASE, "IAudioRenderClient::ReleaseBuffer"))
+            rendered(frames);
+    }
+
+    // allocates the scheduler or the coalescer run() uses, before the render
+    // thread starts; run() calls it itself unless realtime is set
+    void prepare() {
+        if (ring && !scheduler) {
+            RenderScheduler::Mode mode = event_driven ? RenderScheduler::Event : RenderScheduler::Polling;
+            scheduler = std::make_unique<RenderScheduler>(this, ring, mode, latency_ms);
+            scheduler->status = &status;
+        }
+        if (!ring && !coalescer)
+            coalescer = std::make_unique<avio::CoalescingSink>(this, periodFrames());
+    }
+
+    // 1 while playing, 0 at the end of the stream, in realtime mode a
+    // negative RenderError when the device failed during this call; the
+    // next call tries again
     int run() {
+        if (realtime) {
+            if (!ring) {
+                status.fail(RENDER_NOT_REALTIME);
+                return -RENDER_NOT_REALTIME;
+            }
+            if (!scheduler) {
+                status.fail(RENDER_NOT_PREPARED);
+                return -RENDER_NOT_PREPARED;
+            }
+            uint64_t failures = status.failures();
+            if (!scheduler->step())
+                return 0;
+            return status.failures() == failures ? 1 : -status.last();
+        }
+
+        prepare();
+        if (ring) {
+            if (!scheduler->step()) {
+                std::cout << "win audio ring finished" << std::endl;
+                return 0;
+            }
+            return 1;
+        }
+
+        // frames are packed into device periods, one GetBuffer/ReleaseBuffer
+        // round per period whatever size the decoder produced
+
         avio::Frame frame = input->pop();
         if (frame.is_null()) {
             std::cout << "win audio recvd null frame" << std::endl;
+            coalescer->flush();
+            start();
             return 0;
         }
 
         int offset = 0;
         int converted = frame.samples();
         while (converted > 0) {
-            error(pAudioClient->GetCurrentPadding(&numFramesPadding), "IAudioClient::GetCurrentPadding");
-            UINT32 numFramesAvailable = bufferFrameCount - numFramesPadding;
-            int to_write = min((int)numFramesAvailable, converted);
+            int to_write = min(coalescer->available(), converted);
             if (to_write > 0) {
-                BYTE* pData = nullptr;
-                error(pRenderClient->GetBuffer(to_write, &pData), "IAudioRenderClient::GetBuffer");
-                memcpy(pData, frame.data() + offset * pwfx->nBlockAlign, to_write * pwfx->nBlockAlign);
-                error(pRenderClient->ReleaseBuffer(to_write, 0), "IAudioRenderClient::GetBuffer");
+                memcpy(coalescer->getBuffer(to_write), frame.data() + offset * pwfx->nBlockAlign, to_write * pwfx->nBlockAlign);
+                coalescer->releaseBuffer(to_write);
                 offset += to_write;
                 converted -= to_write;
             }
             else {
-                Sleep(5);
+                wait();
             }
         }
 
@@ -220,7 +344,17 @@ public:
         #endif
     }
 
-    error(HRESULT hr, const std::string& msg) {
+    // render thread: throws like error() unless realtime, then only records
+    bool check(HRESULT hr, RenderError code, const char* msg) {
+        if (SUCCEEDED(hr))
+            return true;
+        if (!realtime)
+            error(hr, msg);
+        status.fail(code, hr);
+        return false;
+    }
+
+    void error(HRESULT hr, const std::string& msg) {
         if (FAILED(hr)) {
             _com_error err(hr);
             std::stringstream str;
@@ -0,0 +1,175 @@
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+#include "Trace.hpp"
+
+namespace avio {
+
+// Fixed set of threads running posted jobs, shared by everything that decodes
+// in the background (the Mixer sources, the LoudnessScanner segments). Every
+// worker has its own deque: a job posted from inside a job goes to the front
+// of the worker's own deque and runs there next unless an idle worker steals
+// it from the back, jobs posted from outside are dealt round robin. Workers
+// claim jobs straight from the deques under the deque's own lock; the pool
+// mutex is only taken to sleep when every deque is empty and to wake sleepers
+// or drain(). Jobs must not block on each other, a job waiting for another one
+// can deadlock a small pool.
+
+class WorkerPool {
+public:
+    WorkerPool(int threads = 0) {
+        if (threads <= 0)
+            threads = (std::max)(1, (int)std::thread::hardware_concurrency() - 1);
+        for (int i = 0; i < threads; i++)
+            queues.emplace_back(new Queue());
+        for (int i = 0; i < threads; i++)
+            workers.emplace_back([this, i] { run(i); });
+    }
+
+    // jobs still queued are dropped, running ones finish first
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping.store(true);
+        }
+        cond.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void post(std::function<void()> job) {
+        int index = current().pool == this ? current().index
+                                           : (int)(next.fetch_add(1, std::memory_order_relaxed) % queues.size());
+        // counted before it is visible, so a worker never claims an uncounted
+        // job; seq_cst against sleep(): either a sleeper is counted here or it
+        // sees pending > 0 before it waits
+        pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->jobs.push_front(std::move(job));
+        }
+        if (sleepers.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_one();
+        }
+    }
+
+    // blocks until no job is queued or running
+    void drain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pending.load() == 0 && running.load() == 0; });
+    }
+
+    int size() const { return (int)workers.size(); }
+
+    // jobs taken from another worker's deque so far
+    uint64_t steals() const { return stolen.load(std::memory_order_relaxed); }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+    };
+
+    struct Worker {
+        WorkerPool* pool = nullptr;
+        int index = -1;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;               // only for sleeping on cond and idle
+    std::condition_variable cond;
+    std::condition_variable idle;
+    std::atomic<int> pending{ 0 };  // queued, not yet claimed by a worker
+    std::atomic<int> running{ 0 };  // claiming or running
+    std::atomic<int> sleepers{ 0 };
+    std::atomic<bool> stopping{ false };
+    std::atomic<uint64_t> next{ 0 };
+    std::atomic<uint64_t> stolen{ 0 };
+
+    static Worker& current() {
+        static thread_local Worker worker;
+        return worker;
+    }
+
+    // own deque from the front, then the others from the back
+    bool take(int index, std::function<void()>& job) {
+        int count = (int)queues.size();
+        for (int i = 0; i < count; i++) {
+            Queue& queue = *queues[(index + i) % count];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.jobs.empty())
+                continue;
+            if (i == 0) {
+                job = std::move(queue.jobs.front());
+                queue.jobs.pop_front();
+            }
+            else {
+                job = std::move(queue.jobs.back());
+                queue.jobs.pop_back();
+                stolen.fetch_add(1, std::memory_order_relaxed);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // the last one out with nothing queued wakes drain()
+    void finish() {
+        if (running.fetch_sub(1) == 1 && pending.load() == 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle.notify_all();
+        }
+    }
+
+    void sleep() {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepers.fetch_add(1);
+        cond.wait(lock, [this] { return stopping.load() || pending.load() > 0; });
+        sleepers.fetch_sub(1);
+    }
+
+    void run(int index) {
+        AVIO_TRACE_THREAD("worker");
+        current().pool = this;
+        current().index = index;
+        std::function<void()> job;
+        while (!stopping.load()) {
+            // counted as running before the deques are searched, so drain()
+            // never sees a claimed job as neither pending nor running
+            running.fetch_add(1);
+            if (take(index, job)) {
+                pending.fetch_sub(1);
+                job();
+                job = nullptr;
+                finish();
+                continue;
+            }
+            finish();
+            // pending > 0: a job is being pushed or another worker is
+            // claiming it, either way it is gone in a moment
+            if (pending.load() > 0)
+                std::this_thread::yield();
+            else
+                sleep();
+        }
+    }
+};
+
+}
+
+#endif // WORKERPOOL_HPP
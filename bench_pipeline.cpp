@@ -0,0 +1,2214 @@
+// bench_pipeline.cpp
+//
+// Headless throughput of reader -> decoder -> swr -> null sink, as fast as the
+// machine allows. Builds and runs on Linux with FFmpeg only. The null sink
+// counts device calls, the render stage packs its writes into --period sized
+// chunks through a CoalescingSink unless --no-coalesce is given.
+//
+//   bench_pipeline [options] [files...]
+//
+// Without files a matrix of test media (mp3, aac, flac, opus, pcm at several
+// rates and channel counts) is encoded once into --dir and benchmarked.
+//
+//   --seconds N     length of generated media (20)
+//   --dir PATH      where generated media are kept (/tmp/bench_pipeline)
+//   --json PATH     write results as JSON, - for stdout
+//   --label TEXT    stored with the JSON results, e.g. a commit hash
+//   --rate N        sink sample rate (48000)
+//   --channels N    sink channel count (2)
+//   --no-kernels    always convert with swr, even when a format kernel fits
+//   --period MS     device period the render stage coalesces to (10)
+//   --no-coalesce   write to the sink as frames arrive, for comparison
+//   --packet-queue MS[,KB]   bound of the reader -> decoder queue (2000,4096)
+//   --frame-queue MS[,KB]    bound of the decoder -> filter queue (500,4096)
+//   --fixed-queues N         bound both queues at N items instead, for comparison
+//   --playlist      play all files (or the generated matrix) as one gapless playlist
+//   --prefetch MS   audio the next track is decoded ahead in playlist mode (500)
+//   --no-prefetch   open each track only when the previous one ended, for comparison
+//   --fast-open     bounded probesize / analyzeduration when opening files
+//   --cache DIR     keep resolved stream info in DIR, later opens skip probing
+//   --startup       measure time to first decoded frame instead of throughput,
+//                   default, fast and cached opens, cache cold and warm
+//   --runs N        opens per variant in --startup mode, the median is shown (9)
+//   --seek          measure seek latency and accuracy, av_seek_frame against
+//                   the background packet index, instead of throughput
+//   --seeks N       seek targets per file in --seek mode (50)
+//   --input file|mmap|both   read through the libavformat file protocol, a
+//                   memory mapped MappedInput, or run every file both ways (file)
+//   --mix N[,N...]  mix N sources at once (the files or the generated matrix,
+//                   repeated as needed) offline into the null sink, per count
+//   --workers N     decoder threads of the mixer pool (hardware threads - 1),
+//                   in --analyze mode the largest pool of the sweep, in
+//                   --pipelines mode the scheduler pool (hardware threads)
+//   --analyze       EBU R128 loudness, true peak and ReplayGain of all files on
+//                   pools of 1, 2, 4 ... workers against a single threaded reference
+//   --segment MS    length of the segments files are split into for --analyze (10000)
+//   --pipelines N[,N...]   run N pipelines at once into null sinks, with four
+//                   threads each and then as tasks on a shared pool of --workers
+//                   threads (hardware threads), threads, context switches and
+//                   throughput per count
+//   --clips MB      time to the first period on the sink, streamed against a
+//                   decoded PCM cache of MB megabytes, cold and on a hit, and
+//                   what the cache holds after playing every file twice
+//   --trace PATH    record stage spans, queue depths and ring fill while the
+//                   benchmark runs and write them to PATH as a Chrome trace,
+//                   for chrome://tracing or ui.perfetto.dev
+//   --trace-overhead   pipeline throughput with the tracer stopped against
+//                   recording, --runs each, and the cost of one span
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#include "AudioSink.hpp"
+#include "PcmRing.hpp"
+#include "SwrRender.hpp"
+#include "CoalescingSink.hpp"
+#include "MediaQueue.hpp"
+#include "AudioReader.hpp"
+#include "AudioDecoder.hpp"
+#include "StreamInfoCache.hpp"
+#include "Playlist.hpp"
+#include "Mixer.hpp"
+#include "WorkerPool.hpp"
+#include "Loudness.hpp"
+#include "PipelineScheduler.hpp"
+#include "PcmCache.hpp"
+#include "Trace.hpp"
+#include "Metrics.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    int seconds = 20;
+    std::string dir = "/tmp/bench_pipeline";
+    std::string json;
+    std::string label;
+    int rate = 48000;
+    int channels = 2;
+    bool kernels = true;
+    int period_ms = 10;
+    bool coalesce = true;
+    avio::QueueLimits packet_queue{ 2000, 4096 * 1024 };
+    avio::QueueLimits frame_queue{ 500, 4096 * 1024 };
+    bool playlist = false;
+    bool prefetch = true;
+    int prefetch_ms = 500;
+    bool fast_open = false;
+    std::string cache_dir;
+    bool startup = false;
+    int runs = 9;
+    bool seek = false;
+    int seeks = 50;
+    std::string input = "file";
+    std::vector<int> mix;
+    int workers = 0;
+    bool analyze = false;
+    int segment_ms = 10000;
+    std::vector<int> pipelines;
+    int clips_mb = 0;
+    std::string trace;
+    bool trace_overhead = false;
+    std::vector<std::string> files;
+};
+
+struct MediaSpec {
+    const char* name;
+    const char* ext;
+    AVCodecID codec_id;
+};
+
+static const MediaSpec MEDIA[] = {
+    { "mp3",  "mp3",  AV_CODEC_ID_MP3 },
+    { "aac",  "m4a",  AV_CODEC_ID_AAC },
+    { "flac", "flac", AV_CODEC_ID_FLAC },
+    { "opus", "opus", AV_CODEC_ID_OPUS },
+    { "pcm",  "wav",  AV_CODEC_ID_PCM_S16LE },
+};
+
+static const int RATES[] = { 44100, 48000 };
+static const int CHANNELS[] = { 1, 2 };
+
+struct Result {
+    std::string file;
+    std::string input;
+    std::string codec;
+    int sample_rate = 0;
+    int channels = 0;
+    std::string convert;
+    double audio_seconds = 0;
+    double wall_seconds = 0;
+    double realtime = 0;
+    double samples_per_sec = 0;
+    double device_calls_per_sec = 0;    // per second of audio
+    double cpu_reader_ms = 0;
+    double cpu_decoder_ms = 0;
+    double cpu_filter_ms = 0;
+    double cpu_render_ms = 0;
+    long reader_syscalls = 0;           // read syscalls issued on the reader thread
+    double reader_syscalls_per_sec = 0; // the same per second of audio
+    long reader_faults = 0;             // page faults taken on the reader thread
+    long peak_rss_kb = -1;
+    int queue_peak_ms[2] = {};          // packets, frames
+    size_t queue_peak_kb[2] = {};
+    avio::Histogram::Snapshot latency_us[4];
+    std::string error;
+};
+
+static const char* STAGES[] = { "reader", "decoder", "filter", "render" };
+static const char* QUEUES[] = { "packets", "frames" };
+
+static double thread_cpu_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// read() and friends issued by the calling thread so far
+static long thread_read_syscalls() {
+    std::ifstream io("/proc/thread-self/io");
+    std::string line;
+    while (std::getline(io, line)) {
+        if (!line.compare(0, 6, "syscr:"))
+            return std::stol(line.substr(6));
+    }
+    return 0;
+}
+
+static long thread_faults() {
+    rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage))
+        return 0;
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+// VmHWM is reset through clear_refs so each run reports its own peak
+static void reset_peak_rss() {
+    std::ofstream clear("/proc/self/clear_refs");
+    if (clear) clear << "5";
+}
+
+static long peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (!line.compare(0, 6, "VmHWM:"))
+            return std::stol(line.substr(6));
+    }
+    return -1;
+}
+
+static bool file_exists(const std::string& path) {
+    struct stat st;
+    return !stat(path.c_str(), &st) && st.st_size > 0;
+}
+
+// -------- test media --------
+
+struct Encoder {
+    AVFormatContext* oc = nullptr;
+    AVCodecContext* enc = nullptr;
+    AVStream* st = nullptr;
+    SwrContext* swr = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket* pkt = nullptr;
+    std::string path;
+    bool complete = false;
+
+    // a half written file would be mistaken for cached media next time
+    ~Encoder() {
+        if (oc && oc->pb) avio_closep(&oc->pb);
+        if (!complete && !path.empty()) remove(path.c_str());
+        if (oc) avformat_free_context(oc);
+        if (enc) avcodec_free_context(&enc);
+        if (swr) swr_free(&swr);
+        if (frame) av_frame_free(&frame);
+        if (pkt) av_packet_free(&pkt);
+    }
+
+    int write(AVFrame* input) {
+        int ret = avcodec_send_frame(enc, input);
+        if (ret < 0) return ret;
+        while ((ret = avcodec_receive_packet(enc, pkt)) >= 0) {
+            av_packet_rescale_ts(pkt, enc->time_base, st->time_base);
+            pkt->stream_index = st->index;
+            if ((ret = av_interleaved_write_frame(oc, pkt)) < 0)
+                return ret;
+        }
+        return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+    }
+};
+
+// A few seconds of tones and noise per channel so the lossy encoders have real work
+static std::string generate(const MediaSpec& spec, int rate, int channels, const Options& opts, std::string& error) {
+    std::stringstream name;
+    name << opts.dir << "/" << spec.name << "_" << rate << "_" << channels << "." << spec.ext;
+    std::string path = name.str();
+    if (file_exists(path))
+        return path;
+
+    const AVCodec* codec = avcodec_find_encoder(spec.codec_id);
+    if (!codec) {
+        error = "no encoder";
+        return "";
+    }
+
+    Encoder e;
+    if (avformat_alloc_output_context2(&e.oc, nullptr, nullptr, path.c_str()) < 0) {
+        error = "no muxer";
+        return "";
+    }
+
+    e.st = avformat_new_stream(e.oc, nullptr);
+    e.enc = avcodec_alloc_context3(codec);
+    e.enc->sample_rate = rate;
+    av_channel_layout_default(&e.enc->ch_layout, channels);
+    e.enc->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+    e.enc->bit_rate = 64000 * channels;
+    e.enc->time_base = AVRational{ 1, rate };
+    e.enc->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    if (e.oc->oformat->flags & AVFMT_GLOBALHEADER)
+        e.enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (avcodec_open2(e.enc, codec, nullptr) < 0) {
+        error = "encoder rejected format";
+        return "";
+    }
+
+    avcodec_parameters_from_context(e.st->codecpar, e.enc);
+    e.st->time_base = e.enc->time_base;
+
+    e.path = path;
+    if (avio_open(&e.oc->pb, path.c_str(), AVIO_FLAG_WRITE) < 0 || avformat_write_header(e.oc, nullptr) < 0) {
+        error = "cannot write " + path;
+        return "";
+    }
+
+    int frame_size = 1024;
+    if (e.enc->frame_size > 0 && !(codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+        frame_size = e.enc->frame_size;
+
+    e.swr = avio::SwrRender::create(&e.enc->ch_layout, AV_SAMPLE_FMT_FLT, rate, channels, e.enc->sample_fmt, rate);
+    e.frame = av_frame_alloc();
+    e.pkt = av_packet_alloc();
+    e.frame->nb_samples = frame_size;
+    e.frame->format = e.enc->sample_fmt;
+    e.frame->sample_rate = rate;
+    av_channel_layout_copy(&e.frame->ch_layout, &e.enc->ch_layout);
+    if (!e.swr || av_frame_get_buffer(e.frame, 0) < 0) {
+        error = "cannot allocate frame";
+        return "";
+    }
+
+    std::vector<float> pcm((size_t)frame_size * channels);
+    uint32_t noise = 22222;
+    int64_t total = (int64_t)opts.seconds * rate;
+    // the last frame is cut short where the encoder allows it, so the file
+    // holds exactly seconds * rate samples for the playlist checks
+    bool small_last = codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE);
+    for (int64_t pts = 0; pts < total; pts += frame_size) {
+        int samples = (small_last && total - pts < frame_size) ? (int)(total - pts) : frame_size;
+        e.frame->nb_samples = samples;
+        for (int i = 0; i < frame_size; i++) {
+            double t = (double)(pts + i) / rate;
+            for (int ch = 0; ch < channels; ch++) {
+                noise = noise * 1664525 + 1013904223;
+                double tone = 0.3 * sin(2 * M_PI * (220.0 * (ch + 1) + 50 * sin(t)) * t);
+                pcm[(size_t)i * channels + ch] = (float)(tone + 0.05 * ((int32_t)noise / 2147483648.0));
+            }
+        }
+
+        const uint8_t* in[1] = { (const uint8_t*)pcm.data() };
+        if (av_frame_make_writable(e.frame) < 0
+            || swr_convert(e.swr, e.frame->extended_data, samples, in, samples) < 0)
+        {
+            error = "conversion failed";
+            return "";
+        }
+        e.frame->pts = pts;
+        if (e.write(e.frame) < 0) {
+            error = "encoding failed";
+            return "";
+        }
+    }
+
+    if (e.write(nullptr) < 0 || av_write_trailer(e.oc) < 0) {
+        error = "encoding failed";
+        return "";
+    }
+    e.complete = true;
+
+    return path;
+}
+
+static avio::OpenOptions open_options(const Options& opts, avio::StreamInfoCache* cache) {
+    avio::OpenOptions options = opts.fast_open ? avio::OpenOptions::fast() : avio::OpenOptions();
+    options.cache = cache;
+    options.mmap = opts.input == "mmap";
+    return options;
+}
+
+// -------- pipeline --------
+
+static Result run_pipeline(const std::string& path, const Options& opts, avio::StreamInfoCache* cache, bool mmap) {
+    Result result;
+    result.file = path;
+    result.input = mmap ? "mmap" : "file";
+    reset_peak_rss();
+    avio::Metrics& metrics = avio::Metrics::instance();
+    metrics.reset();
+
+    try {
+        avio::OpenOptions options = open_options(opts, cache);
+        options.mmap = mmap;
+        avio::AudioReader reader(path, options);
+        if (mmap && !reader.input)
+            result.input = "file";
+        avio::AudioDecoder decoder(reader.stream);
+        result.codec = decoder.codec_ctx->codec->name;
+        result.sample_rate = decoder.sampleRate();
+        result.channels = decoder.channelLayout()->nb_channels;
+
+        avio::MediaQueue<AVPacket> pkts(opts.packet_queue, reader.stream->time_base);
+        avio::MediaQueue<AVFrame> frames(opts.frame_queue);
+        pkts.trace_name = "packets queue";
+        frames.trace_name = "frames queue";
+        avio::NullSink sink(opts.rate, opts.channels, sizeof(float), opts.rate / 10);
+        avio::PcmRing ring(sink.blockAlign(), opts.rate, 200);
+        avio::RingSink ring_sink(&ring, opts.rate, opts.channels);
+        std::string filter_error;
+
+        auto start = Clock::now();
+
+        std::thread reader_thread([&] {
+            AVIO_TRACE_THREAD("reader");
+            double cpu = thread_cpu_ms();
+            long syscalls = thread_read_syscalls();
+            long faults = thread_faults();
+            while (true) {
+                AVPacket* pkt = av_packet_alloc();
+                avio::StageTimer timer;
+                if (reader.read(pkt) <= 0) {
+                    av_packet_free(&pkt);
+                    break;
+                }
+                metrics.reader_latency_us.record(timer.us());
+                if (!pkts.push(pkt))
+                    break;
+            }
+            pkts.close();
+            result.cpu_reader_ms = thread_cpu_ms() - cpu;
+            result.reader_faults = thread_faults() - faults;
+            // less the read of /proc/thread-self/io itself
+            result.reader_syscalls = thread_read_syscalls() - syscalls - 1;
+        });
+
+        std::thread decoder_thread([&] {
+            AVIO_TRACE_THREAD("decoder");
+            double cpu = thread_cpu_ms();
+            AVFrame* frame = av_frame_alloc();
+            while (true) {
+                AVPacket* pkt = pkts.pop();
+                avio::StageTimer timer;
+                decoder.send(pkt);
+                while (decoder.receive(frame) > 0) {
+                    metrics.decoder_latency_us.record(timer.us());
+                    frames.push(frame);
+                    frame = av_frame_alloc();
+                    timer = avio::StageTimer();
+                }
+                if (!pkt) break;
+                av_packet_free(&pkt);
+            }
+            av_frame_free(&frame);
+            frames.close();
+            result.cpu_decoder_ms = thread_cpu_ms() - cpu;
+        });
+
+        // the converter follows the decoded frames, some decoders only settle
+        // on a layout once they have seen data. Streams already at the sink
+        // rate and layout go through a format kernel instead of swr
+        std::thread filter_thread([&] {
+            AVIO_TRACE_THREAD("filter");
+            double cpu = thread_cpu_ms();
+            avio::SwrRender render(nullptr, &ring_sink, AV_SAMPLE_FMT_FLT, 0);
+            render.use_kernels = opts.kernels;
+            auto wait = [] { std::this_thread::sleep_for(std::chrono::microseconds(100)); };
+            while (AVFrame* frame = frames.pop()) {
+                if (render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait) < 0) {
+                    filter_error = "Failed to initialize SwrContext";
+                    av_frame_free(&frame);
+                    break;
+                }
+                result.convert = render.kernel ? "kernel" : "swr";
+                avio::StageTimer timer;
+                render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+                metrics.filter_latency_us.record(timer.us());
+                av_frame_free(&frame);
+            }
+            render.render(nullptr, 0, wait);
+            ring.close();
+            frames.close();
+            result.cpu_filter_ms = thread_cpu_ms() - cpu;
+        });
+
+        std::thread render_thread([&] {
+            AVIO_TRACE_THREAD("render");
+            double cpu = thread_cpu_ms();
+            avio::CoalescingSink coalesced(&sink, (int)((int64_t)opts.rate * opts.period_ms / 1000));
+            avio::AudioSink* device = opts.coalesce ? (avio::AudioSink*)&coalesced : &sink;
+            while (!ring.finished()) {
+                avio::StageTimer timer;
+                int written = avio::renderFromRing(device, &ring);
+                if (written)
+                    metrics.render_latency_us.record(timer.us());
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            coalesced.flush();
+            result.cpu_render_ms = thread_cpu_ms() - cpu;
+        });
+
+        reader_thread.join();
+        decoder_thread.join();
+        filter_thread.join();
+        render_thread.join();
+
+        result.wall_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.audio_seconds = (double)sink.frames_rendered / opts.rate;
+        result.realtime = result.audio_seconds / result.wall_seconds;
+        result.samples_per_sec = sink.frames_rendered / result.wall_seconds;
+        if (result.audio_seconds > 0) {
+            result.device_calls_per_sec = sink.device_calls / result.audio_seconds;
+            result.reader_syscalls_per_sec = result.reader_syscalls / result.audio_seconds;
+        }
+        result.error = filter_error;
+        result.queue_peak_ms[0] = pkts.peakMs();
+        result.queue_peak_ms[1] = frames.peakMs();
+        result.queue_peak_kb[0] = pkts.peakBytes() / 1024;
+        result.queue_peak_kb[1] = frames.peakBytes() / 1024;
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+    }
+
+    result.peak_rss_kb = peak_rss_kb();
+    result.latency_us[0] = metrics.reader_latency_us.snapshot();
+    result.latency_us[1] = metrics.decoder_latency_us.snapshot();
+    result.latency_us[2] = metrics.filter_latency_us.snapshot();
+    result.latency_us[3] = metrics.render_latency_us.snapshot();
+    return result;
+}
+
+// -------- output --------
+
+static std::string json_string(const std::string& str) {
+    std::stringstream out;
+    out << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') out << '\\' << c;
+        else if ((unsigned char)c < 0x20) out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+        else out << c;
+    }
+    out << '"';
+    return out.str();
+}
+
+static void write_json(std::ostream& out, const std::vector<Result>& results, const Options& opts) {
+    out << "{\n  \"label\": " << json_string(opts.label) << ",\n"
+        << "  \"sink\": { \"sample_rate\": " << opts.rate << ", \"channels\": " << opts.channels
+        << ", \"period_ms\": " << opts.period_ms << ", \"coalesce\": " << (opts.coalesce ? "true" : "false") << " },\n"
+        << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        out << "    { \"file\": " << json_string(r.file)
+            << ", \"input\": " << json_string(r.input)
+            << ", \"codec\": " << json_string(r.codec)
+            << ", \"sample_rate\": " << r.sample_rate
+            << ", \"channels\": " << r.channels
+            << ", \"convert\": " << json_string(r.convert)
+            << ", \"audio_seconds\": " << r.audio_seconds
+            << ", \"wall_seconds\": " << r.wall_seconds
+            << ", \"realtime\": " << r.realtime
+            << ", \"samples_per_sec\": " << r.samples_per_sec
+            << ", \"device_calls_per_sec\": " << r.device_calls_per_sec
+            << ", \"cpu_ms\": { \"reader\": " << r.cpu_reader_ms
+            << ", \"decoder\": " << r.cpu_decoder_ms
+            << ", \"filter\": " << r.cpu_filter_ms
+            << ", \"render\": " << r.cpu_render_ms << " }"
+            << ", \"reader_syscalls\": " << r.reader_syscalls
+            << ", \"reader_syscalls_per_sec\": " << r.reader_syscalls_per_sec
+            << ", \"reader_faults\": " << r.reader_faults
+            << ", \"latency_us\": {";
+        for (int stage = 0; stage < 4; stage++) {
+            const avio::Histogram::Snapshot& snap = r.latency_us[stage];
+            out << (stage ? ", " : " ") << "\"" << STAGES[stage] << "\": { \"mean\": " << snap.mean()
+                << ", \"p99\": " << snap.percentile(0.99) << ", \"max\": " << snap.max << " }";
+        }
+        out << " }"
+            << ", \"queues\": {";
+        for (int queue = 0; queue < 2; queue++) {
+            out << (queue ? ", " : " ") << "\"" << QUEUES[queue] << "\": { \"peak_ms\": " << r.queue_peak_ms[queue]
+                << ", \"peak_kb\": " << r.queue_peak_kb[queue] << " }";
+        }
+        out << " }"
+            << ", \"peak_rss_kb\": " << r.peak_rss_kb
+            << ", \"error\": " << json_string(r.error) << " }"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+static void print_result(const Result& r) {
+    std::string name = r.file.substr(r.file.find_last_of('/') + 1);
+    std::cout << std::left << std::setw(24) << name << std::right;
+    if (!r.error.empty() && !r.audio_seconds) {
+        std::cout << "  " << r.error << std::endl;
+        return;
+    }
+    std::cout << std::fixed << std::setprecision(1)
+              << std::setw(9) << r.realtime << "x"
+              << std::setw(12) << std::setprecision(0) << r.samples_per_sec << " samples/s"
+              << std::setw(7) << r.device_calls_per_sec << " calls/s"
+              << std::setprecision(1)
+              << "  cpu ms r/d/f/s "
+              << r.cpu_reader_ms << "/" << r.cpu_decoder_ms << "/" << r.cpu_filter_ms << "/" << r.cpu_render_ms
+              << "  " << r.input << " " << std::setprecision(0) << r.reader_syscalls_per_sec << " reads/s "
+              << r.reader_faults << " faults" << std::setprecision(1)
+              << "  queues " << r.queue_peak_ms[0] << "/" << r.queue_peak_ms[1] << " ms"
+              << "  rss " << r.peak_rss_kb << " kB  " << r.convert << std::endl;
+}
+
+// -------- playlist --------
+
+// All files as one gapless playlist through a single resampler and sink. Per
+// track it reports the startup cost (open, probe, first decoded frame), how
+// long the producer stalled at the boundary, which is what a device would hear
+// as a gap once it exceeds the buffered audio, and the samples left after
+// trimming against the length the track should have. expected is 0 when only
+// the container duration is known.
+
+static int run_playlist(const std::vector<std::string>& paths, const std::vector<int64_t>& expected,
+                        const Options& opts, avio::StreamInfoCache* cache)
+{
+    avio::Metrics::instance().reset();
+    avio::Playlist playlist(paths, opts.prefetch);
+    playlist.prefetch_ms = opts.prefetch_ms;
+    playlist.open_options = open_options(opts, cache);
+    avio::NullSink sink(opts.rate, opts.channels, sizeof(float), opts.rate / 10);
+    avio::PcmRing ring(sink.blockAlign(), opts.rate, 200);
+    avio::RingSink ring_sink(&ring, opts.rate, opts.channels);
+    std::string error;
+
+    auto start = Clock::now();
+
+    std::thread producer([&] {
+        AVIO_TRACE_THREAD("producer");
+        avio::SwrRender render(nullptr, &ring_sink, AV_SAMPLE_FMT_FLT, 0);
+        render.use_kernels = opts.kernels;
+        auto wait = [] { std::this_thread::sleep_for(std::chrono::microseconds(100)); };
+        AVFrame* frame = av_frame_alloc();
+        while (playlist.next(frame) > 0) {
+            if (render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait) < 0) {
+                error = "Failed to initialize SwrContext";
+                break;
+            }
+            render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+        }
+        render.render(nullptr, 0, wait);
+        av_frame_free(&frame);
+        ring.close();
+    });
+
+    std::thread render_thread([&] {
+        AVIO_TRACE_THREAD("render");
+        avio::CoalescingSink coalesced(&sink, (int)((int64_t)opts.rate * opts.period_ms / 1000));
+        avio::AudioSink* device = opts.coalesce ? (avio::AudioSink*)&coalesced : &sink;
+        while (!ring.finished()) {
+            if (!avio::renderFromRing(device, &ring))
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        coalesced.flush();
+    });
+
+    producer.join();
+    render_thread.join();
+    double wall_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cout << std::left << std::setw(24) << "track" << std::right
+              << std::setw(9) << "open ms" << std::setw(10) << "first ms" << std::setw(13) << "boundary ms"
+              << std::setw(11) << "samples" << std::setw(8) << "diff" << std::setw(14) << "trim start/end" << std::endl;
+
+    double worst_boundary = 0;
+    int64_t worst_diff = 0;
+    bool failed = !error.empty();
+    for (size_t i = 0; i < playlist.stats.size(); i++) {
+        const avio::Playlist::TrackStats& t = playlist.stats[i];
+        std::string name = t.filename.substr(t.filename.find_last_of('/') + 1);
+        std::cout << std::left << std::setw(24) << name << std::right;
+        if (!t.error.empty()) {
+            std::cout << "  " << t.error << std::endl;
+            failed = true;
+            continue;
+        }
+        int64_t target = expected[i] ? expected[i] : t.nominal_samples;
+        int64_t diff = t.samples - target;
+        if (i) worst_boundary = (std::max)(worst_boundary, t.boundary_ms);
+        if (std::llabs(diff) > std::llabs(worst_diff)) worst_diff = diff;
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::setw(9) << t.open_ms << std::setw(10) << t.first_frame_ms
+                  << std::setw(13) << (i ? t.boundary_ms : 0.0)
+                  << std::setw(11) << t.samples << std::setw(8) << diff
+                  << std::setw(8) << t.trimmed_start << "/" << t.trimmed_end
+                  << (t.prefetch_error.empty() ? "" : "  prefetch failed: " + t.prefetch_error) << std::endl;
+    }
+
+    std::cout << std::fixed << std::setprecision(1)
+              << (opts.prefetch ? "prefetch " : "no prefetch ") << opts.prefetch_ms << " ms: "
+              << (double)sink.frames_rendered / opts.rate / wall_seconds << "x realtime, worst boundary stall "
+              << worst_boundary << " ms, worst sample diff " << worst_diff
+              << ", " << playlist.prefetch_failures << " prefetch failures" << std::endl;
+    if (!error.empty())
+        std::cout << error << std::endl;
+
+    if (!opts.json.empty()) {
+        std::ofstream file;
+        if (opts.json != "-") file.open(opts.json);
+        std::ostream& out = opts.json == "-" ? std::cout : file;
+        out << "{\n  \"label\": " << json_string(opts.label) << ",\n"
+            << "  \"prefetch\": " << (opts.prefetch ? "true" : "false") << ", \"prefetch_ms\": " << opts.prefetch_ms << ",\n"
+            << "  \"tracks\": [\n";
+        for (size_t i = 0; i < playlist.stats.size(); i++) {
+            const avio::Playlist::TrackStats& t = playlist.stats[i];
+            out << "    { \"file\": " << json_string(t.filename)
+                << ", \"open_ms\": " << t.open_ms
+                << ", \"first_frame_ms\": " << t.first_frame_ms
+                << ", \"boundary_ms\": " << (i ? t.boundary_ms : 0.0)
+                << ", \"samples\": " << t.samples
+                << ", \"expected\": " << (expected[i] ? expected[i] : t.nominal_samples)
+                << ", \"trimmed_start\": " << t.trimmed_start
+                << ", \"trimmed_end\": " << t.trimmed_end
+                << ", \"cache_hit\": " << (t.cache_hit ? "true" : "false")
+                << ", \"prefetch_error\": " << json_string(t.prefetch_error)
+                << ", \"error\": " << json_string(t.error) << " }"
+                << (i + 1 < playlist.stats.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    return failed ? 1 : 0;
+}
+
+// -------- startup --------
+
+// Time from opening a file to its first decoded frame, the median of
+// opts.runs opens for each way of opening it: libavformat defaults, bounded
+// probing, and bounded probing with the stream info cache, once with the
+// entry removed before every open (probe and store) and once with it in
+// place (no probing at all). Cold and warm refer to the stream info cache,
+// the file itself stays in the page cache after the first run.
+
+enum StartupVariant { STARTUP_DEFAULT, STARTUP_FAST, STARTUP_COLD, STARTUP_WARM, STARTUP_VARIANTS };
+
+static const char* STARTUP_NAMES[] = { "default", "fast", "cache cold", "cache warm" };
+
+struct StartupResult {
+    std::string file;
+    double first_frame_ms[STARTUP_VARIANTS] = {};
+    double open_ms[STARTUP_VARIANTS] = {};
+    bool warm_hit = false;
+    std::string error;
+};
+
+static double median(std::vector<double> values) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static StartupResult run_startup(const std::string& path, const Options& opts, avio::StreamInfoCache& cache) {
+    StartupResult result;
+    result.file = path;
+    try {
+        for (int variant = 0; variant < STARTUP_VARIANTS; variant++) {
+            avio::OpenOptions options = variant == STARTUP_DEFAULT ? avio::OpenOptions() : avio::OpenOptions::fast();
+            if (variant >= STARTUP_COLD)
+                options.cache = &cache;
+            options.mmap = opts.input == "mmap";
+            std::vector<double> first_frame, open;
+            bool hit = true;
+            for (int run = 0; run < opts.runs; run++) {
+                if (variant == STARTUP_COLD)
+                    cache.erase(path);
+                avio::Track track(path, options);
+                AVFrame* frame = av_frame_alloc();
+                int ret = track.read(frame);
+                av_frame_free(&frame);
+                if (ret <= 0)
+                    throw std::runtime_error(std::string(STARTUP_NAMES[variant]) + " open decoded no frame");
+                first_frame.push_back(track.first_frame_ms);
+                open.push_back(track.open_ms);
+                hit = hit && track.reader.cache_hit;
+            }
+            result.first_frame_ms[variant] = median(first_frame);
+            result.open_ms[variant] = median(open);
+            if (variant == STARTUP_WARM)
+                result.warm_hit = hit;
+        }
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    return result;
+}
+
+static int report_startup(const std::vector<StartupResult>& results, const Options& opts) {
+    std::cout << std::left << std::setw(24) << "first frame ms" << std::right;
+    for (const char* name : STARTUP_NAMES)
+        std::cout << std::setw(12) << name;
+    std::cout << std::endl;
+
+    bool failed = false;
+    for (const StartupResult& r : results) {
+        std::string name = r.file.substr(r.file.find_last_of('/') + 1);
+        std::cout << std::left << std::setw(24) << name << std::right;
+        if (!r.error.empty()) {
+            std::cout << "  " << r.error << std::endl;
+            failed = true;
+            continue;
+        }
+        std::cout << std::fixed << std::setprecision(2);
+        for (int variant = 0; variant < STARTUP_VARIANTS; variant++)
+            std::cout << std::setw(12) << r.first_frame_ms[variant];
+        std::cout << (r.warm_hit ? "" : "  (cache not used)") << std::endl;
+    }
+
+    if (!opts.json.empty()) {
+        std::ofstream file;
+        if (opts.json != "-") file.open(opts.json);
+        std::ostream& out = opts.json == "-" ? std::cout : file;
+        out << "{\n  \"label\": " << json_string(opts.label) << ", \"runs\": " << opts.runs << ",\n"
+            << "  \"startup\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const StartupResult& r = results[i];
+            out << "    { \"file\": " << json_string(r.file);
+            for (int variant = 0; variant < STARTUP_VARIANTS; variant++) {
+                out << ", " << json_string(STARTUP_NAMES[variant]) << ": { \"open_ms\": " << r.open_ms[variant]
+                    << ", \"first_frame_ms\": " << r.first_frame_ms[variant] << " }";
+            }
+            out << ", \"warm_hit\": " << (r.warm_hit ? "true" : "false")
+                << ", \"error\": " << json_string(r.error) << " }"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    return failed ? 1 : 0;
+}
+
+// -------- seek --------
+
+// Seek latency and accuracy, plain av_seek_frame on the computed timestamp
+// against seeks through the background PacketIndex. Every file is decoded
+// once start to end as the reference, then each seek target is read back
+// and compared: exact when the samples after the seek are bit identical to
+// the reference, otherwise the offset (in samples) that matches best is
+// reported, 0 with a nonzero error means the decoder had not converged.
+
+enum SeekMethod { SEEK_PLAIN, SEEK_INDEX, SEEK_METHODS };
+
+static const char* SEEK_NAMES[] = { "av_seek_frame", "index" };
+
+struct SeekResult {
+    std::string file;
+    double index_ms = 0;
+    size_t index_entries = 0;
+    bool index_cached = false;
+    bool byte_seekable = false;
+    int seeks = 0;
+    double mean_ms[SEEK_METHODS] = {};
+    double max_ms[SEEK_METHODS] = {};
+    int exact[SEEK_METHODS] = {};
+    int64_t worst_offset[SEEK_METHODS] = {};
+    double worst_error[SEEK_METHODS] = {};
+    std::string error;
+};
+
+static const int SEEK_COMPARE = 2048;      // samples compared after each seek
+static const int SEEK_SEARCH = 4096;       // offsets searched either way on a mismatch
+
+// any decoded sample format as interleaved float
+static void append_samples(const AVFrame* frame, std::vector<float>& out) {
+    AVSampleFormat fmt = (AVSampleFormat)frame->format;
+    AVSampleFormat packed = av_get_packed_sample_fmt(fmt);
+    bool planar = av_sample_fmt_is_planar(fmt);
+    int channels = frame->ch_layout.nb_channels;
+    int bytes = av_get_bytes_per_sample(fmt);
+    for (int i = 0; i < frame->nb_samples; i++) {
+        for (int ch = 0; ch < channels; ch++) {
+            const uint8_t* p = planar ? frame->extended_data[ch] + (size_t)i * bytes
+                                      : frame->extended_data[0] + ((size_t)i * channels + ch) * bytes;
+            float value = 0;
+            switch (packed) {
+            case AV_SAMPLE_FMT_U8: value = (p[0] - 128) / 128.0f; break;
+            case AV_SAMPLE_FMT_S16: { int16_t v; memcpy(&v, p, 2); value = v / 32768.0f; break; }
+            case AV_SAMPLE_FMT_S32: { int32_t v; memcpy(&v, p, 4); value = (float)(v / 2147483648.0); break; }
+            case AV_SAMPLE_FMT_FLT: memcpy(&value, p, 4); break;
+            case AV_SAMPLE_FMT_DBL: { double v; memcpy(&v, p, 8); value = (float)v; break; }
+            default: break;
+            }
+            out.push_back(value);
+        }
+    }
+}
+
+static int read_samples(avio::Track& track, AVFrame* frame, std::vector<float>& out, size_t count) {
+    int ret = 1;
+    while (out.size() < count && (ret = track.read(frame)) > 0)
+        append_samples(frame, out);
+    return ret < 0 ? ret : 0;
+}
+
+static SeekResult run_seek(const std::string& path, const Options& opts, avio::StreamInfoCache& cache) {
+    SeekResult result;
+    result.file = path;
+    AVFrame* frame = av_frame_alloc();
+    try {
+        std::vector<float> reference;
+        int channels;
+        {
+            avio::Track track(path, open_options(opts, nullptr));
+            channels = track.decoder.channelLayout()->nb_channels;
+            if (read_samples(track, frame, reference, SIZE_MAX) < 0)
+                throw std::runtime_error("decode error");
+        }
+        int64_t total = (int64_t)reference.size() / channels;
+        if (total < 2 * SEEK_COMPARE)
+            throw std::runtime_error("too short");
+
+        avio::OpenOptions options = open_options(opts, &cache);
+        avio::Track plain(path, open_options(opts, nullptr));
+        options.index = true;
+        avio::Track indexed(path, options);
+        const avio::PacketIndex* index;
+        while (!(index = indexed.indexer->index()))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        result.index_ms = indexed.indexer->buildMs();
+        result.index_cached = indexed.indexer->loadedFromCache();
+        result.index_entries = index->entries.size();
+        result.byte_seekable = index->byte_seekable;
+
+        // the start, a frame boundary region and spread out random targets
+        std::vector<int64_t> targets = { 0, 1, 1151, 4096, total / 2, total - SEEK_COMPARE };
+        uint32_t noise = 12345;
+        while ((int)targets.size() < opts.seeks) {
+            noise = noise * 1664525 + 1013904223;
+            targets.push_back((int64_t)(noise % (uint32_t)(total - SEEK_COMPARE)));
+        }
+        targets.resize(opts.seeks);
+        result.seeks = (int)targets.size();
+
+        avio::Track* tracks[SEEK_METHODS] = { &plain, &indexed };
+        std::vector<float> samples;
+        for (int method = 0; method < SEEK_METHODS; method++) {
+            double sum_ms = 0;
+            for (int64_t target : targets) {
+                samples.clear();
+                auto start = Clock::now();
+                if (tracks[method]->seek(target) < 0 || read_samples(*tracks[method], frame, samples, 1) < 0)
+                    throw std::runtime_error(std::string(SEEK_NAMES[method]) + " seek failed");
+                double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+                sum_ms += ms;
+                result.max_ms[method] = (std::max)(result.max_ms[method], ms);
+                read_samples(*tracks[method], frame, samples, (size_t)SEEK_COMPARE * channels);
+                samples.resize((size_t)SEEK_COMPARE * channels);
+
+                const float* expected = reference.data() + (size_t)target * channels;
+                if (!memcmp(samples.data(), expected, samples.size() * sizeof(float))) {
+                    result.exact[method]++;
+                    continue;
+                }
+                // where in the reference the samples came from
+                int64_t best_offset = 0;
+                double best_error = 1e30;
+                for (int64_t offset = -SEEK_SEARCH; offset <= SEEK_SEARCH; offset++) {
+                    if (target + offset < 0 || target + offset + SEEK_COMPARE > total)
+                        continue;
+                    const float* ref = reference.data() + (size_t)(target + offset) * channels;
+                    double error = 0;
+                    for (size_t i = 0; i < samples.size() && error < best_error; i++)
+                        error = (std::max)(error, (double)std::fabs(samples[i] - ref[i]));
+                    if (error < best_error) {
+                        best_error = error;
+                        best_offset = offset;
+                    }
+                }
+                if (std::llabs(best_offset) > std::llabs(result.worst_offset[method]))
+                    result.worst_offset[method] = best_offset;
+                result.worst_error[method] = (std::max)(result.worst_error[method], best_error);
+            }
+            result.mean_ms[method] = sum_ms / targets.size();
+        }
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    av_frame_free(&frame);
+    return result;
+}
+
+static int report_seek(const std::vector<SeekResult>& results, const Options& opts) {
+    std::cout << std::left << std::setw(24) << "seek" << std::right << std::setw(18) << "index ms/entries";
+    for (const char* name : SEEK_NAMES)
+        std::cout << std::setw(34) << std::string(name) + " mean/max ms exact offset";
+    std::cout << std::endl;
+
+    bool failed = false;
+    for (const SeekResult& r : results) {
+        std::string name = r.file.substr(r.file.find_last_of('/') + 1);
+        std::cout << std::left << std::setw(24) << name << std::right;
+        if (!r.error.empty()) {
+            std::cout << "  " << r.error << std::endl;
+            failed = true;
+            continue;
+        }
+        std::stringstream index;
+        index << std::fixed << std::setprecision(1) << r.index_ms << (r.index_cached ? "c" : "") << "/" << r.index_entries;
+        std::cout << std::setw(18) << index.str();
+        for (int method = 0; method < SEEK_METHODS; method++) {
+            std::stringstream cell;
+            cell << std::fixed << std::setprecision(2) << r.mean_ms[method] << "/" << r.max_ms[method]
+                 << "  " << r.exact[method] << "/" << r.seeks << "  " << r.worst_offset[method];
+            std::cout << std::setw(34) << cell.str();
+        }
+        std::cout << std::endl;
+        if (r.exact[SEEK_INDEX] < r.seeks && r.worst_offset[SEEK_INDEX])
+            failed = true;
+    }
+
+    if (!opts.json.empty()) {
+        std::ofstream file;
+        if (opts.json != "-") file.open(opts.json);
+        std::ostream& out = opts.json == "-" ? std::cout : file;
+        out << "{\n  \"label\": " << json_string(opts.label) << ",\n  \"seek\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const SeekResult& r = results[i];
+            out << "    { \"file\": " << json_string(r.file)
+                << ", \"index_ms\": " << r.index_ms
+                << ", \"index_cached\": " << (r.index_cached ? "true" : "false")
+                << ", \"index_entries\": " << r.index_entries
+                << ", \"byte_seekable\": " << (r.byte_seekable ? "true" : "false")
+                << ", \"seeks\": " << r.seeks;
+            for (int method = 0; method < SEEK_METHODS; method++) {
+                out << ", " << json_string(SEEK_NAMES[method]) << ": { \"mean_ms\": " << r.mean_ms[method]
+                    << ", \"max_ms\": " << r.max_ms[method]
+                    << ", \"exact\": " << r.exact[method]
+                    << ", \"worst_offset\": " << r.worst_offset[method]
+                    << ", \"worst_error\": " << r.worst_error[method] << " }";
+            }
+            out << ", \"error\": " << json_string(r.error) << " }"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    return failed ? 1 : 0;
+}
+
+// -------- mix --------
+
+// N sources decoded on the worker pool and mixed offline, the mix loop waits
+// for the slowest source instead of counting underruns. Decoder cost per
+// source is the process CPU time outside the mix thread, split over the
+// sources and the seconds of audio produced.
+
+struct MixResult {
+    int sources = 0;
+    int workers = 0;
+    double audio_seconds = 0;
+    double wall_seconds = 0;
+    double realtime = 0;
+    double mix_cpu_ms = 0;              // mix thread
+    double decode_cpu_ms = 0;           // worker pool
+    double cpu_per_source_ms = 0;       // decode CPU per source and second of audio
+    double mix_per_source_us = 0;       // mix thread CPU per source and period
+    uint64_t periods = 0;
+    uint64_t underruns = 0;
+    avio::Histogram::Snapshot mix_latency_us;
+    std::string error;
+};
+
+static double process_cpu_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static MixResult run_mix(const std::vector<std::string>& paths, int sources, const Options& opts,
+                         avio::StreamInfoCache* cache)
+{
+    MixResult result;
+    result.sources = sources;
+    avio::Metrics::instance().reset();
+    avio::NullSink sink(opts.rate, opts.channels, sizeof(float), opts.rate / 10);
+    avio::CoalescingSink coalesced(&sink, (int)((int64_t)opts.rate * opts.period_ms / 1000));
+    avio::WorkerPool pool(opts.workers);
+    result.workers = pool.size();
+
+    double process_start = process_cpu_ms();
+    double thread_start = thread_cpu_ms();
+    auto start = Clock::now();
+    try {
+        avio::Mixer mixer(&coalesced, AV_SAMPLE_FMT_FLT, &pool, sources);
+        mixer.offline = true;
+        // unity gain over all sources keeps the sum in range most of the time
+        float gain = 1.0f / sources;
+        for (int i = 0; i < sources; i++)
+            mixer.add(paths[i % paths.size()], gain, open_options(opts, cache));
+        while (!mixer.finished()) {
+            if (!mixer.mix())
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        coalesced.flush();
+        result.periods = mixer.periods;
+        for (int i = 0; i < mixer.count(); i++) {
+            result.underruns += mixer.source(i)->underruns;
+            if (result.error.empty() && !mixer.source(i)->error.empty())
+                result.error = mixer.source(i)->filename + ": " + mixer.source(i)->error;
+        }
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    result.wall_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.mix_cpu_ms = thread_cpu_ms() - thread_start;
+    result.decode_cpu_ms = (std::max)(0.0, process_cpu_ms() - process_start - result.mix_cpu_ms);
+
+    result.audio_seconds = (double)sink.frames_rendered / opts.rate;
+    if (result.audio_seconds > 0) {
+        result.realtime = result.audio_seconds / result.wall_seconds;
+        result.cpu_per_source_ms = result.decode_cpu_ms / sources / result.audio_seconds;
+    }
+    if (result.periods)
+        result.mix_per_source_us = result.mix_cpu_ms * 1000.0 / result.periods / sources;
+    result.mix_latency_us = avio::Metrics::instance().mix_latency_us.snapshot();
+    return result;
+}
+
+static int report_mix(const std::vector<MixResult>& results, const Options& opts) {
+    std::cout << std::setw(7) << "sources" << std::setw(8) << "workers" << std::setw(10) << "realtime"
+              << std::setw(11) << "audio s" << std::setw(16) << "decode ms/src/s"
+              << std::setw(12) << "mix cpu ms" << std::setw(16) << "mix us/src/prd"
+              << std::setw(16) << "mix p50/p99 us" << std::setw(10) << "underruns" << std::endl;
+
+    bool failed = false;
+    for (const MixResult& r : results) {
+        std::stringstream latency;
+        latency << r.mix_latency_us.percentile(0.5) << "/" << r.mix_latency_us.percentile(0.99);
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::setw(7) << r.sources << std::setw(8) << r.workers
+                  << std::setw(9) << r.realtime << "x" << std::setw(11) << r.audio_seconds
+                  << std::setprecision(2) << std::setw(16) << r.cpu_per_source_ms
+                  << std::setprecision(1) << std::setw(12) << r.mix_cpu_ms
+                  << std::setprecision(3) << std::setw(16) << r.mix_per_source_us
+                  << std::setw(16) << latency.str() << std::setw(10) << r.underruns << std::endl;
+        if (!r.error.empty()) {
+            std::cout << "  " << r.error << std::endl;
+            failed = true;
+        }
+    }
+
+    if (!opts.json.empty()) {
+        std::ofstream file;
+        if (opts.json != "-") file.open(opts.json);
+        std::ostream& out = opts.json == "-" ? std::cout : file;
+        out << "{\n  \"label\": " << json_string(opts.label) << ",\n  \"mix\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const MixResult& r = results[i];
+            out << "    { \"sources\": " << r.sources
+                << ", \"workers\": " << r.workers
+                << ", \"audio_seconds\": " << r.audio_seconds
+                << ", \"wall_seconds\": " << r.wall_seconds
+                << ", \"realtime\": " << r.realtime
+                << ", \"mix_cpu_ms\": " << r.mix_cpu_ms
+                << ", \"decode_cpu_ms\": " << r.decode_cpu_ms
+                << ", \"cpu_per_source_ms\": " << r.cpu_per_source_ms
+                << ", \"mix_per_source_us\": " << r.mix_per_source_us
+                << ", \"periods\": " << r.periods
+                << ", \"underruns\": " << r.underruns
+                << ", \"mix_latency_us\": { \"p50\": " << r.mix_latency_us.percentile(0.5)
+                << ", \"p99\": " << r.mix_latency_us.percentile(0.99)
+                << ", \"max\": " << r.mix_latency_us.max << " }"
+                << ", \"error\": " << json_string(r.error) << " }"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    return failed ? 1 : 0;
+}
+
+// -------- analyze --------
+
+// Loudness of every file, first front to back on this thread as the
+// reference, then segmented on work stealing pools of growing size. The
+// segmented values have to match the reference, merging is exact up to the
+// filter state a segment inherits from its preroll.
+
+struct AnalyzeRun {
+    int workers = 0;                    // 0 for the reference
+    double wall_seconds = 0;
+    double files_per_sec = 0;
+    double audio_per_sec = 0;           // seconds of audio measured per second
+    double speedup = 0;                 // against one worker
+    uint64_t steals = 0;
+    double max_diff_lu = 0;             // integrated loudness against the reference
+    double max_diff_tp_db = 0;
+    std::vector<avio::LoudnessScanner::Result> results;
+};
+
+static void compare_loudness(AnalyzeRun& run, const AnalyzeRun& reference) {
+    for (size_t i = 0; i < run.results.size(); i++) {
+        const avio::Loudness& a = run.results[i].loudness;
+        const avio::Loudness& b = reference.results[i].loudness;
+        if (std::isfinite(a.integrated) && std::isfinite(b.integrated))
+            run.max_diff_lu = (std::max)(run.max_diff_lu, std::fabs(a.integrated - b.integrated));
+        else if (std::isfinite(a.integrated) != std::isfinite(b.integrated))
+            run.max_diff_lu = HUGE_VAL;
+        if (a.true_peak > 0 && b.true_peak > 0)
+            run.max_diff_tp_db = (std::max)(run.max_diff_tp_db, std::fabs(a.truePeakDb() - b.truePeakDb()));
+    }
+}
+
+static void time_analyze_run(AnalyzeRun& run, Clock::time_point start) {
+    run.wall_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    double audio_seconds = 0;
+    for (const avio::LoudnessScanner::Result& r : run.results) {
+        if (r.error.empty() && r.loudness.sample_rate)
+            audio_seconds += (double)r.loudness.samples / r.loudness.sample_rate;
+    }
+    run.files_per_sec = run.results.size() / run.wall_seconds;
+    run.audio_per_sec = audio_seconds / run.wall_seconds;
+}
+
+static int run_analyze(const std::vector<std::string>& paths, const Options& opts, avio::StreamInfoCache* cache) {
+    avio::OpenOptions options = open_options(opts, cache);
+
+    AnalyzeRun reference;
+    auto start = Clock::now();
+    for (const std::string& path : paths)
+        reference.results.push_back(avio::LoudnessScanner::analyze(path, options));
+    time_analyze_run(reference, start);
+
+    std::vector<AnalyzeRun> runs;
+    int max_workers = opts.workers > 0 ? opts.workers : (std::max)(1, (int)std::thread::hardware_concurrency());
+    std::vector<int> counts;
+    for (int workers = 1; workers < max_workers; workers *= 2)
+        counts.push_back(workers);
+    counts.push_back(max_workers);
+    for (int workers : counts) {
+        AnalyzeRun run;
+        run.workers = workers;
+        avio::WorkerPool pool(workers);
+        avio::LoudnessScanner scanner(&pool);
+        scanner.options = options;
+        scanner.segment_ms = opts.segment_ms;
+        start = Clock::now();
+        run.results = scanner.scan(paths);
+        time_analyze_run(run, start);
+        run.steals = pool.steals();
+        compare_loudness(run, reference);
+        run.speedup = runs.empty() ? 1.0 : runs.front().wall_seconds / run.wall_seconds;
+        runs.push_back(run);
+    }
+
+    const AnalyzeRun& widest = runs.back();
+    std::cout << std::left << std::setw(24) << "loudness" << std::right
+              << std::setw(9) << "LUFS" << std::setw(9) << "dBTP" << std::setw(9) << "RG dB"
+              << std::setw(7) << "segs" << std::setw(11) << "ref LUFS" << std::setw(10) << "ref dBTP" << std::endl;
+    bool failed = false;
+    for (size_t i = 0; i < paths.size(); i++) {
+        const avio::LoudnessScanner::Result& r = widest.results[i];
+        const avio::LoudnessScanner::Result& ref = reference.results[i];
+        std::string name = r.file.substr(r.file.find_last_of('/') + 1);
+        std::cout << std::left << std::setw(24) << name << std::right;
+        if (!r.error.empty() || !ref.error.empty()) {
+            std::cout << "  " << (r.error.empty() ? ref.error : r.error) << std::endl;
+            failed = true;
+            continue;
+        }
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(9) << r.loudness.integrated << std::setw(9) << r.loudness.truePeakDb()
+                  << std::setw(9) << r.loudness.replayGain() << std::setw(7) << r.segments
+                  << std::setw(11) << ref.loudness.integrated << std::setw(10) << ref.loudness.truePeakDb() << std::endl;
+    }
+
+    std::cout << std::setw(8) << "workers" << std::setw(10) << "files/s" << std::setw(12) << "audio x"
+              << std::setw(9) << "speedup" << std::setw(12) << "efficiency" << std::setw(8) << "steals"
+              << std::setw(14) << "max diff LU" << std::setw(14) << "max diff dBTP" << std::endl;
+    std::cout << std::setw(8) << "ref" << std::fixed << std::setprecision(2)
+              << std::setw(10) << reference.files_per_sec << std::setprecision(1) << std::setw(12) << reference.audio_per_sec
+              << std::endl;
+    for (const AnalyzeRun& run : runs) {
+        std::cout << std::setw(8) << run.workers << std::fixed << std::setprecision(2)
+                  << std::setw(10) << run.files_per_sec << std::setprecision(1) << std::setw(12) << run.audio_per_sec
+                  << std::setprecision(2) << std::setw(9) << run.speedup
+                  << std::setw(11) << 100.0 * run.speedup / run.workers << "%" << std::setw(8) << run.steals
+                  << std::setprecision(4) << std::setw(14) << run.max_diff_lu << std::setw(14) << run.max_diff_tp_db << std::endl;
+        if (run.max_diff_lu > 0.01 || run.max_diff_tp_db > 0.01)
+            failed = true;
+    }
+
+    if (!opts.json.empty()) {
+        std::ofstream file;
+        if (opts.json != "-") file.open(opts.json);
+        std::ostream& out = opts.json == "-" ? std::cout : file;
+        out << "{\n  \"label\": " << json_string(opts.label) << ", \"segment_ms\": " << opts.segment_ms << ",\n  \"files\": [\n";
+        for (size_t i = 0; i < paths.size(); i++) {
+            const avio::LoudnessScanner::Result& r = widest.results[i];
+            const avio::LoudnessScanner::Result& ref = reference.results[i];
+            out << "    { \"file\": " << json_string(r.file)
+                << ", \"integrated_lufs\": " << (std::isfinite(r.loudness.integrated) ? r.loudness.integrated : -1000.0)
+                << ", \"true_peak_dbtp\": " << (r.loudness.true_peak > 0 ? r.loudness.truePeakDb() : -1000.0)
+                << ", \"sample_peak\": " << r.loudness.sample_peak
+                << ", \"replaygain_db\": " << r.loudness.replayGain()
+                << ", \"segments\": " << r.segments
+                << ", \"reference_lufs\": " << (std::isfinite(ref.loudness.integrated) ? ref.loudness.integrated : -1000.0)
+                << ", \"error\": " << json_string(r.error.empty() ? ref.error : r.error) << " }"
+                << (i + 1 < paths.size() ? "," : "") << "\n";
+        }
+        out << "  ],\n  \"reference\": { \"files_per_sec\": " << reference.files_per_sec
+            << ", \"audio_per_sec\": " << reference.audio_per_sec << " },\n  \"runs\": [\n";
+        for (size_t i = 0; i < runs.size(); i++) {
+            const AnalyzeRun& run = runs[i];
+            out << "    { \"workers\": " << run.workers
+                << ", \"wall_seconds\": " << run.wall_seconds
+                << ", \"files_per_sec\": " << run.files_per_sec
+                << ", \"audio_per_sec\": " << run.audio_per_sec
+                << ", \"speedup\": " << run.speedup
+                << ", \"steals\": " << run.steals
+                << ", \"max_diff_lu\": " << run.max_diff_lu
+                << ", \"max_diff_tp_db\": " << run.max_diff_tp_db << " }"
+                << (i + 1 < runs.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    return failed ? 1 : 0;
+}
+
+// -------- pipelines --------
+
+// N pipelines at once into null sinks, first with the four dedicated threads
+// per pipeline of run_pipeline, then with reader, decoder and converter as
+// PipelineScheduler tasks on one pool and a single render thread serving all
+// rings. Threads are sampled from /proc/self/status while the run lasts,
+// context switches come from getrusage for the whole process less those of
+// the sampling thread itself.
+
+static const char* SCHED_NAMES[] = { "threads", "tasks" };
+
+struct SchedResult {
+    int pipelines = 0;
+    int mode = 0;                       // index into SCHED_NAMES
+    int workers = 0;                    // pool threads, 0 for dedicated threads
+    int peak_threads = 0;
+    long voluntary_switches = 0;
+    long involuntary_switches = 0;
+    double audio_seconds = 0;           // over all pipelines
+    double wall_seconds = 0;
+    double realtime = 0;                // audio_seconds / wall_seconds
+    double cpu_ms = 0;
+    double switches_per_audio_sec = 0;
+    uint64_t steps = 0;
+    std::string error;
+};
+
+static int process_threads() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (!line.compare(0, 8, "Threads:"))
+            return std::stoi(line.substr(8));
+    }
+    return 0;
+}
+
+static void context_switches(int who, long& voluntary, long& involuntary) {
+    rusage usage;
+    voluntary = involuntary = 0;
+    if (getrusage(who, &usage))
+        return;
+    voluntary = usage.ru_nvcsw;
+    involuntary = usage.ru_nivcsw;
+}
+
+// A render thread at real time priority as on a device, silently stays
+// normal without the privilege
+static void raise_render_priority() {
+    sched_param param{};
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+}
+
+// the render side of one pipeline, what the device would consume
+struct SchedSink {
+    avio::NullSink sink;
+    avio::CoalescingSink coalesced;
+    avio::AudioSink* device;
+
+    SchedSink(const Options& opts) :
+        sink(opts.rate, opts.channels, sizeof(float), opts.rate / 10),
+        coalesced(&sink, (int)((int64_t)opts.rate * opts.period_ms / 1000)),
+        device(opts.coalesce ? (avio::AudioSink*)&coalesced : &sink)
+    { }
+};
+
+// run_pipeline without the per stage accounting, blocking queues between
+// four threads
+struct ThreadedPipeline {
+    avio::AudioReader reader;
+    avio::AudioDecoder decoder;
+    avio::MediaQueue<AVPacket> pkts;
+    avio::MediaQueue<AVFrame> frames;
+    avio::PcmRing ring;
+    avio::RingSink ring_sink;
+    std::string error;
+    std::vector<std::thread> threads;
+
+    ThreadedPipeline(const std::string& path, const Options& opts, const avio::OpenOptions& options) :
+        reader(path, options),
+        decoder(reader.stream),
+        pkts(opts.packet_queue, reader.stream->time_base),
+        frames(opts.frame_queue),
+        ring(opts.channels * (int)sizeof(float), opts.rate, 200),
+        ring_sink(&ring, opts.rate, opts.channels)
+    { }
+
+    ~ThreadedPipeline() {
+        pkts.close();
+        frames.close();
+        ring.close();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    void start(SchedSink* out, const Options& opts) {
+        threads.emplace_back([this] {
+            AVIO_TRACE_THREAD("reader");
+            while (true) {
+                AVPacket* pkt = av_packet_alloc();
+                if (reader.read(pkt) <= 0) {
+                    av_packet_free(&pkt);
+                    break;
+                }
+                if (!pkts.push(pkt))
+                    break;
+            }
+            pkts.close();
+        });
+        threads.emplace_back([this] {
+            AVIO_TRACE_THREAD("decoder");
+            AVFrame* frame = av_frame_alloc();
+            while (true) {
+                AVPacket* pkt = pkts.pop();
+                decoder.send(pkt);
+                while (decoder.receive(frame) > 0) {
+                    frames.push(frame);
+                    frame = av_frame_alloc();
+                }
+                if (!pkt) break;
+                av_packet_free(&pkt);
+            }
+            av_frame_free(&frame);
+            frames.close();
+        });
+        threads.emplace_back([this, &opts] {
+            AVIO_TRACE_THREAD("filter");
+            avio::SwrRender render(nullptr, &ring_sink, AV_SAMPLE_FMT_FLT, 0);
+            render.use_kernels = opts.kernels;
+            auto wait = [] { std::this_thread::sleep_for(std::chrono::microseconds(100)); };
+            while (AVFrame* frame = frames.pop()) {
+                if (render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait) < 0) {
+                    error = "Failed to initialize SwrContext";
+                    av_frame_free(&frame);
+                    break;
+                }
+                render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+                av_frame_free(&frame);
+            }
+            render.render(nullptr, 0, wait);
+            ring.close();
+            frames.close();
+        });
+        threads.emplace_back([this, out] {
+            AVIO_TRACE_THREAD("render");
+            raise_render_priority();
+            while (!ring.finished()) {
+                if (!avio::renderFromRing(out->device, &ring))
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            out->coalesced.flush();
+        });
+    }
+};
+
+static SchedResult run_sched(const std::vector<std::string>& paths, int count, int mode, const Options& opts,
+                             avio::StreamInfoCache* cache)
+{
+    SchedResult result;
+    result.pipelines = count;
+    result.mode = mode;
+    avio::OpenOptions options = open_options(opts, cache);
+    std::vector<std::unique_ptr<SchedSink>> sinks;
+    for (int i = 0; i < count; i++)
+        sinks.emplace_back(new SchedSink(opts));
+
+    long voluntary = 0, involuntary = 0, own_voluntary = 0, own_involuntary = 0;
+    double cpu = 0;
+    Clock::time_point start;
+    // main thread: sample the thread count until done() holds
+    auto sample = [&](const std::function<bool()>& done) {
+        do {
+            result.peak_threads = (std::max)(result.peak_threads, process_threads());
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        } while (!done());
+    };
+    auto begin = [&] {
+        context_switches(RUSAGE_SELF, voluntary, involuntary);
+        context_switches(RUSAGE_THREAD, own_voluntary, own_involuntary);
+        cpu = process_cpu_ms();
+        start = Clock::now();
+    };
+    auto end = [&] {
+        result.wall_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.cpu_ms = process_cpu_ms() - cpu;
+        long v, n, own_v, own_n;
+        context_switches(RUSAGE_SELF, v, n);
+        context_switches(RUSAGE_THREAD, own_v, own_n);
+        result.voluntary_switches = (v - voluntary) - (own_v - own_voluntary);
+        result.involuntary_switches = (n - involuntary) - (own_n - own_involuntary);
+    };
+
+    try {
+        if (mode == 0) {
+            std::vector<std::unique_ptr<ThreadedPipeline>> pipelines;
+            for (int i = 0; i < count; i++)
+                pipelines.emplace_back(new ThreadedPipeline(paths[i % paths.size()], opts, options));
+            begin();
+            for (int i = 0; i < count; i++)
+                pipelines[i]->start(sinks[i].get(), opts);
+            sample([&] {
+                for (auto& pipeline : pipelines) {
+                    if (!pipeline->ring.finished())
+                        return false;
+                }
+                return true;
+            });
+            for (auto& pipeline : pipelines) {
+                for (std::thread& thread : pipeline->threads)
+                    thread.join();
+                pipeline->threads.clear();
+            }
+            end();
+            for (auto& pipeline : pipelines) {
+                if (result.error.empty() && !pipeline->error.empty())
+                    result.error = pipeline->error;
+            }
+        }
+        else {
+            int workers = opts.workers > 0 ? opts.workers : (std::max)(1, (int)std::thread::hardware_concurrency());
+            avio::WorkerPool pool(workers);
+            avio::PipelineScheduler scheduler(&pool);
+            result.workers = pool.size();
+            std::vector<std::unique_ptr<avio::ScheduledPipeline>> pipelines;
+            for (int i = 0; i < count; i++) {
+                pipelines.emplace_back(new avio::ScheduledPipeline(&scheduler, paths[i % paths.size()], opts.rate,
+                    opts.channels, opts.packet_queue, opts.frame_queue, 200, options));
+                pipelines.back()->use_kernels = opts.kernels;
+            }
+            begin();
+            for (auto& pipeline : pipelines)
+                pipeline->start();
+            // one render thread for all pipelines
+            std::thread render_thread([&] {
+                AVIO_TRACE_THREAD("render");
+                raise_render_priority();
+                bool finished = false;
+                while (!finished) {
+                    finished = true;
+                    bool written = false;
+                    for (int i = 0; i < count; i++) {
+                        if (pipelines[i]->finished())
+                            continue;
+                        finished = false;
+                        if (avio::renderFromRing(sinks[i]->device, &pipelines[i]->ring)) {
+                            written = true;
+                            pipelines[i]->kick();
+                        }
+                    }
+                    if (!written && !finished)
+                        std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+                for (auto& sink : sinks)
+                    sink->coalesced.flush();
+            });
+            sample([&] {
+                for (auto& pipeline : pipelines) {
+                    if (!pipeline->finished())
+                        return false;
+                }
+                return true;
+            });
+            render_thread.join();
+            pipelines.clear();
+            end();
+            result.steps = scheduler.steps();
+        }
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+    }
+
+    for (auto& sink : sinks)
+        result.audio_seconds += (double)sink->sink.frames_rendered / opts.rate;
+    if (result.wall_seconds > 0)
+        result.realtime = result.audio_seconds / result.wall_seconds;
+    if (result.audio_seconds > 0)
+        result.switches_per_audio_sec = (result.voluntary_switches + result.involuntary_switches) / result.audio_seconds;
+    return result;
+}
+
+static int report_sched(const std::vector<SchedResult>& results, const Options& opts) {
+    std::cout << std::setw(9) << "pipelines" << std::setw(9) << "mode" << std::setw(8) << "workers"
+              << std::setw(9) << "threads" << std::setw(10) << "vol csw" << std::setw(10) << "invol csw"
+              << std::setw(12) << "csw/audio s" << std::setw(10) << "realtime" << std::setw(11) << "audio s"
+              << std::setw(11) << "cpu ms" << std::endl;
+
+    bool failed = false;
+    for (const SchedResult& r : results) {
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::setw(9) << r.pipelines << std::setw(9) << SCHED_NAMES[r.mode] << std::setw(8) << r.workers
+                  << std::setw(9) << r.peak_threads << std::setw(10) << r.voluntary_switches
+                  << std::setw(10) << r.involuntary_switches << std::setw(12) << r.switches_per_audio_sec
+                  << std::setw(9) << r.realtime << "x" << std::setw(11) << r.audio_seconds
+                  << std::setw(11) << r.cpu_ms << std::endl;
+        if (!r.error.empty()) {
+            std::cout << "  " << r.error << std::endl;
+            failed = true;
+        }
+    }
+
+    if (!opts.json.empty()) {
+        std::ofstream file;
+        if (opts.json != "-") file.open(opts.json);
+        std::ostream& out = opts.json == "-" ? std::cout : file;
+        out << "{\n  \"label\": " << json_string(opts.label) << ",\n  \"pipelines\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const SchedResult& r = results[i];
+            out << "    { \"pipelines\": " << r.pipelines
+                << ", \"mode\": " << json_string(SCHED_NAMES[r.mode])
+                << ", \"workers\": " << r.workers
+                << ", \"peak_threads\": " << r.peak_threads
+                << ", \"voluntary_switches\": " << r.voluntary_switches
+                << ", \"involuntary_switches\": " << r.involuntary_switches
+                << ", \"switches_per_audio_sec\": " << r.switches_per_audio_sec
+                << ", \"audio_seconds\": " << r.audio_seconds
+                << ", \"wall_seconds\": " << r.wall_seconds
+                << ", \"realtime\": " << r.realtime
+                << ", \"cpu_ms\": " << r.cpu_ms
+                << ", \"steps\": " << r.steps
+                << ", \"error\": " << json_string(r.error) << " }"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    return failed ? 1 : 0;
+}
+
+// -------- clips --------
+
+// Latency from asking for a sound to its first period on the sink, streamed
+// (open, decode and convert until a period is written) against the decoded
+// PCM cache, cold (the entry removed first, the whole file is decoded and
+// stored) and on a hit (lookup and one copy into the sink). Medians of
+// opts.runs. Every file then gets played once more in order from a fresh
+// cache of the same size to show what the byte cap keeps, and the memory the
+// cache holds is compared with the process peak.
+
+struct ClipResult {
+    std::string file;
+    double stream_ms = 0;
+    double cold_ms = 0;
+    double hit_us = 0;
+    size_t clip_bytes = 0;
+    double clip_seconds = 0;
+    std::string error;
+};
+
+struct ClipSummary {
+    size_t max_bytes = 0;
+    size_t cache_bytes = 0;
+    size_t clips = 0;
+    uint64_t replay_hits = 0;
+    uint64_t replay_misses = 0;
+    uint64_t evictions = 0;
+    long peak_rss_kb = 0;
+};
+
+static ClipResult run_clip(const std::string& path, const Options& opts, avio::PcmCache& pcm,
+                           avio::StreamInfoCache* cache)
+{
+    ClipResult result;
+    result.file = path;
+    int period = (std::max)(1, (int)((int64_t)opts.rate * opts.period_ms / 1000));
+    avio::NullSink sink(opts.rate, opts.channels, sizeof(float), opts.rate / 10);
+    std::vector<double> stream, cold, hit;
+    try {
+        for (int run = 0; run < opts.runs; run++) {
+            sink.frames_rendered = 0;
+            auto start = Clock::now();
+            avio::Track track(path, open_options(opts, cache));
+            avio::SwrRender render(nullptr, &sink, AV_SAMPLE_FMT_FLT, 0);
+            render.use_kernels = opts.kernels;
+            auto wait = [] {};
+            AVFrame* frame = av_frame_alloc();
+            while (sink.frames_rendered < (uint64_t)period && track.read(frame) > 0) {
+                if (render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait) < 0)
+                    break;
+                render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+            }
+            stream.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+            av_frame_free(&frame);
+            if (sink.frames_rendered < (uint64_t)period)
+                throw std::runtime_error("streamed less than a period");
+        }
+
+        for (int run = 0; run < opts.runs; run++) {
+            pcm.erase(path);
+            std::string error;
+            auto start = Clock::now();
+            std::shared_ptr<const avio::PcmClip> clip = pcm.get(path, opts.rate, opts.channels, AV_SAMPLE_FMT_FLT, &error);
+            if (!clip)
+                throw std::runtime_error(error);
+            avio::ClipPlayer player(clip);
+            player.render(&sink, period);
+            cold.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+            result.clip_bytes = clip->bytes();
+            result.clip_seconds = (double)clip->frames / clip->sample_rate;
+        }
+
+        for (int run = 0; run < opts.runs; run++) {
+            auto start = Clock::now();
+            std::shared_ptr<const avio::PcmClip> clip = pcm.find(path, opts.rate, opts.channels, AV_SAMPLE_FMT_FLT);
+            if (!clip)
+                throw std::runtime_error("clip larger than the cache");
+            avio::ClipPlayer player(clip);
+            player.render(&sink, period);
+            hit.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    result.stream_ms = median(stream);
+    result.cold_ms = median(cold);
+    result.hit_us = median(hit);
+    return result;
+}
+
+static int run_clips(const std::vector<std::string>& paths, const Options& opts, avio::StreamInfoCache* cache) {
+    reset_peak_rss();
+    size_t max_bytes = (size_t)opts.clips_mb << 20;
+    std::vector<ClipResult> results;
+    {
+        avio::PcmCache pcm(max_bytes);
+        pcm.max_clip_bytes = max_bytes;
+        pcm.options = open_options(opts, cache);
+        for (const std::string& path : paths)
+            results.push_back(run_clip(path, opts, pcm, cache));
+    }
+
+    // two passes over all files, the second one hits what the cap kept
+    ClipSummary summary;
+    summary.max_bytes = max_bytes;
+    avio::PcmCache pcm(max_bytes);
+    pcm.max_clip_bytes = max_bytes;
+    pcm.options = open_options(opts, cache);
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t hits = pcm.hits, misses = pcm.misses;
+        for (const std::string& path : paths)
+            pcm.get(path, opts.rate, opts.channels, AV_SAMPLE_FMT_FLT);
+        summary.replay_hits = pcm.hits - hits;
+        summary.replay_misses = pcm.misses - misses;
+    }
+    summary.cache_bytes = pcm.bytes();
+    summary.clips = pcm.size();
+    summary.evictions = pcm.evictions;
+    summary.peak_rss_kb = peak_rss_kb();
+
+    std::cout << std::left << std::setw(24) << "first period" << std::right
+              << std::setw(12) << "stream ms" << std::setw(12) << "cold ms" << std::setw(12) << "hit us"
+              << std::setw(12) << "clip s" << std::setw(12) << "clip KB" << std::endl;
+    bool failed = false;
+    for (const ClipResult& r : results) {
+        std::string name = r.file.substr(r.file.find_last_of('/') + 1);
+        std::cout << std::left << std::setw(24) << name << std::right;
+        if (!r.error.empty()) {
+            std::cout << "  " << r.error << std::endl;
+            failed = true;
+            continue;
+        }
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(12) << r.stream_ms << std::setw(12) << r.cold_ms << std::setw(12) << r.hit_us
+                  << std::setw(12) << r.clip_seconds << std::setw(12) << r.clip_bytes / 1024 << std::endl;
+    }
+    std::cout << "cache " << summary.cache_bytes / 1024 << " KB of " << summary.max_bytes / 1024 << " KB in "
+              << summary.clips << " clips, replay " << summary.replay_hits << " hits " << summary.replay_misses
+              << " misses, " << summary.evictions << " evictions, peak rss " << summary.peak_rss_kb << " KB" << std::endl;
+
+    if (!opts.json.empty()) {
+        std::ofstream file;
+        if (opts.json != "-") file.open(opts.json);
+        std::ostream& out = opts.json == "-" ? std::cout : file;
+        out << "{\n  \"label\": " << json_string(opts.label) << ", \"runs\": " << opts.runs
+            << ", \"period_ms\": " << opts.period_ms << ",\n"
+            << "  \"cache\": { \"max_bytes\": " << summary.max_bytes
+            << ", \"bytes\": " << summary.cache_bytes
+            << ", \"clips\": " << summary.clips
+            << ", \"replay_hits\": " << summary.replay_hits
+            << ", \"replay_misses\": " << summary.replay_misses
+            << ", \"evictions\": " << summary.evictions
+            << ", \"peak_rss_kb\": " << summary.peak_rss_kb << " },\n"
+            << "  \"clips\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const ClipResult& r = results[i];
+            out << "    { \"file\": " << json_string(r.file)
+                << ", \"stream_ms\": " << r.stream_ms
+                << ", \"cold_ms\": " << r.cold_ms
+                << ", \"hit_us\": " << r.hit_us
+                << ", \"clip_seconds\": " << r.clip_seconds
+                << ", \"clip_bytes\": " << r.clip_bytes
+                << ", \"error\": " << json_string(r.error) << " }"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    return failed ? 1 : 0;
+}
+
+// -------- trace --------
+
+// --trace: the tracer records from the start of main, the file is written on
+// the way out whatever mode ran.
+
+struct TraceSession {
+    std::string path;
+
+    TraceSession(const std::string& path) : path(path) {
+        if (path.empty()) return;
+        AVIO_TRACE_THREAD("main");
+        avio::Tracer::instance().start();
+    }
+
+    ~TraceSession() {
+        if (path.empty()) return;
+        avio::Tracer& tracer = avio::Tracer::instance();
+        tracer.stop();
+        if (!tracer.write(path)) {
+            std::cerr << "Cannot write trace " << path << std::endl;
+            return;
+        }
+        std::cout << "trace: " << tracer.events() << " events, " << tracer.overwritten() << " overwritten, " << path
+#ifdef AVIO_NO_TRACE
+                  << " (built with AVIO_NO_TRACE, nothing recorded)"
+#endif
+                  << std::endl;
+    }
+};
+
+// What tracing costs: the pipeline of every file with the tracer stopped and
+// recording, alternating, opts.runs each, and the median throughput of both;
+// then the time of one span and counter in a tight loop, stopped and
+// recording. Stopped is what a build with tracing in pays when nobody looks.
+// With --trace the file holds the last recorded run.
+
+struct OverheadResult {
+    std::string file;
+    double off_samples_per_sec = 0;
+    double on_samples_per_sec = 0;
+    double overhead_pct = 0;
+    uint64_t events = 0;            // per recorded run
+    std::string error;
+};
+
+static double trace_ns_per_event(int iterations) {
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; i++) {
+        AVIO_TRACE_SPAN("overhead");
+        AVIO_TRACE_COUNTER("overhead counter", i);
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations;
+}
+
+static int run_trace_overhead(const std::vector<std::string>& paths, const Options& opts, avio::StreamInfoCache* cache) {
+    avio::Tracer& tracer = avio::Tracer::instance();
+    std::vector<OverheadResult> results;
+    for (const std::string& path : paths) {
+        OverheadResult result;
+        result.file = path;
+        std::vector<double> off, on;
+        for (int run = 0; run < opts.runs && result.error.empty(); run++) {
+            for (int traced = 0; traced < 2; traced++) {
+                tracer.stop();
+                if (traced) {
+                    tracer.clear();
+                    tracer.start();
+                }
+                Result r = run_pipeline(path, opts, cache, opts.input == "mmap");
+                tracer.stop();
+                if (!r.error.empty()) {
+                    result.error = r.error;
+                    break;
+                }
+                (traced ? on : off).push_back(r.samples_per_sec);
+                if (traced)
+                    result.events = tracer.events() + tracer.overwritten();
+            }
+        }
+        result.off_samples_per_sec = median(off);
+        result.on_samples_per_sec = median(on);
+        if (result.off_samples_per_sec > 0)
+            result.overhead_pct = (result.off_samples_per_sec / result.on_samples_per_sec - 1) * 100;
+        results.push_back(result);
+    }
+
+    const int ITERATIONS = 1 << 22;
+    double stopped_ns = trace_ns_per_event(ITERATIONS);
+    tracer.clear();
+    tracer.start();
+    double recording_ns = trace_ns_per_event(ITERATIONS);
+    tracer.stop();
+    tracer.clear();
+
+    std::cout << std::left << std::setw(24) << "trace overhead" << std::right
+              << std::setw(16) << "off samples/s" << std::setw(16) << "on samples/s"
+              << std::setw(12) << "overhead %" << std::setw(10) << "events" << std::endl;
+    bool failed = false;
+    for (const OverheadResult& r : results) {
+        std::string name = r.file.substr(r.file.find_last_of('/') + 1);
+        std::cout << std::left << std::setw(24) << name << std::right;
+        if (!r.error.empty()) {
+            std::cout << "  " << r.error << std::endl;
+            failed = true;
+            continue;
+        }
+        std::cout << std::fixed << std::setprecision(0)
+                  << std::setw(16) << r.off_samples_per_sec << std::setw(16) << r.on_samples_per_sec
+                  << std::setprecision(2) << std::setw(12) << r.overhead_pct
+                  << std::setw(10) << r.events << std::endl;
+    }
+    std::cout << std::setprecision(2) << "span + counter: " << stopped_ns << " ns stopped, " << recording_ns << " ns recording"
+#ifdef AVIO_NO_TRACE
+              << " (built with AVIO_NO_TRACE)"
+#endif
+              << std::endl;
+
+    if (!opts.json.empty()) {
+        std::ofstream file;
+        if (opts.json != "-") file.open(opts.json);
+        std::ostream& out = opts.json == "-" ? std::cout : file;
+        out << "{\n  \"label\": " << json_string(opts.label) << ", \"runs\": " << opts.runs
+#ifdef AVIO_NO_TRACE
+            << ", \"compiled\": false"
+#else
+            << ", \"compiled\": true"
+#endif
+            << ",\n  \"event_ns\": { \"stopped\": " << stopped_ns << ", \"recording\": " << recording_ns << " },\n"
+            << "  \"overhead\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const OverheadResult& r = results[i];
+            out << "    { \"file\": " << json_string(r.file)
+                << ", \"off_samples_per_sec\": " << r.off_samples_per_sec
+                << ", \"on_samples_per_sec\": " << r.on_samples_per_sec
+                << ", \"overhead_pct\": " << r.overhead_pct
+                << ", \"events\": " << r.events
+                << ", \"error\": " << json_string(r.error) << " }"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    return failed ? 1 : 0;
+}
+
+// MS or MS,KB
+static avio::QueueLimits parse_limits(const std::string& arg) {
+    avio::QueueLimits limits;
+    size_t comma = arg.find(',');
+    limits.max_ms = std::stoi(arg.substr(0, comma));
+    if (comma != std::string::npos)
+        limits.max_bytes = (size_t)std::stoi(arg.substr(comma + 1)) * 1024;
+    return limits;
+}
+
+static int parse_options(int argc, char* argv[], Options& opts) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--seconds" && has_value) opts.seconds = std::stoi(argv[++i]);
+        else if (arg == "--dir" && has_value) opts.dir = argv[++i];
+        else if (arg == "--json" && has_value) opts.json = argv[++i];
+        else if (arg == "--label" && has_value) opts.label = argv[++i];
+        else if (arg == "--rate" && has_value) opts.rate = std::stoi(argv[++i]);
+        else if (arg == "--channels" && has_value) opts.channels = std::stoi(argv[++i]);
+        else if (arg == "--no-kernels") opts.kernels = false;
+        else if (arg == "--period" && has_value) opts.period_ms = std::stoi(argv[++i]);
+        else if (arg == "--no-coalesce") opts.coalesce = false;
+        else if (arg == "--packet-queue" && has_value) opts.packet_queue = parse_limits(argv[++i]);
+        else if (arg == "--frame-queue" && has_value) opts.frame_queue = parse_limits(argv[++i]);
+        else if (arg == "--playlist") opts.playlist = true;
+        else if (arg == "--prefetch" && has_value) opts.prefetch_ms = std::stoi(argv[++i]);
+        else if (arg == "--no-prefetch") opts.prefetch = false;
+        else if (arg == "--fast-open") opts.fast_open = true;
+        else if (arg == "--cache" && has_value) opts.cache_dir = argv[++i];
+        else if (arg == "--startup") opts.startup = true;
+        else if (arg == "--input" && has_value) opts.input = argv[++i];
+        else if (arg == "--seek") opts.seek = true;
+        else if (arg == "--seeks" && has_value) opts.seeks = (std::max)(1, std::stoi(argv[++i]));
+        else if (arg == "--mix" && has_value) {
+            std::stringstream list(argv[++i]);
+            std::string count;
+            while (std::getline(list, count, ','))
+                opts.mix.push_back((std::max)(1, std::stoi(count)));
+        }
+        else if (arg == "--pipelines" && has_value) {
+            std::stringstream list(argv[++i]);
+            std::string count;
+            while (std::getline(list, count, ','))
+                opts.pipelines.push_back((std::max)(1, std::stoi(count)));
+        }
+        else if (arg == "--clips" && has_value) opts.clips_mb = (std::max)(1, std::stoi(argv[++i]));
+        else if (arg == "--trace" && has_value) opts.trace = argv[++i];
+        else if (arg == "--trace-overhead") opts.trace_overhead = true;
+        else if (arg == "--workers" && has_value) opts.workers = std::stoi(argv[++i]);
+        else if (arg == "--analyze") opts.analyze = true;
+        else if (arg == "--segment" && has_value) opts.segment_ms = (std::max)(400, std::stoi(argv[++i]));
+        else if (arg == "--runs" && has_value) opts.runs = (std::max)(1, std::stoi(argv[++i]));
+        else if (arg == "--fixed-queues" && has_value) {
+            opts.packet_queue = opts.frame_queue = avio::QueueLimits();
+            opts.packet_queue.max_items = opts.frame_queue.max_items = std::stoi(argv[++i]);
+        }
+        else if (!arg.compare(0, 2, "--")) {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return -1;
+        }
+        else opts.files.push_back(arg);
+    }
+    if (opts.input != "file" && opts.input != "mmap" && opts.input != "both") {
+        std::cerr << "Unknown input " << opts.input << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    if (parse_options(argc, argv, opts) < 0) {
+        std::cerr << "Usage: bench_pipeline [--seconds N] [--dir PATH] [--json PATH] [--label TEXT]"
+                  << " [--rate N] [--channels N] [--no-kernels]"
+                  << " [--period MS] [--no-coalesce] [--packet-queue MS[,KB]] [--frame-queue MS[,KB]]"
+                  << " [--fixed-queues N] [--playlist] [--prefetch MS] [--no-prefetch]"
+                  << " [--fast-open] [--cache DIR] [--startup] [--runs N] [--seek] [--seeks N] [--input file|mmap|both]"
+                  << " [--mix N[,N...]] [--workers N] [--analyze] [--segment MS] [--pipelines N[,N...]] [--clips MB]"
+                  << " [--trace PATH] [--trace-overhead] [files...]" << std::endl;
+        return -1;
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+    TraceSession trace(opts.trace);
+
+    std::unique_ptr<avio::StreamInfoCache> cache;
+    if (!opts.cache_dir.empty()) {
+        mkdir(opts.cache_dir.c_str(), 0755);
+        cache.reset(new avio::StreamInfoCache(opts.cache_dir));
+    }
+
+    if (opts.startup || opts.seek) {
+        std::vector<std::string> paths = opts.files;
+        mkdir(opts.dir.c_str(), 0755);
+        if (paths.empty()) {
+            for (const MediaSpec& spec : MEDIA) {
+                for (int rate : RATES) {
+                    for (int channels : CHANNELS) {
+                        std::string error;
+                        std::string path = generate(spec, rate, channels, opts, error);
+                        if (path.empty())
+                            std::cout << spec.name << "_" << rate << "_" << channels << " skipped: " << error << std::endl;
+                        else
+                            paths.push_back(path);
+                    }
+                }
+            }
+        }
+        if (!cache) {
+            std::string dir = opts.dir + "/streaminfo";
+            mkdir(dir.c_str(), 0755);
+            cache.reset(new avio::StreamInfoCache(dir));
+        }
+        if (opts.seek) {
+            std::vector<SeekResult> results;
+            for (const std::string& path : paths)
+                results.push_back(run_seek(path, opts, *cache));
+            return report_seek(results, opts);
+        }
+        std::vector<StartupResult> results;
+        for (const std::string& path : paths)
+            results.push_back(run_startup(path, opts, *cache));
+        return report_startup(results, opts);
+    }
+
+    if (!opts.mix.empty() || opts.analyze || !opts.pipelines.empty() || opts.clips_mb || opts.trace_overhead) {
+        std::vector<std::string> paths = opts.files;
+        if (paths.empty()) {
+            mkdir(opts.dir.c_str(), 0755);
+            for (const MediaSpec& spec : MEDIA) {
+                for (int rate : RATES) {
+                    for (int channels : CHANNELS) {
+                        std::string error;
+                        std::string path = generate(spec, rate, channels, opts, error);
+                        if (path.empty())
+                            std::cout << spec.name << "_" << rate << "_" << channels << " skipped: " << error << std::endl;
+                        else
+                            paths.push_back(path);
+                    }
+                }
+            }
+        }
+        if (paths.empty())
+            return 1;
+        if (opts.analyze)
+            return run_analyze(paths, opts, cache.get());
+        if (opts.clips_mb)
+            return run_clips(paths, opts, cache.get());
+        if (opts.trace_overhead)
+            return run_trace_overhead(paths, opts, cache.get());
+        if (!opts.pipelines.empty()) {
+            std::vector<SchedResult> results;
+            for (int count : opts.pipelines) {
+                for (int mode = 0; mode < 2; mode++)
+                    results.push_back(run_sched(paths, count, mode, opts, cache.get()));
+            }
+            return report_sched(results, opts);
+        }
+        std::vector<MixResult> results;
+        for (int sources : opts.mix)
+            results.push_back(run_mix(paths, sources, opts, cache.get()));
+        return report_mix(results, opts);
+    }
+
+    if (opts.playlist) {
+        std::vector<std::string> paths = opts.files;
+        std::vector<int64_t> expected(paths.size(), 0);
+        if (paths.empty()) {
+            mkdir(opts.dir.c_str(), 0755);
+            for (const MediaSpec& spec : MEDIA) {
+                for (int rate : RATES) {
+                    for (int channels : CHANNELS) {
+                        std::string error;
+                        std::string path = generate(spec, rate, channels, opts, error);
+                        if (path.empty()) {
+                            std::cout << spec.name << "_" << rate << "_" << channels << " skipped: " << error << std::endl;
+                            continue;
+                        }
+                        paths.push_back(path);
+                        expected.push_back((int64_t)opts.seconds * rate);
+                    }
+                }
+            }
+        }
+        return run_playlist(paths, expected, opts, cache.get());
+    }
+
+    std::vector<Result> results;
+    std::vector<bool> inputs;
+    if (opts.input != "mmap") inputs.push_back(false);
+    if (opts.input != "file") inputs.push_back(true);
+
+    if (opts.files.empty()) {
+        mkdir(opts.dir.c_str(), 0755);
+        for (const MediaSpec& spec : MEDIA) {
+            for (int rate : RATES) {
+                for (int channels : CHANNELS) {
+                    std::string error;
+                    std::string path = generate(spec, rate, channels, opts, error);
+                    if (path.empty()) {
+                        Result skipped;
+                        std::stringstream name;
+                        name << spec.name << "_" << rate << "_" << channels;
+                        skipped.file = name.str();
+                        skipped.codec = spec.name;
+                        skipped.sample_rate = rate;
+                        skipped.channels = channels;
+                        skipped.error = "skipped: " + error;
+                        results.push_back(skipped);
+                        print_result(results.back());
+                        continue;
+                    }
+                    for (bool mmap : inputs) {
+                        results.push_back(run_pipeline(path, opts, cache.get(), mmap));
+                        print_result(results.back());
+                    }
+                }
+            }
+        }
+    }
+    else {
+        for (const std::string& file : opts.files) {
+            for (bool mmap : inputs) {
+                results.push_back(run_pipeline(file, opts, cache.get(), mmap));
+                print_result(results.back());
+            }
+        }
+    }
+
+    if (opts.json == "-") {
+        write_json(std::cout, results, opts);
+    }
+    else if (!opts.json.empty()) {
+        std::ofstream out(opts.json);
+        write_json(out, results, opts);
+    }
+
+    for (const Result& r : results) {
+        if (!r.error.empty() && r.error.compare(0, 8, "skipped:"))
+            return 1;
+    }
+    return 0;
+}
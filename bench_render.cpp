@@ -0,0 +1,1149 @@
+// bench_render.cpp
+//
+// Headless measurements of the render side against simulated sinks, runs on Linux.
+//
+//   bench_render ring [chunks]
+//   bench_render copy [seconds]
+//   bench_render alloc [seconds]
+//   bench_render sched [seconds] [buffer ms] [jitter us]
+//   bench_render latency [seconds] [jitter us]
+//   bench_render kernels [seconds]
+//   bench_render coalesce [seconds]
+//   bench_render mix [seconds]
+//   bench_render drift [seconds] [ppm]
+//   bench_render rt [seconds]
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+#include "Queue.hpp"
+#include "AudioSink.hpp"
+#include "PcmRing.hpp"
+#include "SwrRender.hpp"
+#include "CoalescingSink.hpp"
+#include "SimulatedSink.hpp"
+#include "RenderScheduler.hpp"
+#include "SampleConvert.hpp"
+#include "PlaybackClock.hpp"
+#include "Realtime.hpp"
+
+// glibc lets the executable interpose the allocator and pthread_mutex_lock,
+// every call is forwarded to avio::RealtimeAudit, which counts the ones made
+// inside a RealtimeScope (bench_rt). Sanitizers interpose the same functions,
+// their builds go without the audit.
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define REALTIME_HOOKS 1
+
+#include <cerrno>
+#include <dlfcn.h>
+#include <pthread.h>
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size) noexcept {
+    avio::RealtimeAudit::allocated();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    avio::RealtimeAudit::allocated();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    avio::RealtimeAudit::allocated();
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+    avio::RealtimeAudit::allocated();
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    avio::RealtimeAudit::allocated();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept {
+    avio::RealtimeAudit::allocated();
+    void* memory = __libc_memalign(alignment, size);
+    if (!memory)
+        return ENOMEM;
+    *ptr = memory;
+    return 0;
+}
+
+void free(void* ptr) noexcept {
+    if (ptr)
+        avio::RealtimeAudit::freed();
+    __libc_free(ptr);
+}
+
+// the real functions are looked up at the first lock, long before any scope
+static int (*real_mutex_lock)(pthread_mutex_t*) = nullptr;
+static int (*real_mutex_trylock)(pthread_mutex_t*) = nullptr;
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) noexcept {
+    if (!real_mutex_lock)
+        real_mutex_lock = (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_lock");
+    avio::RealtimeAudit::locked();
+    return real_mutex_lock(mutex);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* mutex) noexcept {
+    if (!real_mutex_trylock)
+        real_mutex_trylock = (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+    avio::RealtimeAudit::locked();
+    return real_mutex_trylock(mutex);
+}
+
+}
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+static const int CHANNELS = 2;
+static const int SAMPLE_RATE = 48000;
+static const int CHUNK_FRAMES = 1024;
+
+static double elapsed_ns(Clock::time_point start) {
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static double thread_cpu_ms() {
+#ifdef _WIN32
+    return 0;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static uint64_t check_samples(const float* samples, int count, uint64_t& expected) {
+    uint64_t errors = 0;
+    for (int i = 0; i < count; i++) {
+        if (samples[i] != (float)(expected++ & 0xFFFFFF)) errors++;
+    }
+    return errors;
+}
+
+static void fill_chunk(std::vector<float>& chunk, uint64_t& counter) {
+    for (float& sample : chunk)
+        sample = (float)(counter++ & 0xFFFFFF);
+}
+
+// The producer stamps every sample with a running counter, the consumer checks
+// it on the way out of the null sink, so the benchmark doubles as a stress test.
+
+static int bench_ring(int chunks) {
+    avio::NullSink sink(SAMPLE_RATE, CHANNELS, sizeof(float), CHUNK_FRAMES * 4);
+    avio::PcmRing ring(sink.blockAlign(), SAMPLE_RATE, 100);
+    uint64_t errors = 0;
+
+    auto start = Clock::now();
+
+    std::thread producer([&] {
+        std::vector<float> chunk(CHUNK_FRAMES * CHANNELS);
+        uint64_t counter = 0;
+        for (int i = 0; i < chunks; i++) {
+            fill_chunk(chunk, counter);
+            const uint8_t* src = (const uint8_t*)chunk.data();
+            int offset = 0;
+            while (offset < CHUNK_FRAMES) {
+                offset += ring.push(src + offset * ring.blockAlign(), CHUNK_FRAMES - offset);
+                if (offset < CHUNK_FRAMES) std::this_thread::yield();
+            }
+        }
+        ring.close();
+    });
+
+    std::thread consumer([&] {
+        uint64_t expected = 0;
+        while (!ring.finished()) {
+            int count = 0;
+            const float* src = (const float*)ring.readRegion(&count);
+            count = std::min(count, sink.available());
+            if (!count) {
+                std::this_thread::yield();
+                continue;
+            }
+            errors += check_samples(src, count * CHANNELS, expected);
+            memcpy(sink.getBuffer(count), src, count * sink.blockAlign());
+            sink.releaseBuffer(count);
+            ring.commitRead(count);
+        }
+    });
+
+    producer.join();
+    consumer.join();
+    double ns = elapsed_ns(start);
+
+    std::cout << "PcmRing      " << std::setw(10) << std::fixed << std::setprecision(1)
+              << ns / chunks << " ns/op  frames: " << sink.frames_rendered
+              << "  errors: " << errors << std::endl;
+
+    return errors || sink.frames_rendered != (uint64_t)chunks * CHUNK_FRAMES;
+}
+
+// Same traffic through the mutex based avio::Queue used between the stages,
+// each element is a heap buffer the way an avio::Frame copy would be.
+
+static int bench_queue(int chunks) {
+    avio::NullSink sink(SAMPLE_RATE, CHANNELS, sizeof(float), CHUNK_FRAMES * 4);
+    avio::Queue<std::vector<float>> queue(128);
+    uint64_t errors = 0;
+
+    auto start = Clock::now();
+
+    std::thread producer([&] {
+        std::vector<float> chunk(CHUNK_FRAMES * CHANNELS);
+        uint64_t counter = 0;
+        for (int i = 0; i < chunks; i++) {
+            fill_chunk(chunk, counter);
+            queue.push(chunk);
+        }
+        queue.push(std::vector<float>());
+    });
+
+    std::thread consumer([&] {
+        uint64_t expected = 0;
+        while (true) {
+            std::vector<float> chunk = queue.pop();
+            if (chunk.empty()) break;
+            int count = (int)chunk.size() / CHANNELS;
+            errors += check_samples(chunk.data(), count * CHANNELS, expected);
+            memcpy(sink.getBuffer(count), chunk.data(), count * sink.blockAlign());
+            sink.releaseBuffer(count);
+        }
+    });
+
+    producer.join();
+    consumer.join();
+    double ns = elapsed_ns(start);
+
+    std::cout << "avio::Queue  " << std::setw(10) << std::fixed << std::setprecision(1)
+              << ns / chunks << " ns/op  frames: " << sink.frames_rendered
+              << "  errors: " << errors << std::endl;
+
+    return errors || sink.frames_rendered != (uint64_t)chunks * CHUNK_FRAMES;
+}
+
+// Decoder-like fltp 44.1 kHz frames rendered into a flt 48 kHz null sink, once
+// through the scratch buffer + memcpy path and once straight into the sink.
+
+static SwrContext* make_swr(int in_rate, AVSampleFormat in_fmt, int out_rate, AVSampleFormat out_fmt) {
+    AVChannelLayout layout;
+    av_channel_layout_default(&layout, CHANNELS);
+    return avio::SwrRender::create(&layout, in_fmt, in_rate, CHANNELS, out_fmt, out_rate);
+}
+
+static int bench_copy(avio::SwrRender::Mode mode, int seconds) {
+    const int in_rate = 44100;
+    SwrContext* swr = make_swr(in_rate, AV_SAMPLE_FMT_FLTP, SAMPLE_RATE, AV_SAMPLE_FMT_FLT);
+    if (!swr) {
+        std::cerr << "Failed to initialize SwrContext" << std::endl;
+        return -1;
+    }
+
+    avio::NullSink sink(SAMPLE_RATE, CHANNELS, sizeof(float), SAMPLE_RATE / 10);
+    avio::SwrRender render(swr, &sink, AV_SAMPLE_FMT_FLT, in_rate, mode);
+
+    std::vector<float> planes[CHANNELS];
+    const uint8_t* in[CHANNELS];
+    for (int ch = 0; ch < CHANNELS; ch++) {
+        planes[ch].resize(CHUNK_FRAMES);
+        for (int i = 0; i < CHUNK_FRAMES; i++)
+            planes[ch][i] = (float)((i * (ch + 1)) % 200) / 100.0f - 1.0f;
+        in[ch] = (const uint8_t*)planes[ch].data();
+    }
+
+    int chunks = (int)((int64_t)seconds * in_rate / CHUNK_FRAMES);
+    auto start = Clock::now();
+    for (int i = 0; i < chunks; i++)
+        render.render(in, CHUNK_FRAMES, [] {});
+    render.render(nullptr, 0, [] {});
+    double ns = elapsed_ns(start);
+
+    double audio_seconds = (double)render.stats.frames_rendered / SAMPLE_RATE;
+    std::cout << (mode == avio::SwrRender::Copy ? "copy       " : "zero copy  ")
+              << std::fixed << std::setprecision(1)
+              << std::setw(10) << ns / chunks << " ns/frame  "
+              << std::setw(12) << render.stats.bytes_copied / audio_seconds << " bytes copied/s  "
+              << std::setw(12) << render.stats.bytes_rendered / audio_seconds << " bytes rendered/s"
+              << std::endl;
+
+    return 0;
+}
+
+// Copy mode through the pooled scratch buffer with AAC sized frames and the
+// occasional short one. After the first second the pool must not allocate again.
+
+static int bench_alloc(int seconds) {
+    const int in_rate = 44100;
+    SwrContext* swr = make_swr(in_rate, AV_SAMPLE_FMT_FLTP, SAMPLE_RATE, AV_SAMPLE_FMT_FLT);
+    if (!swr) {
+        std::cerr << "Failed to initialize SwrContext" << std::endl;
+        return -1;
+    }
+
+    avio::NullSink sink(SAMPLE_RATE, CHANNELS, sizeof(float), SAMPLE_RATE / 10);
+    avio::SwrRender render(swr, &sink, AV_SAMPLE_FMT_FLT, in_rate, avio::SwrRender::Copy);
+
+    std::vector<float> planes[CHANNELS];
+    const uint8_t* in[CHANNELS];
+    for (int ch = 0; ch < CHANNELS; ch++) {
+        planes[ch].assign(CHUNK_FRAMES, 0.25f);
+        in[ch] = (const uint8_t*)planes[ch].data();
+    }
+
+    int64_t samples = 0;
+    uint64_t warm = 0;
+    bool warmed_up = false;
+    for (int i = 0; samples < (int64_t)seconds * in_rate; i++) {
+        int nb_samples = (i % 7 == 6) ? CHUNK_FRAMES / 2 : CHUNK_FRAMES;
+        render.render(in, nb_samples, [] {});
+        samples += nb_samples;
+        if (!warmed_up && samples >= in_rate) {
+            warm = render.pool.allocations;
+            warmed_up = true;
+        }
+    }
+
+    uint64_t steady = render.pool.allocations - warm;
+    std::cout << "pool allocations: warm up " << warm << ", steady state " << steady
+              << ", capacity " << render.pool.capacity(AV_SAMPLE_FMT_FLT, CHANNELS) << " frames"
+              << std::endl;
+
+    if (steady) {
+        std::cout << "FAILED: steady state playback allocated" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Real time playback into a SimulatedSink with 10 ms periods, once with the
+// Sleep(5) polling loop and once woken by the sink at each period.
+
+static int bench_sched(avio::RenderScheduler::Mode mode, int seconds, int buffer_ms, int jitter_us) {
+    const int period_frames = SAMPLE_RATE / 100;
+    avio::SimulatedSink sink(SAMPLE_RATE, CHANNELS, sizeof(float),
+                             SAMPLE_RATE * buffer_ms / 1000, period_frames, jitter_us);
+    avio::PcmRing ring(sink.blockAlign(), SAMPLE_RATE, 200);
+    avio::RenderScheduler scheduler(&sink, &ring, mode);
+    std::atomic<bool> running{ true };
+
+    std::thread producer([&] {
+        std::vector<float> chunk(CHUNK_FRAMES * CHANNELS, 0.0f);
+        const uint8_t* src = (const uint8_t*)chunk.data();
+        while (running) {
+            int offset = 0;
+            while (running && offset < CHUNK_FRAMES) {
+                offset += ring.push(src + offset * ring.blockAlign(), CHUNK_FRAMES - offset);
+                if (offset < CHUNK_FRAMES)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        ring.close();
+    });
+
+    // let the producer get ahead before the device clock starts
+    while (ring.readable() < ring.size() / 2)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    double cpu_ms = 0;
+    std::thread render([&] {
+        double cpu_start = thread_cpu_ms();
+        sink.start();
+        auto end = Clock::now() + std::chrono::seconds(seconds);
+        while (Clock::now() < end && scheduler.step()) {}
+        cpu_ms = thread_cpu_ms() - cpu_start;
+    });
+
+    render.join();
+    running = false;
+    producer.join();
+
+    std::cout << (mode == avio::RenderScheduler::Event ? "event     " : "polling   ")
+              << std::fixed << std::setprecision(1)
+              << std::setw(8) << (double)scheduler.wakeups / seconds << " wakeups/s  "
+              << std::setw(8) << cpu_ms / seconds << " ms cpu/s  "
+              << std::setw(6) << sink.underruns << " underruns" << std::endl;
+
+    return 0;
+}
+
+// Time to first sample and underruns for the old 1 s silence prefill against
+// the latency controller at several targets. The producer has a 5 ms start up
+// cost like opening a decoder and then stalls at random for up to 15 ms.
+
+static int bench_latency(int latency_ms, bool legacy, int seconds, int jitter_us) {
+    const int period_frames = SAMPLE_RATE / 100;
+    int buffer_frames = legacy ? SAMPLE_RATE : SAMPLE_RATE * latency_ms * 2 / 1000;
+    avio::SimulatedSink sink(SAMPLE_RATE, CHANNELS, sizeof(float), buffer_frames, period_frames, jitter_us);
+    avio::PcmRing ring(sink.blockAlign(), SAMPLE_RATE, 200);
+    avio::RenderScheduler scheduler(&sink, &ring,
+        legacy ? avio::RenderScheduler::Polling : avio::RenderScheduler::Event, latency_ms);
+    scheduler.prefill_silence = legacy;
+    std::atomic<bool> running{ true };
+
+    std::thread producer([&] {
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> stall(0, 15);
+        std::vector<float> chunk(CHUNK_FRAMES * CHANNELS, 0.0f);
+        const uint8_t* src = (const uint8_t*)chunk.data();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        for (int i = 0; running; i++) {
+            int offset = 0;
+            while (running && offset < CHUNK_FRAMES) {
+                offset += ring.push(src + offset * ring.blockAlign(), CHUNK_FRAMES - offset);
+                if (offset < CHUNK_FRAMES)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            if (i % 8 == 7)
+                std::this_thread::sleep_for(std::chrono::milliseconds(stall(rng)));
+        }
+        ring.close();
+    });
+
+    auto end = Clock::now() + std::chrono::seconds(seconds);
+    while (Clock::now() < end && scheduler.step()) {}
+    running = false;
+    producer.join();
+
+    std::cout << (legacy ? "silence 1000 ms " : "target ")
+              << (legacy ? "" : (latency_ms < 100 ? "  " : " ")) << (legacy ? "" : std::to_string(latency_ms) + " ms ")
+              << std::fixed << std::setprecision(1)
+              << std::setw(9) << scheduler.timeToFirstSample() << " ms to first sample  "
+              << std::setw(5) << sink.underruns << " underruns  fill "
+              << std::setw(6) << 1000.0 * (legacy ? buffer_frames : scheduler.latency.target()) / SAMPLE_RATE
+              << " ms" << std::endl;
+
+    return 0;
+}
+
+// Float to s16 on inputs swr is not compared on: NaN, infinities, values
+// past full scale and the edges of the range. The vector loop and the scalar
+// tail have to agree with kernel::toS16 on every sample.
+
+static int check_s16_edges(AVSampleFormat in_fmt, int channels) {
+    const float EDGES[] = { NAN, -NAN, INFINITY, -INFINITY, 2.0f, -2.0f, 1.0f, -1.0f,
+                            32767.0f / 32768, 32767.5f / 32768, -32768.5f / 32768, 0.5f / 32768,
+                            1.5f / 32768, -0.5f / 32768, 0.0f, -0.0f, 1e30f, -1e30f };
+    const int FRAMES = 37;      // a few vectors and a tail
+    const int count = (int)(sizeof(EDGES) / sizeof(EDGES[0]));
+    AVChannelLayout layout;
+    av_channel_layout_default(&layout, channels);
+    avio::ConvertKernel kernel = avio::findConvertKernel(&layout, in_fmt, SAMPLE_RATE, channels, AV_SAMPLE_FMT_S16, SAMPLE_RATE);
+    av_channel_layout_uninit(&layout);
+
+    std::cout << std::left << std::setw(5) << av_get_sample_fmt_name(in_fmt) << " -> s16 " << std::right
+              << std::setw(2) << channels << " ch  nan/inf/overshoot  ";
+    if (!kernel) {
+        std::cout << "no kernel" << std::endl;
+        return 1;
+    }
+
+    // sample n of the interleaved stream is EDGES[n % count]
+    bool planar = av_sample_fmt_is_planar(in_fmt);
+    std::vector<std::vector<float>> planes(planar ? channels : 1, std::vector<float>((size_t)FRAMES * (planar ? 1 : channels)));
+    std::vector<int16_t> expected((size_t)FRAMES * channels);
+    for (int n = 0; n < FRAMES * channels; n++) {
+        float sample = EDGES[n % count];
+        if (planar)
+            planes[n % channels][n / channels] = sample;
+        else
+            planes[0][n] = sample;
+        expected[n] = avio::kernel::toS16(sample);
+    }
+    std::vector<const uint8_t*> src;
+    for (std::vector<float>& plane : planes)
+        src.push_back((const uint8_t*)plane.data());
+
+    std::vector<int16_t> out(expected.size());
+    kernel((uint8_t*)out.data(), src.data(), 0, FRAMES, channels);
+    int mismatches = 0;
+    for (size_t n = 0; n < out.size(); n++)
+        mismatches += out[n] != expected[n];
+    std::cout << (mismatches ? "MISMATCH" : "bit exact") << std::endl;
+    return mismatches ? 1 : 0;
+}
+
+// Format kernels against swr at the same rate and default layout. The output
+// has to be bit exact, otherwise the kernel is not a drop in for swr.
+
+static int bench_kernel(AVSampleFormat in_fmt, AVSampleFormat out_fmt, int channels, int seconds) {
+    const int CHUNKS = 16;
+    AVChannelLayout layout;
+    av_channel_layout_default(&layout, channels);
+    avio::ConvertKernel kernel = avio::findConvertKernel(&layout, in_fmt, SAMPLE_RATE, channels, out_fmt, SAMPLE_RATE);
+    SwrContext* swr = avio::SwrRender::create(&layout, in_fmt, SAMPLE_RATE, channels, out_fmt, SAMPLE_RATE);
+    av_channel_layout_uninit(&layout);
+
+    std::cout << std::left << std::setw(5) << av_get_sample_fmt_name(in_fmt) << " -> "
+              << std::setw(4) << av_get_sample_fmt_name(out_fmt) << std::right << std::setw(2) << channels << " ch  ";
+    if (!kernel || !swr) {
+        std::cout << (kernel ? "swr init failed" : "no kernel") << std::endl;
+        if (swr) swr_free(&swr);
+        return 1;
+    }
+
+    // random input over the full range, floats overshoot to exercise clipping
+    bool planar = av_sample_fmt_is_planar(in_fmt);
+    int planes = planar ? channels : 1;
+    int plane_size = CHUNK_FRAMES * av_get_bytes_per_sample(in_fmt) * (planar ? 1 : channels);
+    std::vector<std::vector<uint8_t>> data((size_t)CHUNKS * planes, std::vector<uint8_t>(plane_size));
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> real(-1.25f, 1.25f);
+    for (std::vector<uint8_t>& plane : data) {
+        if (av_get_packed_sample_fmt(in_fmt) == AV_SAMPLE_FMT_FLT) {
+            for (size_t i = 0; i < plane.size(); i += sizeof(float)) {
+                float sample = real(rng);
+                memcpy(&plane[i], &sample, sizeof(float));
+            }
+        }
+        else {
+            for (uint8_t& byte : plane)
+                byte = (uint8_t)rng();
+        }
+    }
+    std::vector<const uint8_t*> in((size_t)CHUNKS * planes);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = data[i].data();
+
+    int out_size = CHUNK_FRAMES * channels * av_get_bytes_per_sample(out_fmt);
+    std::vector<uint8_t> out_kernel(out_size);
+    std::vector<uint8_t> out_swr(out_size);
+    uint8_t* out[1] = { out_swr.data() };
+
+    int mismatches = 0;
+    for (int chunk = 0; chunk < CHUNKS; chunk++) {
+        const uint8_t** src = &in[(size_t)chunk * planes];
+        kernel(out_kernel.data(), src, 0, CHUNK_FRAMES, channels);
+        int converted = swr_convert(swr, out, CHUNK_FRAMES, src, CHUNK_FRAMES);
+        if (converted != CHUNK_FRAMES || memcmp(out_kernel.data(), out_swr.data(), out_size))
+            mismatches++;
+    }
+
+    int64_t frames = (int64_t)seconds * SAMPLE_RATE;
+    int iterations = (int)(frames / CHUNK_FRAMES);
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+        kernel(out_kernel.data(), &in[(size_t)(i % CHUNKS) * planes], 0, CHUNK_FRAMES, channels);
+    double kernel_ns = elapsed_ns(start);
+
+    start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+        swr_convert(swr, out, CHUNK_FRAMES, &in[(size_t)(i % CHUNKS) * planes], CHUNK_FRAMES);
+    double swr_ns = elapsed_ns(start);
+    swr_free(&swr);
+
+    double total = (double)iterations * CHUNK_FRAMES;
+    std::cout << std::fixed << std::setprecision(2)
+              << "kernel " << std::setw(6) << kernel_ns / total << " ns/frame  "
+              << "swr " << std::setw(6) << swr_ns / total << " ns/frame  "
+              << std::setprecision(1) << std::setw(5) << swr_ns / kernel_ns << "x  "
+              << (mismatches ? "MISMATCH" : "bit exact") << std::endl;
+
+    return mismatches ? 1 : 0;
+}
+
+// Null sink that checks the sample counter of everything released to it
+
+class CheckedSink : public avio::NullSink {
+public:
+    using NullSink::NullSink;
+
+    uint64_t expected = 0;
+    uint64_t errors = 0;
+
+    uint8_t* getBuffer(int frames) override {
+        region = NullSink::getBuffer(frames);
+        return region;
+    }
+
+    void releaseBuffer(int frames) override {
+        errors += check_samples((const float*)region, frames * CHANNELS, expected);
+        NullSink::releaseBuffer(frames);
+    }
+
+private:
+    uint8_t* region = nullptr;
+};
+
+// Decoded frames of one size written to a null sink as they come, or packed
+// into 10 ms device periods by a CoalescingSink. Opus frames run from 120 to
+// 2880 samples, 1024 is AAC.
+
+static int bench_coalesce(int frame_size, bool coalesce, int seconds) {
+    CheckedSink sink(SAMPLE_RATE, CHANNELS, sizeof(float), SAMPLE_RATE / 10);
+    avio::CoalescingSink coalesced(&sink, SAMPLE_RATE / 100);
+    avio::SwrRender render(nullptr, coalesce ? (avio::AudioSink*)&coalesced : &sink, AV_SAMPLE_FMT_FLT, SAMPLE_RATE);
+
+    std::vector<float> chunk((size_t)frame_size * CHANNELS);
+    uint64_t counter = 0;
+    int64_t frames = (int64_t)seconds * SAMPLE_RATE;
+    auto start = Clock::now();
+    for (int64_t written = 0; written < frames; written += frame_size) {
+        fill_chunk(chunk, counter);
+        const uint8_t* in[1] = { (const uint8_t*)chunk.data() };
+        render.render(in, frame_size, [] {});
+    }
+    coalesced.flush();
+    double ns = elapsed_ns(start);
+
+    double audio_seconds = (double)sink.frames_rendered / SAMPLE_RATE;
+    std::cout << std::setw(5) << frame_size << (coalesce ? "  coalesced  " : "  per frame  ")
+              << std::fixed << std::setprecision(1)
+              << std::setw(8) << sink.device_calls / audio_seconds << " device calls/s  "
+              << std::setw(8) << ns / sink.frames_rendered << " ns/frame  errors: " << sink.errors << std::endl;
+
+    return sink.errors || sink.frames_rendered != counter / CHANNELS;
+}
+
+// Mixer inner loop: sources periods summed with a gain each, then clamped into
+// the device buffer. The SIMD kernels have to match the plain loop bit for bit,
+// the loop is what a mixer without them would run.
+
+static void mix_reference(float* out, float* acc, const std::vector<std::vector<float>>& sources,
+                          const std::vector<float>& gains, size_t offset, int count)
+{
+    for (int i = 0; i < count; i++)
+        acc[i] = 0.0f;
+    for (size_t s = 0; s < sources.size(); s++) {
+        const float* src = sources[s].data() + offset;
+        for (int i = 0; i < count; i++)
+            acc[i] += src[i] * gains[s];
+    }
+    for (int i = 0; i < count; i++)
+        out[i] = acc[i] > 1.0f ? 1.0f : (acc[i] < -1.0f ? -1.0f : acc[i]);
+}
+
+static void mix_kernels(float* out, float* acc, const std::vector<std::vector<float>>& sources,
+                        const std::vector<float>& gains, size_t offset, int count)
+{
+    memset(acc, 0, (size_t)count * sizeof(float));
+    for (size_t s = 0; s < sources.size(); s++)
+        avio::kernel::mixAddRun(acc, sources[s].data() + offset, count, gains[s]);
+    avio::kernel::clampRun(out, acc, count);
+}
+
+static int bench_mix(int num_sources, int seconds) {
+    const int CHUNKS = 16;
+    const int count = CHUNK_FRAMES * CHANNELS;
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> real(-1.0f, 1.0f);
+    std::vector<std::vector<float>> sources((size_t)num_sources, std::vector<float>((size_t)CHUNKS * count));
+    std::vector<float> gains((size_t)num_sources);
+    for (int s = 0; s < num_sources; s++) {
+        for (float& sample : sources[s])
+            sample = real(rng);
+        // loud enough for the sum to clip now and then
+        gains[s] = 1.5f / std::sqrt((float)num_sources) * (0.5f + 0.5f * (float)(s + 1) / num_sources);
+    }
+
+    std::vector<float> acc(count), out_kernel(count), out_reference(count);
+    int mismatches = 0;
+    for (int chunk = 0; chunk < CHUNKS; chunk++) {
+        // odd lengths run the scalar tails too
+        int length = chunk % 2 ? count - 2 * chunk - 1 : count;
+        mix_kernels(out_kernel.data(), acc.data(), sources, gains, (size_t)chunk * count, length);
+        mix_reference(out_reference.data(), acc.data(), sources, gains, (size_t)chunk * count, length);
+        if (memcmp(out_kernel.data(), out_reference.data(), (size_t)length * sizeof(float)))
+            mismatches++;
+    }
+
+    int64_t frames = (int64_t)seconds * SAMPLE_RATE;
+    int iterations = (int)(frames / CHUNK_FRAMES);
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+        mix_kernels(out_kernel.data(), acc.data(), sources, gains, (size_t)(i % CHUNKS) * count, count);
+    double kernel_ns = elapsed_ns(start);
+
+    start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+        mix_reference(out_reference.data(), acc.data(), sources, gains, (size_t)(i % CHUNKS) * count, count);
+    double reference_ns = elapsed_ns(start);
+
+    double total = (double)iterations * CHUNK_FRAMES;
+    std::cout << std::setw(3) << num_sources << " sources  " << std::fixed << std::setprecision(2)
+              << "kernels " << std::setw(7) << kernel_ns / total << " ns/frame "
+              << std::setw(5) << kernel_ns / total / num_sources << " per source  "
+              << "loop " << std::setw(7) << reference_ns / total << " ns/frame  "
+              << std::setprecision(1) << std::setw(5) << reference_ns / kernel_ns << "x  "
+              << (mismatches ? "MISMATCH" : "bit exact") << std::endl;
+
+    return mismatches ? 1 : 0;
+}
+
+// A producer on steady_clock, 10 ms of fltp 44.1 kHz per tick resampled into
+// a ring, against a 48 kHz device whose clock runs ppm fast or slow, in
+// simulated time. With a fixed swr ratio the buffered audio drifts until the
+// device starves or the ring overflows; with the DriftController fed from the
+// PlaybackClock it has to stay within a few ms of the target. Between ticks
+// the clock is read at a random instant and checked against the device.
+
+static int bench_drift(double ppm, bool compensate, int seconds) {
+    const int in_rate = 44100;
+    const int in_frames = in_rate / 100;
+    const int period_frames = SAMPLE_RATE / 100;
+    const int device_target = SAMPLE_RATE / 20;
+    const int target = SAMPLE_RATE * 150 / 1000;
+
+    avio::SimulatedSink sink(SAMPLE_RATE, CHANNELS, sizeof(float), SAMPLE_RATE / 10, period_frames, 0, ppm);
+    sink.simulated_time = true;
+    avio::PcmRing ring(sink.blockAlign(), SAMPLE_RATE, 300);
+    avio::RingSink ring_sink(&ring, SAMPLE_RATE, CHANNELS);
+    avio::SwrRender render(nullptr, &ring_sink, AV_SAMPLE_FMT_FLT, 0);
+    render.use_kernels = false;
+    AVChannelLayout layout;
+    av_channel_layout_default(&layout, CHANNELS);
+    if (render.reconfigure(&layout, AV_SAMPLE_FMT_FLTP, in_rate, [] {}) < 0) {
+        std::cerr << "Failed to initialize SwrContext" << std::endl;
+        return -1;
+    }
+    avio::PlaybackClock clock(&sink);
+    avio::DriftController drift(SAMPLE_RATE, target);
+
+    std::vector<float> planes[CHANNELS];
+    const uint8_t* in[CHANNELS];
+    for (int ch = 0; ch < CHANNELS; ch++) {
+        planes[ch].resize(in_frames);
+        for (int i = 0; i < in_frames; i++)
+            planes[ch][i] = 0.5f * (float)std::sin(2 * M_PI * 1000 * i / in_rate);
+        in[ch] = (const uint8_t*)planes[ch].data();
+    }
+
+    uint64_t produced = 0;
+    uint64_t overflows = 0;
+    auto produce = [&] {
+        if (ring.writable() < swr_get_out_samples(render.swr, in_frames)) {
+            overflows++;
+            return 0;
+        }
+        int written = render.render(in, in_frames, [] {});
+        if (written > 0)
+            produced += written;
+        return written;
+    };
+
+    // prefill to the target, then the device clock starts
+    while (produced < (uint64_t)target)
+        produce();
+    sink.start();
+
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> instant(0, 9999);
+    const std::chrono::microseconds tick(10000);
+    int64_t ticks = (int64_t)seconds * 100;
+    int64_t max_position_error = 0;
+    double max_fill_error = 0;
+    double correction_ppm = 0;
+    for (int64_t i = 0; i < ticks; i++) {
+        int space = device_target - sink.padding();
+        if (space > 0)
+            avio::renderFromRing(&sink, &ring, space);
+        clock.update();
+
+        // position between readings against the device's own
+        std::chrono::microseconds at(instant(rng));
+        sink.advance(at);
+        avio::DevicePosition truth;
+        sink.devicePosition(truth);
+        int64_t error = (int64_t)clock.frames(truth.time_us) - (int64_t)truth.played;
+        max_position_error = (std::max)(max_position_error, error < 0 ? -error : error);
+        sink.advance(tick - at);
+
+        int written = produce();
+        int64_t buffered = (int64_t)produced - (int64_t)clock.frames(truth.time_us + (tick - at).count());
+        if (compensate && written > 0) {
+            correction_ppm = drift.update(buffered, written);
+            render.compensate(drift.delta(period_frames), period_frames);
+        }
+        // settled after the first minute
+        if (i >= 6000)
+            max_fill_error = (std::max)(max_fill_error, std::fabs((double)(buffered - target)));
+    }
+    int64_t final_fill = (int64_t)produced - (int64_t)clock.frames(std::chrono::duration_cast<std::chrono::microseconds>(
+        sink.now().time_since_epoch()).count());
+
+    bool failed = compensate && (sink.underruns || overflows || max_fill_error > SAMPLE_RATE * 5 / 1000);
+    std::cout << (compensate ? "compensated " : "fixed ratio ") << std::showpos << std::fixed << std::setprecision(0)
+              << std::setw(5) << ppm << " ppm" << std::noshowpos
+              << "  measured " << std::setprecision(1) << std::setw(7) << clock.ppm() << " ppm"
+              << "  correction " << std::setw(7) << correction_ppm << " ppm"
+              << "  fill drift " << std::setw(8) << 1000.0 * (final_fill - target) / SAMPLE_RATE << " ms"
+              << "  max error " << std::setw(8) << 1000.0 * max_fill_error / SAMPLE_RATE << " ms"
+              << "  position error " << std::setw(3) << max_position_error << " frames"
+              << "  underruns " << std::setw(5) << sink.underruns << "  overflows " << std::setw(5) << overflows
+              << (failed ? "  FAILED" : "") << std::endl;
+
+    return failed ? 1 : 0;
+}
+
+// Steady state playback on the render thread under the RealtimeAudit: after
+// half a second of warm up every allocation, free and mutex lock of the
+// thread is counted for the rest of the run. The ring path (PcmRing ->
+// RenderScheduler -> SimulatedSink, as WinAudio runs it in realtime mode) has
+// to come out at zero while its sink refuses every 97th device buffer, which
+// is reported through a RenderStatus like a failed GetBuffer. The old queue
+// path (avio::Queue of heap buffers -> CoalescingSink) runs as the reference
+// the audit has to catch.
+
+class FlakySink : public avio::AudioSink {
+public:
+    avio::RenderStatus status;
+    uint64_t failures = 0;
+
+    FlakySink(avio::AudioSink* device, int fail_every) : device(device), fail_every(fail_every) { }
+
+    int sampleRate() const override { return device->sampleRate(); }
+    int channels() const override { return device->channels(); }
+    int blockAlign() const override { return device->blockAlign(); }
+    int bufferFrames() const override { return device->bufferFrames(); }
+    int periodFrames() const override { return device->periodFrames(); }
+    bool eventDriven() const override { return device->eventDriven(); }
+    bool waitPeriod(int timeout_ms) override { return device->waitPeriod(timeout_ms); }
+    void start() override { device->start(); }
+    int available() override { return device->available(); }
+
+    uint8_t* getBuffer(int frames) override {
+        if (++calls % fail_every == 0) {
+            failures++;
+            status.fail(avio::RENDER_DEVICE_BUFFER, -1);
+            return nullptr;
+        }
+        return device->getBuffer(frames);
+    }
+
+    void releaseBuffer(int frames) override { device->releaseBuffer(frames); }
+
+private:
+    avio::AudioSink* device;
+    int fail_every;
+    uint64_t calls = 0;
+};
+
+static void* volatile audit_escape = nullptr;
+
+// the hooks are live when an allocation and a lock in a scope are seen
+static bool audit_self_check() {
+    avio::RealtimeAudit::Counts before = avio::RealtimeAudit::counts();
+    {
+        avio::RealtimeScope scope;
+        audit_escape = malloc(64);
+        free(audit_escape);
+        std::mutex mutex;
+        mutex.lock();
+        mutex.unlock();
+    }
+    avio::RealtimeAudit::Counts after = avio::RealtimeAudit::counts();
+    std::cout << "self check   allocations " << after.allocations - before.allocations
+              << "  frees " << after.frees - before.frees << "  locks " << after.locks - before.locks << std::endl;
+    return after.allocations > before.allocations && after.frees > before.frees && after.locks > before.locks;
+}
+
+static avio::RealtimeAudit::Counts audit_delta(const avio::RealtimeAudit::Counts& before) {
+    avio::RealtimeAudit::Counts after = avio::RealtimeAudit::counts();
+    after.allocations -= before.allocations;
+    after.frees -= before.frees;
+    after.locks -= before.locks;
+    return after;
+}
+
+static void print_audit(const char* name, const avio::RealtimeAudit::Counts& counts, uint64_t frames,
+                        uint64_t underruns)
+{
+    std::cout << name << "  allocations " << std::setw(7) << counts.allocations
+              << "  frees " << std::setw(7) << counts.frees << "  locks " << std::setw(7) << counts.locks
+              << "  frames " << std::setw(9) << frames << "  underruns " << std::setw(4) << underruns;
+}
+
+static int bench_rt_ring(int seconds) {
+    const int period_frames = SAMPLE_RATE / 100;
+    avio::SimulatedSink device(SAMPLE_RATE, CHANNELS, sizeof(float), SAMPLE_RATE / 10, period_frames, 500);
+    FlakySink sink(&device, 97);
+    avio::PcmRing ring(sink.blockAlign(), SAMPLE_RATE, 200);
+    avio::RenderScheduler scheduler(&sink, &ring, avio::RenderScheduler::Event, 50);
+    scheduler.status = &sink.status;
+    std::atomic<bool> running{ true };
+
+    std::thread producer([&] {
+        std::vector<float> chunk(CHUNK_FRAMES * CHANNELS, 0.0f);
+        const uint8_t* src = (const uint8_t*)chunk.data();
+        while (running) {
+            int offset = 0;
+            while (running && offset < CHUNK_FRAMES) {
+                offset += ring.push(src + offset * ring.blockAlign(), CHUNK_FRAMES - offset);
+                if (offset < CHUNK_FRAMES)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        ring.close();
+    });
+
+    while (ring.readable() < ring.size() / 2)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    avio::RealtimeAudit::Counts counts;
+    uint64_t failures = 0;
+    uint64_t frames = 0;
+    std::thread render([&] {
+        auto warm = Clock::now() + std::chrono::milliseconds(500);
+        while (Clock::now() < warm && scheduler.step()) {}
+        avio::RealtimeAudit::Counts before = avio::RealtimeAudit::counts();
+        uint64_t failures_before = sink.failures;
+        uint64_t frames_before = scheduler.frames_rendered;
+        {
+            avio::RealtimeScope scope;
+            auto end = Clock::now() + std::chrono::seconds(seconds);
+            while (Clock::now() < end && scheduler.step()) {}
+        }
+        counts = audit_delta(before);
+        failures = sink.failures - failures_before;
+        frames = scheduler.frames_rendered - frames_before;
+    });
+
+    render.join();
+    running = false;
+    producer.join();
+
+    uint64_t reported = sink.status.count(avio::RENDER_DEVICE_BUFFER);
+    bool failed = counts.allocations || counts.frees || counts.locks || !failures || reported != sink.failures;
+    print_audit("ring       ", counts, frames, device.underruns);
+    std::cout << "  status " << avio::RenderStatus::message(sink.status.last()) << " x " << reported
+              << (failed ? "  FAILED" : "") << std::endl;
+    return failed ? 1 : 0;
+}
+
+static int bench_rt_queue(int seconds) {
+    const int period_frames = SAMPLE_RATE / 100;
+    avio::SimulatedSink device(SAMPLE_RATE, CHANNELS, sizeof(float), SAMPLE_RATE / 10, period_frames, 500);
+    avio::CoalescingSink coalesced(&device, period_frames);
+    avio::Queue<std::vector<float>> queue(16);
+    std::atomic<bool> running{ true };
+
+    std::thread producer([&] {
+        std::vector<float> chunk(CHUNK_FRAMES * CHANNELS, 0.0f);
+        while (running)
+            queue.push(chunk);
+        queue.push(std::vector<float>());
+    });
+
+    avio::RealtimeAudit::Counts counts;
+    uint64_t frames = 0;
+    std::thread render([&] {
+        // WinAudio::run on its input queue
+        auto play = [&](Clock::time_point end) {
+            while (Clock::now() < end) {
+                std::vector<float> chunk = queue.pop();
+                int offset = 0;
+                int remaining = (int)chunk.size() / CHANNELS;
+                while (remaining > 0) {
+                    int to_write = (std::min)(coalesced.available(), remaining);
+                    if (to_write > 0) {
+                        memcpy(coalesced.getBuffer(to_write), chunk.data() + (size_t)offset * CHANNELS,
+                               (size_t)to_write * coalesced.blockAlign());
+                        coalesced.releaseBuffer(to_write);
+                        offset += to_write;
+                        remaining -= to_write;
+                        frames += to_write;
+                    }
+                    else {
+                        device.start();
+                        device.waitPeriod(2000);
+                    }
+                }
+            }
+        };
+        play(Clock::now() + std::chrono::milliseconds(500));
+        avio::RealtimeAudit::Counts before = avio::RealtimeAudit::counts();
+        frames = 0;
+        {
+            avio::RealtimeScope scope;
+            play(Clock::now() + std::chrono::seconds(seconds));
+        }
+        counts = audit_delta(before);
+    });
+
+    render.join();
+    running = false;
+    while (!queue.pop().empty()) {}
+    producer.join();
+
+    // the queue copies and locks on every chunk, seeing none means the hooks
+    // stopped counting on this path and the ring result proves nothing
+    bool failed = !counts.allocations || !counts.locks;
+    print_audit("queue (ref)", counts, frames, device.underruns);
+    std::cout << (failed ? "  FAILED: the hooks saw nothing" : "") << std::endl;
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "ring";
+
+    if (mode == "ring") {
+        int chunks = argc > 2 ? std::stoi(argv[2]) : 200000;
+        std::cout << "chunks: " << chunks << " x " << CHUNK_FRAMES << " frames, "
+                  << CHANNELS << " ch flt" << std::endl;
+        int result = bench_ring(chunks);
+        result |= bench_queue(chunks);
+        return result;
+    }
+
+    if (mode == "copy") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 600;
+        std::cout << "seconds of audio: " << seconds << ", fltp 44100 -> flt " << SAMPLE_RATE << std::endl;
+        int result = bench_copy(avio::SwrRender::Copy, seconds);
+        result |= bench_copy(avio::SwrRender::ZeroCopy, seconds);
+        return result;
+    }
+
+    if (mode == "alloc") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 600;
+        return bench_alloc(seconds);
+    }
+
+    if (mode == "sched") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 10;
+        int buffer_ms = argc > 3 ? std::stoi(argv[3]) : 40;
+        int jitter_us = argc > 4 ? std::stoi(argv[4]) : 500;
+        std::cout << "seconds: " << seconds << ", buffer: " << buffer_ms << " ms, period: 10 ms, jitter: "
+                  << jitter_us << " us" << std::endl;
+        int result = bench_sched(avio::RenderScheduler::Polling, seconds, buffer_ms, jitter_us);
+        result |= bench_sched(avio::RenderScheduler::Event, seconds, buffer_ms, jitter_us);
+        return result;
+    }
+
+    if (mode == "latency") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 5;
+        int jitter_us = argc > 3 ? std::stoi(argv[3]) : 2000;
+        std::cout << "seconds: " << seconds << ", period: 10 ms, jitter: " << jitter_us << " us" << std::endl;
+        int result = bench_latency(1000, true, seconds, jitter_us);
+        for (int latency_ms : { 10, 20, 50, 100, 200 })
+            result |= bench_latency(latency_ms, false, seconds, jitter_us);
+        return result;
+    }
+
+    if (mode == "kernels") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 600;
+        std::cout << "seconds of audio: " << seconds << " at " << SAMPLE_RATE << ", "
+#if defined(AVIO_SIMD_AVX2)
+                  << "avx2"
+#elif defined(AVIO_SIMD_SSE2)
+                  << "sse2"
+#else
+                  << "scalar"
+#endif
+                  << std::endl;
+        const AVSampleFormat pairs[][2] = {
+            { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT },
+            { AV_SAMPLE_FMT_S16,  AV_SAMPLE_FMT_FLT },
+            { AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_FLT },
+            { AV_SAMPLE_FMT_S32,  AV_SAMPLE_FMT_FLT },
+            { AV_SAMPLE_FMT_FLT,  AV_SAMPLE_FMT_S16 },
+            { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16 },
+        };
+        int result = 0;
+        for (const auto& pair : pairs) {
+            for (int channels : { 1, 2, 6 })
+                result |= bench_kernel(pair[0], pair[1], channels, seconds);
+        }
+        for (AVSampleFormat in_fmt : { AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_FLTP }) {
+            for (int channels : { 1, 2, 6 })
+                result |= check_s16_edges(in_fmt, channels);
+        }
+        return result;
+    }
+
+    if (mode == "coalesce") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 600;
+        std::cout << "seconds of audio: " << seconds << ", period: 10 ms, " << CHANNELS << " ch flt" << std::endl;
+        int result = 0;
+        for (int frame_size : { 120, 480, 960, 1024, 2880 }) {
+            result |= bench_coalesce(frame_size, false, seconds);
+            result |= bench_coalesce(frame_size, true, seconds);
+        }
+        return result;
+    }
+
+    if (mode == "mix") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 60;
+        std::cout << "seconds of audio: " << seconds << " at " << SAMPLE_RATE << ", " << CHANNELS << " ch flt, "
+#if defined(AVIO_SIMD_AVX2)
+                  << "avx2"
+#elif defined(AVIO_SIMD_SSE2)
+                  << "sse2"
+#else
+                  << "scalar"
+#endif
+                  << std::endl;
+        int result = 0;
+        for (int sources : { 1, 2, 8, 32, 64 })
+            result |= bench_mix(sources, seconds);
+        return result;
+    }
+
+    if (mode == "drift") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 3600;
+        std::vector<double> skews = { -300, -50, 50, 300 };
+        if (argc > 3)
+            skews = { std::stod(argv[3]) };
+        std::cout << "simulated seconds: " << seconds << ", fltp 44100 -> flt " << SAMPLE_RATE
+                  << ", target 150 ms buffered" << std::endl;
+        int result = 0;
+        for (double ppm : skews) {
+            result |= bench_drift(ppm, false, seconds);
+            result |= bench_drift(ppm, true, seconds);
+        }
+        return result;
+    }
+
+    if (mode == "rt") {
+        int seconds = argc > 2 ? std::stoi(argv[2]) : 5;
+#ifdef REALTIME_HOOKS
+        std::cout << "seconds: " << seconds << ", period: 10 ms, jitter: 500 us, allocator and mutex hooks on" << std::endl;
+        if (!audit_self_check()) {
+            std::cout << "FAILED: the hooks saw nothing" << std::endl;
+            return 1;
+        }
+        int result = bench_rt_ring(seconds);
+        result |= bench_rt_queue(seconds);
+        return result;
+#else
+        std::cout << "no allocator hooks in this build (not glibc, or a sanitizer owns malloc), skipped" << std::endl;
+        return 0;
+#endif
+    }
+
+    std::cerr << "Usage: bench_render ring [chunks] | copy [seconds] | alloc [seconds] | sched [seconds] [buffer ms] [jitter us]"
+              << " | latency [seconds] [jitter us] | kernels [seconds] | coalesce [seconds] | mix [seconds]"
+              << " | drift [seconds] [ppm] | rt [seconds]" << std::endl;
+    return -1;
+}
@@ -12,6 +12,7 @@
 #include "Player.hpp"
 #include "Drain.hpp"
 #include "WinAudio.hpp"
+#include "MediaQueue.hpp"
 
 int main(int argc, char* argv[]) {
     try {
@@ -31,9 +32,33 @@ int main(int argc, char* argv[]) {
         avio::Reader reader(filename);
         std::cout << "fornat: " << reader.str_sample_format() << std::endl;
         std::cout << "layout: " << reader.str_channel_layout() << std::endl;
-        avio::Queue<avio::Packet> pkts(128);
-        avio::Queue<avio::Frame> frames(128);
-        avio::Queue<avio::Frame> output(128);
+        // each stage is bounded by playing time and bytes rather than a fixed
+        // 128 items, avio::Queue only counts items so the limits are turned
+        // into a capacity from the stream's frame size
+        avio::QueueLimits packet_limits{ 2000, 4096 * 1024 };
+        avio::QueueLimits frame_limits{ 500, 4096 * 1024 };
+        avio::QueueLimits output_limits{ 200, 4096 * 1024 };
+
+        AVCodecParameters* par = reader.fmt_ctx->streams[reader.audio_stream_index]->codecpar;
+        // raw and broken streams may not report a rate, the device rate is
+        // close enough to size the queues
+        int sample_rate = par->sample_rate > 0 ? par->sample_rate : audio.sampleRate();
+        int frame_samples = par->frame_size > 0 ? par->frame_size : 1024;
+        int64_t frame_us = (int64_t)frame_samples * 1000000 / sample_rate;
+        size_t packet_bytes = par->bit_rate > 0 ? (size_t)(par->bit_rate * frame_us / 8000000) : 0;
+        size_t frame_bytes = (size_t)frame_samples * par->ch_layout.nb_channels
+                           * av_get_bytes_per_sample((AVSampleFormat)par->format);
+        size_t output_bytes = (size_t)frame_samples * audio.blockAlign();
+
+        int packet_capacity = (int)avio::queueCapacity(packet_limits, frame_us, packet_bytes);
+        int frame_capacity = (int)avio::queueCapacity(frame_limits, frame_us, frame_bytes);
+        int output_capacity = (int)avio::queueCapacity(output_limits, frame_us, output_bytes);
+        std::cout << "queues: " << packet_capacity << " packets, " << frame_capacity << " frames, "
+                  << output_capacity << " output frames of " << frame_us / 1000.0 << " ms" << std::endl;
+
+        avio::Queue<avio::Packet> pkts(packet_capacity);
+        avio::Queue<avio::Frame> frames(frame_capacity);
+        avio::Queue<avio::Frame> output(output_capacity);
         reader.audio_pkts = &pkts;
         avio::Decoder decoder(&reader, AVMEDIA_TYPE_AUDIO, &pkts, &frames);
 
@@ -42,12 +67,37 @@ int main(int argc, char* argv[]) {
 
         //std::string arg = "aformat=sample_fmts=flt:channel_layouts=stereo:sample_rates=48000";
         avio::Filter filter(&decoder, audio.getMixFormat(), &frames, &output);
-        audio.input = &output;
+        avio::PcmRing ring(audio.blockAlign(), audio.sampleRate(), 500);
+        audio.ring = &ring;
+
+        // the filter thread moves its own output into the ring, so the
+        // render thread never waits on the queue lock. avio::Queue does not
+        // know the length of its frames, the fill is estimated from the
+        // nominal frame duration
+        auto feed = [&] {
+            avio::Metrics::instance().queue_fill_ms.record(output.size() * frame_us / 1000);
+            while (output.size() > 0) {
+                avio::Frame frame = output.pop();
+                if (frame.is_null()) 
+                    return false;
+                int offset = 0;
+                while (offset < frame.samples()) {
+                    offset += ring.push(frame.data() + offset * ring.blockAlign(), frame.samples() - offset);
+                    if (offset < frame.samples())
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            return true;
+        };
 
         std::thread reader_thread([&] { while (reader.read()) {} });
         std::thread decoder_thread([&] { while (decoder.decode()) {} });
-        std::thread filter_thread([&] { while (filter.filter()) {} });
-        std::thread audio_thread([&] { while (audio.run()) {} });
+        std::thread filter_thread([&] { 
+            while (filter.filter() && feed()) {}
+            feed();
+            ring.close();
+        });
+        std::thread audio_thread([&] { while (audio.run() > 0) {} });
 
         reader_thread.join();
         decoder_thread.join();
@@ -1,12 +1,17 @@
 // wasapi_ffmpeg_player.cpp
 //
 // Build with:
-//   cl /EHsc wasapi_ffmpeg_player.cpp /I<ffmpeg-include> /link /LIBPATH:<ffmpeg-lib> avcodec.lib avformat.lib avutil.lib swresample.lib ole32.lib uuid.lib
+//   cl /EHsc wasapi_ffmpeg_player.cpp /I. /I<ffmpeg-include> /link /LIBPATH:<ffmpeg-lib> avcodec.lib avformat.lib avutil.lib swresample.lib ole32.lib uuid.lib
 
 #include <windows.h>
 #include <audioclient.h>
 #include <mmdeviceapi.h>
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -14,51 +19,168 @@ extern "C" {
 #include <libswresample/swresample.h>
 }
 
+#include "AudioSink.hpp"
+#include "SwrRender.hpp"
+#include "CoalescingSink.hpp"
+#include "Playlist.hpp"
+#include "Mixer.hpp"
+#include "WorkerPool.hpp"
+#include "StreamInfoCache.hpp"
+#include "LatencyController.hpp"
+#include "PlaybackClock.hpp"
+#include "Trace.hpp"
+#include "Realtime.hpp"
+#include "Metrics.hpp"
+
 #define EXIT_ON_ERROR(hr, msg) if (FAILED(hr)) { std::cerr << msg << " hr=0x" << std::hex << hr << std::endl; return -1; }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: wasapi_ffmpeg_player <audiofile>" << std::endl;
-        return -1;
+// The shared mode render client seen through the portable sink interface,
+// available() only offers room up to the latency controller's fill target.
+// The position comes from IAudioClock when the client offers one. Failing
+// GetBuffer / ReleaseBuffer calls are counted in status, main reports them.
+
+class WasapiSink : public avio::AudioSink {
+public:
+    IAudioClient* pAudioClient;
+    IAudioRenderClient* pRenderClient;
+    WAVEFORMATEX* pwfx;
+    UINT32 bufferFrameCount;
+    avio::LatencyController* latency = nullptr;
+    IAudioClock* pAudioClock = nullptr;
+    uint64_t written = 0;
+    bool started = false;
+    avio::RenderStatus status;
+
+    WasapiSink(IAudioClient* client, IAudioRenderClient* render, WAVEFORMATEX* format, UINT32 frames) :
+        pAudioClient(client), pRenderClient(render), pwfx(format), bufferFrameCount(frames) { }
+
+    int sampleRate() const override { return pwfx->nSamplesPerSec; }
+    int channels() const override { return pwfx->nChannels; }
+    int blockAlign() const override { return pwfx->nBlockAlign; }
+    int bufferFrames() const override { return bufferFrameCount; }
+
+    int padding() {
+        UINT32 numFramesPadding = 0;
+        if (FAILED(pAudioClient->GetCurrentPadding(&numFramesPadding)))
+            return bufferFrameCount;
+        return numFramesPadding;
     }
 
-    const char* filename = argv[1];
+    int available() override {
+        int target = latency ? latency->target() : bufferFrameCount;
+        return max(0, target - padding());
+    }
 
-    // -------- FFmpeg: open file --------
-    AVFormatContext* fmt_ctx = nullptr;
-    if (avformat_open_input(&fmt_ctx, filename, nullptr, nullptr) < 0) {
-        std::cerr << "Failed to open input file" << std::endl;
-        return -1;
+    void start() override {
+        if (started) return;
+        pAudioClient->Start();
+        started = true;
     }
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
-        std::cerr << "Failed to find stream info" << std::endl;
-        return -1;
+
+    uint8_t* getBuffer(int frames) override {
+        BYTE* pData = nullptr;
+        HRESULT hr = pRenderClient->GetBuffer(frames, &pData);
+        if (FAILED(hr)) {
+            status.fail(avio::RENDER_DEVICE_BUFFER, hr);
+            return nullptr;
+        }
+        return pData;
     }
 
-    int stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
-    if (stream_index < 0) {
-        std::cerr << "Failed to find audio stream" << std::endl;
-        return -1;
+    // frames the device did not accept are not counted as played
+    void releaseBuffer(int frames) override {
+        HRESULT hr = pRenderClient->ReleaseBuffer(frames, 0);
+        if (FAILED(hr)) {
+            status.fail(avio::RENDER_DEVICE_RELEASE, hr);
+            return;
+        }
+        written += frames;
+        rendered(frames);
     }
 
-    AVStream* audio_stream = fmt_ctx->streams[stream_index];
-    const AVCodec* codec = avcodec_find_decoder(audio_stream->codecpar->codec_id);
-    if (!codec) {
-        std::cerr << "Decoder not found" << std::endl;
-        return -1;
+    // device units scaled to frames, the QPC time of the reading comes in
+    // 100 ns units on the same base as steady_clock
+    bool devicePosition(avio::DevicePosition& position) override {
+        UINT64 frequency = 0, device = 0, qpc = 0;
+        if (!pAudioClock || FAILED(pAudioClock->GetFrequency(&frequency)) || !frequency
+            || FAILED(pAudioClock->GetPosition(&device, &qpc)))
+            return false;
+        position.played = device * pwfx->nSamplesPerSec / frequency;
+        position.queued = written > position.played ? (int)(written - position.played) : 0;
+        position.time_us = (int64_t)(qpc / 10);
+        return true;
     }
+};
 
-    AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
-    if (!codec_ctx) return -1;
-    if (avcodec_parameters_to_context(codec_ctx, audio_stream->codecpar) < 0) {
-        std::cerr << "Failed to copy codec parameters" << std::endl;
-        return -1;
+int main(int argc, char* argv[]) {
+    avio::SwrRender::Mode mode = avio::SwrRender::ZeroCopy;
+    bool event_driven = true;
+    bool coalesce = true;
+    int latency_ms = 100;
+    int verbose = avio::LOG_QUIET;
+    bool fast_open = false;
+    bool mmap = false;
+    bool mix = false;
+    std::string trace_path;
+    std::unique_ptr<avio::StreamInfoCache> cache;
+    int arg = 1;
+    for (; arg < argc && !strncmp(argv[arg], "--", 2); arg++) {
+        if (!strcmp(argv[arg], "--copy")) {
+            mode = avio::SwrRender::Copy;
+        }
+        else if (!strcmp(argv[arg], "--poll")) {
+            event_driven = false;
+        }
+        else if (!strcmp(argv[arg], "--no-coalesce")) {
+            coalesce = false;
+        }
+        else if (!strcmp(argv[arg], "--latency") && arg + 1 < argc) {
+            latency_ms = avio::LatencyController::clampLatency(atoi(argv[++arg]));
+        }
+        else if (!strcmp(argv[arg], "--verbose") && arg + 1 < argc) {
+            verbose = atoi(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--fast-open")) {
+            fast_open = true;
+        }
+        else if (!strcmp(argv[arg], "--mmap")) {
+            mmap = true;
+        }
+        else if (!strcmp(argv[arg], "--mix")) {
+            mix = true;
+        }
+        else if (!strcmp(argv[arg], "--cache") && arg + 1 < argc) {
+            cache.reset(new avio::StreamInfoCache(argv[++arg]));
+        }
+        else if (!strcmp(argv[arg], "--trace") && arg + 1 < argc) {
+            trace_path = argv[++arg];
+        }
+        else {
+            std::cerr << "Unknown option " << argv[arg] << std::endl;
+            return -1;
+        }
     }
-    if (avcodec_open2(codec_ctx, codec, nullptr) < 0) {
-        std::cerr << "Failed to open codec" << std::endl;
+
+    if (argc <= arg) {
+        std::cerr << "Usage: wasapi_ffmpeg_player [--copy] [--poll] [--no-coalesce] [--latency ms] [--verbose 0-2] [--fast-open] [--cache dir] [--mmap] [--mix] [--trace file] <audiofile> [audiofile...]" << std::endl;
         return -1;
     }
 
+    avio::Metrics& metrics = avio::Metrics::instance();
+    metrics.level = verbose;
+
+    // -------- FFmpeg: playlist --------
+    // the files play back to back without a gap, while one plays the next is
+    // opened and decoded ahead on a background thread. --fast-open bounds the
+    // probing, --cache keeps what probing found so the next launch skips it,
+    // --mmap reads local files from a memory mapping. With --mix the files
+    // play all at once through the Mixer instead
+    std::vector<std::string> files(argv + arg, argv + argc);
+    avio::Playlist playlist(files);
+    playlist.open_options = fast_open ? avio::OpenOptions::fast() : avio::OpenOptions();
+    playlist.open_options.cache = cache.get();
+    playlist.open_options.mmap = mmap;
+
     // -------- WASAPI: setup --------
     HRESULT hr;
     CoInitializeEx(nullptr, COINIT_MULTITHREADED);
@@ -89,11 +211,8 @@ int main(int argc, char* argv[]) {
               << std::endl;
 
     // -------- FFmpeg SwrContext: match WASAPI mix format --------
-    SwrContext* swr = nullptr;
-
-    AVChannelLayout out_ch_layout;
-    av_channel_layout_default(&out_ch_layout, pwfx->nChannels);
-
+    // set up per track by SwrRender::reconfigure, which uses a SIMD format
+    // kernel instead of swr when rate and layout already match
     AVSampleFormat out_sample_fmt;
     if (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
         WAVEFORMATEXTENSIBLE* wfex = (WAVEFORMATEXTENSIBLE*)pwfx;
@@ -110,33 +229,28 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    if (swr_alloc_set_opts2(
-            &swr,
-            &out_ch_layout,                       // output layout (WASAPI mix)
-            out_sample_fmt,                       // output format
-            pwfx->nSamplesPerSec,                 // output sample rate
-            &codec_ctx->ch_layout,                // input layout
-            codec_ctx->sample_fmt,                // input format
-            codec_ctx->sample_rate,               // input sample rate
-            0, nullptr) < 0)
-    {
-        std::cerr << "Failed to initialize SwrContext" << std::endl;
-        return -1;
-    }
-    if (swr_init(swr) < 0) {
-        std::cerr << "Failed to swr_init()" << std::endl;
-        return -1;
-    }
-
     // -------- WASAPI Initialize --------
+    // the buffer is twice the latency target so the controller has room to grow
     hr = pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
-                                  0,
-                                  10000000, // 1 second buffer
+                                  event_driven ? AUDCLNT_STREAMFLAGS_EVENTCALLBACK : 0,
+                                  (REFERENCE_TIME)latency_ms * 2 * 10000,
                                   0,
                                   pwfx,
                                   nullptr);
     EXIT_ON_ERROR(hr, "Failed to initialize audio client");
 
+    // the device signals hEvent each time a period has been consumed
+    HANDLE hEvent = nullptr;
+    if (event_driven) {
+        hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!hEvent) {
+            std::cerr << "CreateEvent failed" << std::endl;
+            return -1;
+        }
+        hr = pAudioClient->SetEventHandle(hEvent);
+        EXIT_ON_ERROR(hr, "SetEventHandle failed");
+    }
+
     UINT32 bufferFrameCount;
     hr = pAudioClient->GetBufferSize(&bufferFrameCount);
     EXIT_ON_ERROR(hr, "GetBufferSize failed");
@@ -144,94 +258,153 @@ int main(int argc, char* argv[]) {
     hr = pAudioClient->GetService(__uuidof(IAudioRenderClient), (void**)&pRenderClient);
     EXIT_ON_ERROR(hr, "GetService failed");
 
-    // Pre-roll: fill the buffer before Start()
-    {
-        BYTE* pData = nullptr;
-        hr = pRenderClient->GetBuffer(bufferFrameCount, &pData);
-        if (SUCCEEDED(hr)) {
-            memset(pData, 0, bufferFrameCount * pwfx->nBlockAlign); // silence
-            pRenderClient->ReleaseBuffer(bufferFrameCount, 0);
-        }
-    }
+    // only for the playback position, playback works without it
+    IAudioClock* pAudioClock = nullptr;
+    if (FAILED(pAudioClient->GetService(__uuidof(IAudioClock), (void**)&pAudioClock)))
+        pAudioClock = nullptr;
 
-    hr = pAudioClient->Start();
-    EXIT_ON_ERROR(hr, "Start failed");
+    REFERENCE_TIME hnsDevicePeriod = 0;
+    hr = pAudioClient->GetDevicePeriod(&hnsDevicePeriod, nullptr);
+    EXIT_ON_ERROR(hr, "GetDevicePeriod failed");
 
+    // No silence pre-roll, the client is started once the first decoded
+    // audio has filled the buffer up to the latency target
     // -------- Decode + Play loop --------
-    AVPacket* pkt = av_packet_alloc();
+    // swr writes straight into the GetBuffer region unless --copy is given,
+    // the sink, resampler and device stay up across the tracks
     AVFrame* frame = av_frame_alloc();
 
-    while (av_read_frame(fmt_ctx, pkt) >= 0) {
-        if (pkt->stream_index == stream_index) {
-            if (avcodec_send_packet(codec_ctx, pkt) >= 0) {
-                while (avcodec_receive_frame(codec_ctx, frame) >= 0) {
-                    // Convert with swr
-                    uint8_t* out_data[2] = { nullptr };
-                    int out_linesize = 0;
-                    int out_samples = av_rescale_rnd(
-                        swr_get_delay(swr, codec_ctx->sample_rate) + frame->nb_samples,
-                        pwfx->nSamplesPerSec,
-                        codec_ctx->sample_rate,
-                        AV_ROUND_UP);
-
-                    av_samples_alloc(out_data, &out_linesize, pwfx->nChannels,
-                                     out_samples, out_sample_fmt, 1);
-
-                    int converted = swr_convert(swr, out_data, out_samples,
-                                                (const uint8_t**)frame->data, frame->nb_samples);
-
-                    std::cout << "Converted: " << converted << " frames" << std::endl;
-
-                    if (converted > 0) {
-                        UINT32 numFramesPadding = 0;
-                        pAudioClient->GetCurrentPadding(&numFramesPadding);
-                        UINT32 numFramesAvailable = bufferFrameCount - numFramesPadding;
-
-                        std::cout << "Available: " << numFramesAvailable << " frames" << std::endl;
-
-                        int offset = 0;
-                        while (converted > 0) {
-                            pAudioClient->GetCurrentPadding(&numFramesPadding);
-                            numFramesAvailable = bufferFrameCount - numFramesPadding;
-
-                            int toWrite = min((int)numFramesAvailable, converted);
-                            if (toWrite > 0) {
-                                BYTE* pData = nullptr;
-                                hr = pRenderClient->GetBuffer(toWrite, &pData);
-                                if (SUCCEEDED(hr)) {
-                                    memcpy(pData,
-                                           out_data[0] + offset * pwfx->nBlockAlign,
-                                           toWrite * pwfx->nBlockAlign);
-                                    pRenderClient->ReleaseBuffer(toWrite, 0);
-                                    offset += toWrite;
-                                    converted -= toWrite;
-                                }
-                            } else {
-                                Sleep(5); // wait for buffer space
-                            }
-                        }
-                    }
-
-                    av_freep(&out_data[0]);
-                }
+    // decoded frames are packed into device periods unless --no-coalesce is
+    // given, so small Opus frames do not cost a GetBuffer/ReleaseBuffer each
+    int period_frames = (int)(hnsDevicePeriod * pwfx->nSamplesPerSec / 10000000);
+    WasapiSink sink(pAudioClient, pRenderClient, pwfx, bufferFrameCount);
+    avio::LatencyController latency(pwfx->nSamplesPerSec, period_frames, bufferFrameCount, latency_ms);
+    sink.latency = &latency;
+    sink.pAudioClock = pAudioClock;
+    avio::PlaybackClock clock(&sink);
+    avio::CoalescingSink coalesced(&sink, period_frames);
+    avio::AudioSink* device = coalesce ? (avio::AudioSink*)&coalesced : &sink;
+    avio::SwrRender render(nullptr, device, out_sample_fmt, 0, mode);
+    auto wait = [&] { // wait for buffer space
+        if (!sink.started) {
+            sink.start();
+            return;
+        }
+        if (event_driven)
+            WaitForSingleObject(hEvent, 2000);
+        else
+            Sleep(5);
+        latency.observe(sink.padding(), false);
+        clock.update();
+    };
+
+    // counters only on the hot path, the reporter prints them from its own thread
+    avio::MetricsReporter reporter(1000);
+
+    // --trace records stage spans, device padding and underruns until the end
+    // of playback into a Chrome trace, for chrome://tracing or ui.perfetto.dev
+    if (!trace_path.empty()) {
+        avio::Tracer::instance().start();
+        AVIO_TRACE_THREAD("render");
+    }
+
+    if (mix) {
+        // sources decode on the pool, this thread only sums periods into the
+        // device. Until the device starts mix() waits for every source like
+        // offline, so playback does not begin with underruns.
+        avio::WorkerPool pool;
+        avio::Mixer mixer(device, out_sample_fmt, &pool, (int)files.size(), latency_ms);
+        for (const std::string& file : files) {
+            try {
+                mixer.add(file, 1.0f, playlist.open_options);
+            }
+            catch (const std::exception& e) {
+                std::cerr << file << ": " << e.what() << std::endl;
             }
         }
-        av_packet_unref(pkt);
+        while (mixer.count() && !mixer.finished()) {
+            mixer.offline = !sink.started;
+            if (mixer.mix())
+                continue;
+            if (!sink.started && device->available() > 0)
+                Sleep(1);
+            else
+                wait();
+        }
+        coalesced.flush();
+        sink.start();
+        for (int i = 0; i < mixer.count(); i++) {
+            avio::MixerSource* source = mixer.source(i);
+            if (!source->error.empty())
+                std::cerr << source->filename << ": " << source->error << std::endl;
+            AVIO_LOG(avio::LOG_INFO, source->filename << ": " << source->underruns << " underruns");
+        }
+        AVIO_LOG(avio::LOG_INFO, "mixed: " << mixer.periods << " periods on " << pool.size() << " workers");
+    }
+
+    size_t track = files.size();
+    avio::StageTimer decode_timer;
+    while (!mix && playlist.next(frame) > 0) {
+        metrics.decoder_latency_us.record(decode_timer.us());
+        if (render.reconfigure(&frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate, wait) < 0) {
+            std::cerr << "Failed to initialize SwrContext" << std::endl;
+            break;
+        }
+        if (playlist.trackIndex() != track) {
+            track = playlist.trackIndex();
+            AVIO_LOG(avio::LOG_INFO, "Track " << track + 1 << ": " << files[track]
+                     << ", conversion: " << (render.kernel ? "format kernel" : "swr"));
+        }
+        int converted = render.render((const uint8_t**)frame->extended_data, frame->nb_samples, wait);
+        AVIO_LOG(avio::LOG_DEBUG, "Converted: " << converted << " frames, position " << clock.seconds() << " s");
+        decode_timer = avio::StageTimer();
+    }
+    render.render(nullptr, 0, wait);
+    coalesced.flush();
+    sink.start();
+
+    if (!trace_path.empty()) {
+        avio::Tracer& tracer = avio::Tracer::instance();
+        tracer.stop();
+        if (!tracer.write(trace_path))
+            std::cerr << "Cannot write trace " << trace_path << std::endl;
+        AVIO_LOG(avio::LOG_INFO, "trace: " << tracer.events() << " events, " << tracer.overwritten() << " overwritten");
+    }
+
+    if (!sink.status.ok()) {
+        std::cerr << "device errors: " << sink.status.count(avio::RENDER_DEVICE_BUFFER) << " GetBuffer, "
+                  << sink.status.count(avio::RENDER_DEVICE_RELEASE) << " ReleaseBuffer, first "
+                  << avio::RenderStatus::message(sink.status.first())
+                  << " hr=0x" << std::hex << (uint32_t)sink.status.firstDetail() << std::dec << std::endl;
+    }
+
+    clock.update();
+    AVIO_LOG(avio::LOG_INFO, "device clock: " << clock.seconds() << " s played, " << clock.ppm() << " ppm against the system clock");
+    AVIO_LOG(avio::LOG_INFO, "fill target: " << latency.target() << " frames, "
+             << "rendered: " << render.stats.bytes_rendered << " bytes, "
+             << "copied: " << render.stats.bytes_copied << " bytes\n" << metrics.report());
+    for (const avio::Playlist::TrackStats& t : playlist.stats) {
+        if (mix)
+            break;
+        if (!t.error.empty())
+            std::cerr << t.filename << ": " << t.error << std::endl;
+        if (!t.prefetch_error.empty())
+            std::cerr << t.filename << ": prefetch failed, decoded at the boundary: " << t.prefetch_error << std::endl;
+        AVIO_LOG(avio::LOG_INFO, t.filename << ": first frame " << t.first_frame_ms << " ms" << (t.cache_hit ? " (cached)" : "") << ", boundary "
+                 << t.boundary_ms << " ms, trimmed " << t.trimmed_start << "/" << t.trimmed_end);
     }
 
     // -------- Cleanup --------
     pAudioClient->Stop();
-    swr_free(&swr);
     av_frame_free(&frame);
-    av_packet_free(&pkt);
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
 
+    if (pAudioClock) pAudioClock->Release();
     if (pRenderClient) pRenderClient->Release();
     if (pAudioClient) pAudioClient->Release();
     if (pDevice) pDevice->Release();
     if (pEnumerator) pEnumerator->Release();
     CoTaskMemFree(pwfx);
+    if (hEvent) CloseHandle(hEvent);
     CoUninitialize();
 
     return 0;